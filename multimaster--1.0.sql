@@ -11,7 +11,7 @@ END
 $$;
 
 -- message queue receiver, for internal use only
-CREATE FUNCTION mtm.dmq_receiver_loop(sender_name text, recv_timeout int) RETURNS void
+CREATE FUNCTION mtm.dmq_receiver_loop(sender_name text, recv_timeout int, lane int DEFAULT 0) RETURNS void
 AS 'MODULE_PATHNAME','dmq_receiver_loop'
 LANGUAGE C;
 
@@ -508,6 +508,38 @@ CREATE VIEW mtm.stat_bgwpool AS
 			ReceiverName
 	FROM mtm.node_bgwpool_stat();
 
+CREATE FUNCTION mtm.receivers_memory(OUT node_id int, OUT buffered_bytes bigint)
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME','mtm_get_receivers_memory'
+  LANGUAGE C;
+
+CREATE VIEW mtm.stat_receivers_memory AS
+	SELECT	node_id,
+			buffered_bytes
+	FROM mtm.receivers_memory();
+
+CREATE FUNCTION mtm.commit_phases(OUT phase text, OUT node_id int,
+								  OUT calls bigint, OUT total_ms float8,
+								  OUT p50_ms float8, OUT p99_ms float8,
+								  OUT histogram bigint[])
+  RETURNS SETOF record
+  AS 'MODULE_PATHNAME','mtm_get_commit_phases'
+  LANGUAGE C;
+
+CREATE VIEW mtm.stat_commit_phases AS
+	SELECT	phase,
+			node_id,
+			calls,
+			total_ms,
+			p50_ms,
+			p99_ms,
+			histogram
+	FROM mtm.commit_phases();
+
+CREATE FUNCTION mtm.stat_commit_phases_reset() RETURNS void
+  AS 'MODULE_PATHNAME','mtm_reset_commit_phases'
+  LANGUAGE C;
+
 -- select mtm.alter_sequences();
 
 CREATE FUNCTION mtm.get_logged_prepared_xact_state(gid text) RETURNS text
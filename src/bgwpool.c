@@ -367,19 +367,82 @@ BgwStartExtraWorker(BgwPool *poolDesc)
 }
 
 /*
- * Blocking push of message (work size field + ctx + work) into the MTM
- * Executor queue. A circular buffer is used; receiver pushes the whole
- * message in one go and worker reads it out similarly. We never wrap messages
- * around the queue end, so max work size is half of the queue len -- larger
- * jobs must go via file.
+ * Push message (work size field + ctx + work) into the MTM Executor queue if
+ * it fits there. A circular buffer is used; receiver pushes the whole message
+ * in one go and worker reads it out similarly. We never wrap messages around
+ * the queue end, so max work size is half of the queue len -- larger jobs
+ * must go via file.
+ *
+ * Must be called with pool lock held.
+ */
+static bool
+bgwpool_put(BgwPool *poolDesc, void *work, int size)
+{
+	int			txlist_pos;
+
+	/*
+	 * If queue is not wrapped through the end of buffer (head <= tail) we can
+	 * fit message either to the end (between tail and pool->size) or to the
+	 * beginning (between queue beginning and head). In both cases we can fit
+	 * size word after the tail. If queue is wrapped through the end of buffer
+	 * (tail < head) we can fit message only between head and tail.
+	 */
+	if (!(((poolDesc->head <= poolDesc->tail &&
+			(poolDesc->size - poolDesc->tail >= MSGLEN(size) ||
+			 poolDesc->head >= MSGLEN(size) - sizeof(int))) ||
+		   (poolDesc->head > poolDesc->tail &&
+			poolDesc->head - poolDesc->tail >= MSGLEN(size))) &&
+		  /*
+		   * This should normally be always true: during normal work we can' t
+		   * get more than max_connections xacts because sender should wait
+		   * for us, and during recovery bgwpool is not used at all. But there
+		   * is no strict guarantee of course, and so better be safe about
+		   * transitions between these states.
+		   */
+		  (poolDesc->txlist.nelems < poolDesc->txlist.size)))
+		return false;
+
+	txlist_pos = txl_store(&poolDesc->txlist, 1);
+
+	if (poolDesc->txlist.nelems > poolDesc->nWorkers)
+		BgwStartExtraWorker(poolDesc);
+
+	/*
+	 * We always have free space for size at tail, as everything is
+	 * int-aligned and when pool->tail becomes equal to pool->size it is
+	 * switched to zero.
+	 */
+	*(int *) &queue[poolDesc->tail] = size;
+
+	if (poolDesc->size - poolDesc->tail >= MSGLEN(size))
+	{
+		*((int *) &queue[poolDesc->tail + sizeof(int)]) = txlist_pos;
+		memcpy(&queue[poolDesc->tail + 2 * sizeof(int)], work, size);
+		poolDesc->tail += MSGLEN(size);
+	}
+	else
+	{
+		/* Message can't fit into the end of queue. */
+		*((int *) queue) = txlist_pos;
+		memcpy(&queue[sizeof(int)], work, size);
+		poolDesc->tail = MSGLEN(size) - sizeof(int);
+	}
+
+	if (poolDesc->tail == poolDesc->size)
+		poolDesc->tail = 0;
+
+	ConditionVariableSignal(&poolDesc->available_cv);
+	return true;
+}
+
+/*
+ * Blocking push of work into the pool queue.
  *
  * After return from routine work and ctx buffers can be reused safely.
  */
 void
 BgwPoolExecute(BgwPool *poolDesc, void *work, int size, MtmReceiverWorkerContext *rwctx)
 {
-	int			txlist_pos;
-
 	Assert(poolDesc != NULL);
 	Assert(queue != NULL);
 	Assert(MSGLEN(size) <= poolDesc->size);
@@ -401,77 +464,49 @@ BgwPoolExecute(BgwPool *poolDesc, void *work, int size, MtmReceiverWorkerContext
 		LWLockAcquire(&poolDesc->lock, LW_EXCLUSIVE);
 	}
 
-	while (!ProcDiePending)
+	while (!ProcDiePending && !bgwpool_put(poolDesc, work, size))
 	{
-		/*
-		 * If queue is not wrapped through the end of buffer (head <= tail) we
-		 * can fit message either to the end (between tail and pool->size) or
-		 * to the beginning (between queue beginning and head). In both cases
-		 * we can fit size word after the tail. If queue is wrapped through
-		 * the end of buffer (tail < head) we can fit message only between
-		 * head and tail.
-		 */
-		if (((poolDesc->head <= poolDesc->tail &&
-			 (poolDesc->size - poolDesc->tail >= MSGLEN(size) ||
-			  poolDesc->head >= MSGLEN(size) - sizeof(int))) ||
-			(poolDesc->head > poolDesc->tail &&
-			 poolDesc->head - poolDesc->tail >= MSGLEN(size))) &&
-			/*
-			 * This should normally be always true: during normal work we can'
-			 * t get more than max_connections xacts because sender should
-			 * wait for us, and during recovery bgwpool is not used at all.
-			 * But there is no strict guarantee of course, and so better be
-			 * safe about transitions between these states.
-			 */
-			(poolDesc->txlist.nelems < poolDesc->txlist.size))
-		{
-			txlist_pos = txl_store(&poolDesc->txlist, 1);
+		poolDesc->producerBlocked = true;
+		/* It is critical that the sleep preparation will stay here */
+		ConditionVariablePrepareToSleep(&poolDesc->overflow_cv);
+		LWLockRelease(&poolDesc->lock);
 
-			if (poolDesc->txlist.nelems > poolDesc->nWorkers)
-				BgwStartExtraWorker(poolDesc);
+		if (!ProcDiePending)
+			ConditionVariableSleep(&poolDesc->overflow_cv, PG_WAIT_EXTENSION);
 
-			/*
-			 * We always have free space for size at tail, as everything is
-			 * int-aligned and when pool->tail becomes equal to pool->size it
-			 * is switched to zero.
-			 */
-			*(int *) &queue[poolDesc->tail] = size;
-
-			if (poolDesc->size - poolDesc->tail >= MSGLEN(size))
-			{
-				*((int *) &queue[poolDesc->tail + sizeof(int)]) = txlist_pos;
-				memcpy(&queue[poolDesc->tail + 2 * sizeof(int)], work, size);
-				poolDesc->tail += MSGLEN(size);
-			}
-			else
-			{
-				/* Message can't fit into the end of queue. */
-				*((int *) queue) = txlist_pos;
-				memcpy(&queue[sizeof(int)], work, size);
-				poolDesc->tail = MSGLEN(size) - sizeof(int);
-			}
-
-			if (poolDesc->tail == poolDesc->size)
-				poolDesc->tail = 0;
-
-			ConditionVariableSignal(&poolDesc->available_cv);
-			break;
-		}
-		else
-		{
-			poolDesc->producerBlocked = true;
-			/* It is critical that the sleep preparation will stay here */
-			ConditionVariablePrepareToSleep(&poolDesc->overflow_cv);
-			LWLockRelease(&poolDesc->lock);
+		ConditionVariableCancelSleep();
+		LWLockAcquire(&poolDesc->lock, LW_EXCLUSIVE);
+	}
+	LWLockRelease(&poolDesc->lock);
+}
 
-			if (!ProcDiePending)
-				ConditionVariableSleep(&poolDesc->overflow_cv, PG_WAIT_EXTENSION);
+/*
+ * Non-blocking version of BgwPoolExecute: returns false if work doesn't fit
+ * into the queue (or pool is held by join). In that case we are already
+ * prepared to sleep on the cv which will be signalled once it is worth
+ * retrying, so caller may wait on its latch along with other events and must
+ * ConditionVariableCancelSleep afterwards.
+ */
+bool
+BgwPoolTryExecute(BgwPool *poolDesc, void *work, int size, MtmReceiverWorkerContext *rwctx)
+{
+	bool		res = false;
 
-			ConditionVariableCancelSleep();
-			LWLockAcquire(&poolDesc->lock, LW_EXCLUSIVE);
-		}
+	Assert(poolDesc != NULL);
+	Assert(queue != NULL);
+	Assert(MSGLEN(size) <= poolDesc->size);
+
+	LWLockAcquire(&poolDesc->lock, LW_EXCLUSIVE);
+	if (poolDesc->n_holders > 0)
+		ConditionVariablePrepareToSleep(&Mtm->receiver_barrier_cv);
+	else if (!(res = bgwpool_put(poolDesc, work, size)))
+	{
+		poolDesc->producerBlocked = true;
+		ConditionVariablePrepareToSleep(&poolDesc->overflow_cv);
 	}
 	LWLockRelease(&poolDesc->lock);
+
+	return res;
 }
 
 /*
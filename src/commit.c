@@ -26,6 +26,8 @@
 #include "postmaster/autovacuum.h"
 #include "libpq/pqformat.h"
 #include "pgstat.h"
+#include "port/pg_bitutils.h"
+#include "portability/instr_time.h"
 #include "storage/ipc.h"
 
 #include "multimaster.h"
@@ -53,6 +55,8 @@ static struct MtmCommitState
 	char gid[GIDSIZE];
 	GlobalTx *gtx;
 	bool	inside_commit_sequence;
+	/* plain commit in referee gen is ongoing, we hold PB till its end */
+	bool	direct_commit;
 	MemoryContext mctx;
 } mtm_commit_state;
 
@@ -105,6 +109,16 @@ MtmXactCallback(XactEvent event, void *arg)
 			}
 			break;
 
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+			/* commit record of direct commit is written (or xact failed) */
+			if (mtm_commit_state.direct_commit)
+			{
+				mtm_commit_state.direct_commit = false;
+				ReleasePB();
+			}
+			break;
+
 		default:
 			break;
 	}
@@ -330,6 +344,58 @@ MtmGidParseXid(const char *gid)
 	return xid;
 }
 
+/*
+ * Commit phases timing for mtm.stat_commit_phases. Phase being timed is
+ * started with MtmPhaseStart; local phases are finished with
+ * MtmPhaseStopLocal, and while collecting acks the gather hooks account each
+ * one as it arrives.
+ */
+static MtmCommitPhase timed_phase = MTM_N_COMMIT_PHASES; /* none */
+static instr_time timed_phase_start;
+
+static void
+MtmPhaseStart(MtmCommitPhase phase)
+{
+	timed_phase = phase;
+	INSTR_TIME_SET_CURRENT(timed_phase_start);
+}
+
+static void
+MtmPhaseAccount(int node_id)
+{
+	instr_time	elapsed;
+	uint64		us;
+	int			bucket;
+	MtmPhaseStat *stat;
+
+	if (timed_phase == MTM_N_COMMIT_PHASES)
+		return;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, timed_phase_start);
+	us = INSTR_TIME_GET_MICROSEC(elapsed);
+	bucket = us == 0 ? 0 : pg_leftmost_one_pos64(us) + 1;
+	bucket = Min(bucket, MTM_PHASE_HIST_BUCKETS - 1);
+
+	stat = &Mtm->commit_phases[timed_phase][node_id - 1];
+	pg_atomic_fetch_add_u64(&stat->total_us, us);
+	pg_atomic_fetch_add_u64(&stat->hist[bucket], 1);
+}
+
+static void
+MtmPhaseStop(void)
+{
+	timed_phase = MTM_N_COMMIT_PHASES;
+}
+
+/* local phase is done */
+static void
+MtmPhaseStopLocal(void)
+{
+	MtmPhaseAccount(mtm_cfg->my_node_id);
+	MtmPhaseStop();
+}
+
 /* ensure we get the right PREPARE ack */
 static bool
 PrepareGatherHook(MtmMessage *anymsg, Datum arg)
@@ -337,9 +403,10 @@ PrepareGatherHook(MtmMessage *anymsg, Datum arg)
 	MtmPrepareResponse *msg = (MtmPrepareResponse *) anymsg;
 	TransactionId xid = DatumGetTransactionId(arg);
 
-	if (anymsg->tag != T_MtmPrepareResponse)
+	if (anymsg->tag != T_MtmPrepareResponse || msg->xid != xid)
 		return false;
-	return msg->xid == xid;
+	MtmPhaseAccount(msg->node_id);
+	return true;
 }
 
 /* ensure we get the right 2A response */
@@ -349,11 +416,84 @@ Paxos2AGatherHook(MtmMessage *anymsg, Datum arg)
 	Mtm2AResponse *msg = (Mtm2AResponse *) anymsg;
 	char *gid = DatumGetPointer(arg);
 
-	if (anymsg->tag != T_Mtm2AResponse)
+	if (anymsg->tag != T_Mtm2AResponse || strcmp(msg->gid, gid) != 0)
+		return false;
+	MtmPhaseAccount(msg->node_id);
+	return true;
+}
+
+
+static bool
+Paxos2BGood(Mtm2AResponse *msg)
+{
+	return term_cmp(msg->accepted_term, (GlobalTxTerm) {1, 0}) == 0 &&
+		msg->status == GTXPreCommitted;
+}
+
+/*
+ * Commit acks come in the same stream and message type as 2B; stragglers'
+ * 2B acks we didn't wait for may arrive here first, skip them.
+ */
+static bool
+CommitAckGatherHook(MtmMessage *anymsg, Datum arg)
+{
+	Mtm2AResponse *msg = (Mtm2AResponse *) anymsg;
+	char *gid = DatumGetPointer(arg);
+
+	if (anymsg->tag != T_Mtm2AResponse || strcmp(msg->gid, gid) != 0 ||
+		msg->status != GTXCommitted)
 		return false;
-	return strcmp(msg->gid, gid) == 0;
+	MtmPhaseAccount(msg->node_id);
+	return true;
 }
 
+/* stop collecting 2B acks once we have majority of good ones */
+static bool
+Paxos2BQuorumHook(MtmMessage **messages, int msg_count, Datum arg)
+{
+	int			n_configured = DatumGetInt32(arg);
+	int			nvotes = 1; /* myself */
+	int			i;
+
+	for (i = 0; i < msg_count; i++)
+	{
+		if (Paxos2BGood((Mtm2AResponse *) messages[i]))
+			nvotes++;
+	}
+	return Quorum(n_configured, nvotes);
+}
+
+/*
+ * If we are online alone in referee gen, there is nobody to agree with, so
+ * the xact can be committed directly without PREPARE and state_3pc: resolver
+ * never sees it and peer gets it as plain commit during recovery. Returns
+ * true in this case, leaving PB acquired until commit record is written to
+ * keep gen switch (and thus ParallelSafe) ordered after it, like PREPAREs.
+ */
+static bool
+MtmTryDirectCommit(void)
+{
+	MtmGeneration gen;
+
+	if (mtm_commit_state.direct_commit)
+		return true;
+
+	AcquirePBByPreparer(true);
+	if (MtmGetCurrentStatusInGen() == MTM_GEN_ONLINE)
+	{
+		gen = MtmGetCurrentGen(true);
+		if (IS_REFEREE_GEN(gen.members, gen.configured))
+		{
+			mtm_commit_state.direct_commit = true;
+			mtm_log(MtmTxTrace, "xid " XID_FMT " is committed directly in referee gen num=" UINT64_FORMAT,
+					GetTopTransactionIdIfAny(), gen.num);
+			return true;
+		}
+	}
+	/* regular 3PC, which would also complain if we are not online */
+	ReleasePB();
+	return false;
+}
 
 /*
  * Returns false if mtm is not interested in this xact at all.
@@ -370,8 +510,8 @@ MtmTwoPhaseCommit(void)
 	int			i;
 	int 		nvotes;
 	nodemask_t	pc_success_cohort;
+	nodemask_t	commit_cohort;
 	MtmGeneration xact_gen;
-	char dmq_stream_name[DMQ_STREAM_NAME_MAXLEN];
 	GTxState gtx_state;
 
 	if (MtmNo3PC)
@@ -389,6 +529,9 @@ MtmTwoPhaseCommit(void)
 	if (!MtmTx.distributed)
 		return false;
 
+	if (MtmTryDirectCommit())
+		return false;
+
 	/*
 	 * If this is implicit single-query xact, wrap it in block to execute
 	 * PREPARE.
@@ -441,10 +584,9 @@ MtmTwoPhaseCommit(void)
 		xid = GetTopTransactionId();
 		MtmGenerateGid(mtm_commit_state.gid, mtm_cfg->my_node_id, xid,
 					   xact_gen.num);
-		sprintf(dmq_stream_name, "xid" XID_FMT, xid);
-		dmq_stream_subscribe(dmq_stream_name);
-		mtm_log(MtmCoordinatorTrace, "%s subscribed for %s",
-				mtm_commit_state.gid, dmq_stream_name);
+		dmq_stream_subscribe_id(dmq_stream_id(mtm_cfg->my_node_id, xid));
+		mtm_log(MtmCoordinatorTrace, "%s subscribed for xid " XID_FMT,
+				mtm_commit_state.gid, xid);
 
 		/* prepare transaction on our node */
 		mtm_commit_state.gtx = GlobalTxAcquire(mtm_commit_state.gid, true,
@@ -464,6 +606,7 @@ MtmTwoPhaseCommit(void)
 		 * PREPARE doesn't happen here; ret 0 just means we were already in
 		 * aborted transaction block and we expect the callee to handle this.
 		 */
+		MtmPhaseStart(MTM_PHASE_PREPARE);
 		ret = PrepareTransactionBlockWithState3PC(
 			mtm_commit_state.gid,
 			serialize_xstate(&mtm_commit_state.gtx->xinfo, &mtm_commit_state.gtx->state));
@@ -475,6 +618,7 @@ MtmTwoPhaseCommit(void)
 
 		AllowTempIn2PC = true;
 		CommitTransactionCommand(); /* here we actually PrepareTransaction */
+		MtmPhaseStopLocal();
 		/*
 		 * It is nice to be in a transaction for
 		 * SetPreparedTransactionState/FinishPreparedTransaction, so start it
@@ -514,10 +658,12 @@ MtmTwoPhaseCommit(void)
 		 */
 		cohort = xact_gen.members;
 		BIT_CLEAR(cohort, mtm_cfg->my_node_id - 1);
+		MtmPhaseStart(MTM_PHASE_PREPARE_ACKS);
 		ret = gather(cohort,
 					 (MtmMessage **) p_messages, NULL, &n_messages,
 					 PrepareGatherHook, TransactionIdGetDatum(xid),
-					 NULL, xact_gen.num);
+					 xact_gen.num);
+		MtmPhaseStop();
 
 		/*
 		 * The goal here is to check that every gen member applied the
@@ -571,10 +717,12 @@ MtmTwoPhaseCommit(void)
 		gtx_state.status = GTXPreCommitted;
 		gtx_state.proposal = InitialGTxTerm;
 		gtx_state.accepted = InitialGTxTerm;
+		MtmPhaseStart(MTM_PHASE_PRECOMMIT);
 		SetPreparedTransactionState(
 			mtm_commit_state.gid,
 			serialize_xstate(&mtm_commit_state.gtx->xinfo, &gtx_state),
 			false);
+		MtmPhaseStopLocal();
 		/*
 		 * since this moment direct aborting is not allowed; others can
 		 * receive our precommit and resolve xact to commit without us
@@ -584,33 +732,40 @@ MtmTwoPhaseCommit(void)
 
 		/*
 		 * Just skip precommit tour if I am online in my referee gen,
-		 * i.e. working alone. We actually could do direct commits without 2PC
-		 * as an optimization...
+		 * i.e. working alone. Normally such xacts are committed directly
+		 * (MtmTryDirectCommit), but gen might have switched since then.
 		 */
 		pc_success_cohort = 0;
+		commit_cohort = 0;
 		if (IS_REFEREE_GEN(xact_gen.members, xact_gen.configured))
 			goto precommit_tour_done;
 		/*
-		 * Here (paxos 2a/2b) we need only majority of acks, probably it'd be
-		 * useful to teach gather return once quorum of good msgs collected.
+		 * Here (paxos 2a/2b) we need only majority of acks, so don't wait
+		 * for stragglers. Their late acks are harmless: commit acks gather
+		 * below skips them by status, and gathers of subsequent xacts drop
+		 * them by gid.
 		 */
-		ret = gather(cohort,
-					 (MtmMessage **) twoa_messages, NULL, &n_messages,
-					 Paxos2AGatherHook, PointerGetDatum(mtm_commit_state.gid),
-					 NULL, xact_gen.num);
+		MtmPhaseStart(MTM_PHASE_PRECOMMIT_ACKS);
+		ret = gather_until(cohort,
+						   (MtmMessage **) twoa_messages, NULL, &n_messages,
+						   Paxos2AGatherHook, PointerGetDatum(mtm_commit_state.gid),
+						   Paxos2BQuorumHook,
+						   Int32GetDatum(popcount(xact_gen.configured)),
+						   xact_gen.num);
+		MtmPhaseStop();
 
 		/* check ballots in answers */
 		nvotes = 1; /* myself */
+		commit_cohort = cohort;
 		for (i = 0; i < n_messages; i++)
 		{
-			if (term_cmp(twoa_messages[i]->accepted_term,
-						 (GlobalTxTerm) {1, 0}) == 0 &&
-				twoa_messages[i]->status == GTXPreCommitted)
+			if (Paxos2BGood(twoa_messages[i]))
 			{
 				nvotes++;
 				BIT_SET(pc_success_cohort, twoa_messages[i]->node_id - 1);
 				continue;
 			}
+			BIT_CLEAR(commit_cohort, twoa_messages[i]->node_id - 1);
 			ereport(WARNING,
 					(errcode(ERRCODE_INTERNAL_ERROR),
 					 errmsg("[MTM] failed to precommit transaction %s at node %d",
@@ -652,23 +807,30 @@ MtmTwoPhaseCommit(void)
 
 precommit_tour_done:
 		/* we have majority precommits, commit */
+		MtmPhaseStart(MTM_PHASE_COMMIT);
 		FinishPreparedTransaction(mtm_commit_state.gid, true, false);
+		MtmPhaseStopLocal();
 		mtm_commit_state.gtx->state.status = GTXCommitted;
 		mtm_log(MtmTxFinish, "%s committed", mtm_commit_state.gid);
 		GlobalTxRelease(mtm_commit_state.gtx);
 		mtm_commit_state.gtx = NULL;
 
 		/*
-		 * Optionally wait for commit ack
+		 * Optionally wait for commit ack. Precommit gather above returned
+		 * once majority answered, but wait_peer_commits promises that all
+		 * peers confirm the commit, so wait for everyone who didn't refuse
+		 * to precommit, including stragglers whose 2B we haven't seen.
 		 */
 		if (!MtmWaitPeerCommits)
 			goto commit_tour_done;
 
-		/* abusing both message type and gather hook is slightly dubious */
-		ret = gather(pc_success_cohort,
+		/* abusing message type is slightly dubious */
+		MtmPhaseStart(MTM_PHASE_COMMIT_ACKS);
+		ret = gather(commit_cohort,
 					 (MtmMessage **) twoa_messages, NULL, &n_messages,
-					 Paxos2AGatherHook, PointerGetDatum(mtm_commit_state.gid),
-					 NULL, xact_gen.num);
+					 CommitAckGatherHook, PointerGetDatum(mtm_commit_state.gid),
+					 xact_gen.num);
+		MtmPhaseStop();
 
 		if (!ret)
 		{
@@ -682,9 +844,9 @@ precommit_tour_done:
 							new_gen.num,
 							maskToString(new_gen.members))));
 		}
-		else if (n_messages != popcount(pc_success_cohort))
+		else if (n_messages != popcount(commit_cohort))
 		{
-			nodemask_t failed_cohort = pc_success_cohort;
+			nodemask_t failed_cohort = commit_cohort;
 			for (i = 0; i < n_messages; i++)
 			{
 				BIT_CLEAR(failed_cohort, twoa_messages[i]->node_id - 1);
@@ -698,8 +860,8 @@ precommit_tour_done:
 
 commit_tour_done:
 		dmq_stream_unsubscribe();
-		mtm_log(MtmCoordinatorTrace, "%s unsubscribed for %s",
-				mtm_commit_state.gid, dmq_stream_name);
+		mtm_log(MtmCoordinatorTrace, "%s unsubscribed",
+				mtm_commit_state.gid);
 		mtm_commit_state.inside_commit_sequence = false;
 		/*
 		 * If MtmTwoPhaseCommit happened in COMMIT's ProcessUtility hook,
@@ -714,6 +876,7 @@ commit_tour_done:
 	}
 	PG_CATCH();
 	{
+		MtmPhaseStop();
 		mtm_commit_cleanup(0, Int32GetDatum(0));
 
 		PG_RE_THROW();
@@ -736,7 +899,6 @@ MtmExplicitPrepare(char *gid)
 	nodemask_t	cohort;
 	bool		ret;
 	TransactionId xid;
-	char		stream[DMQ_STREAM_NAME_MAXLEN];
 	int			i;
 	MtmGeneration xact_gen;
 	MtmPrepareResponse *p_messages[MTM_MAX_NODES];
@@ -820,9 +982,8 @@ MtmExplicitPrepare(char *gid)
 		mtm_commit_state.gtx->xinfo.configured = xact_gen.configured;
 		Assert(mtm_commit_state.gtx->state.status == GTXInvalid);
 
-		sprintf(stream, "xid" XID_FMT, xid);
-		dmq_stream_subscribe(stream);
-		mtm_log(MtmCoordinatorTrace, "%s subscribed for %s", gid, stream);
+		dmq_stream_subscribe_id(dmq_stream_id(mtm_cfg->my_node_id, xid));
+		mtm_log(MtmCoordinatorTrace, "%s subscribed for xid " XID_FMT, gid, xid);
 
 
 		ret = PrepareTransactionBlockWithState3PC(
@@ -854,7 +1015,7 @@ MtmExplicitPrepare(char *gid)
 		ret = gather(cohort,
 					 (MtmMessage **) p_messages, NULL, &n_messages,
 					 PrepareGatherHook, TransactionIdGetDatum(xid),
-					 NULL, xact_gen.num);
+					 xact_gen.num);
 
 		if (!ret)
 		{
@@ -895,7 +1056,7 @@ MtmExplicitPrepare(char *gid)
 		GlobalTxRelease(mtm_commit_state.gtx);
 		mtm_commit_state.gtx = NULL;
 		dmq_stream_unsubscribe();
-		mtm_log(MtmCoordinatorTrace, "%s unsubscribed for %s", gid, stream);
+		mtm_log(MtmCoordinatorTrace, "%s unsubscribed", gid);
 		mtm_commit_state.inside_commit_sequence = false;
 	}
 	PG_CATCH();
@@ -916,7 +1077,6 @@ MtmExplicitFinishPrepared(bool isTopLevel, char *gid, bool isCommit)
 	int			n_messages;
 	GlobalTx volatile *gtx;
 	nodemask_t cohort;
-	char	   stream[DMQ_STREAM_NAME_MAXLEN];
 	MtmGeneration gen;
 	bool		  ret;
 	int			  i;
@@ -941,8 +1101,8 @@ MtmExplicitFinishPrepared(bool isTopLevel, char *gid, bool isCommit)
 		 */
 		if (MtmWaitPeerCommits)
 		{
-			sprintf(stream, "xid" XID_FMT, gtx->xinfo.xid);
-			dmq_stream_subscribe(stream);
+			dmq_stream_subscribe_id(dmq_stream_id(Mtm->my_node_id,
+												  gtx->xinfo.xid));
 		}
 
 		FinishPreparedTransaction(gid, isCommit, false);
@@ -969,7 +1129,7 @@ MtmExplicitFinishPrepared(bool isTopLevel, char *gid, bool isCommit)
 	ret = gather(cohort,
 				 (MtmMessage **) twoa_messages, NULL, &n_messages,
 				 Paxos2AGatherHook, PointerGetDatum(gid),
-				 NULL, gen.num);
+				 gen.num);
 	if (!ret)
 	{
 		MtmGeneration new_gen = MtmGetCurrentGen(false);
@@ -999,7 +1159,7 @@ MtmExplicitFinishPrepared(bool isTopLevel, char *gid, bool isCommit)
 	}
 
 	dmq_stream_unsubscribe();
-	mtm_log(MtmCoordinatorTrace, "%s unsubscribed for %s", gid, stream);
+	mtm_log(MtmCoordinatorTrace, "%s unsubscribed", gid);
 }
 
 /*
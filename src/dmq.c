@@ -9,6 +9,8 @@
  * parsing.
  *	  Sender is a custom bgworker that starts with postgres, can open multiple
  * remote connections and keeps open memory queue with each ordinary backend.
+ * There might be several senders with destinations sharded among them; each
+ * destination is served by a single sender, so messages to it keep order.
  * It's a sender responsibility to establish a connection with a remote
  * counterpart. Sender can send heartbeats to allow early detection of dead
  * connections. Also it can stubbornly try to reestablish dead connection.
@@ -38,22 +40,40 @@
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "executor/executor.h"
+#include "port/pg_bitutils.h"
 #include "utils/builtins.h"
 #include "utils/timestamp.h"
 #include "storage/shm_toc.h"
 #include "postmaster/interrupt.h"
 #include "storage/shm_mq.h"
+#include "storage/spin.h"
 #include "storage/ipc.h"
 #include "tcop/tcopprot.h"
 #include "utils/dynahash.h"
 #include "utils/ps_status.h"
 
 #define DMQ_MQ_SIZE  ((Size) 65536)
+
+/*
+ * Sender coalesces outgoing messages to the same destination and flushes them
+ * once per loop iteration, but not later than after that much time or data.
+ */
+#define DMQ_FLUSH_DELAY_MS 1.0
+#define DMQ_FLUSH_BYTES ((size_t) 65536)
+
+/*
+ * Besides, coalesced messages (typically tiny 3PC ones from many backends)
+ * are packed into a single frame of at most that size to save receiver the
+ * per-message protocol overhead. Must be well below receiver's
+ * DMQ_RECV_BUFFER.
+ */
+#define DMQ_BATCH_BYTES ((size_t) 4096)
 #define DMQ_MQ_MAGIC 0x646d71
 
 /*  XXX: move to common */
 #define BIT_CLEAR(mask, bit) ((mask) &= ~((uint64)1 << (bit)))
 #define BIT_CHECK(mask, bit) (((mask) & ((uint64)1 << (bit))) != 0)
+#define BIT_SET(mask, bit) ((mask) |= ((uint64)1 << (bit)))
 static int
 first_set_bit(uint64 mask)
 {
@@ -78,7 +98,12 @@ first_set_bit(uint64 mask)
 
 #define DMQ_MAX_SUBS_PER_BACKEND 10
 #define DMQ_MAX_DESTINATIONS 10
-#define DMQ_MAX_RECEIVERS 10
+/* receiver slots are per (sender, lane) */
+#define DMQ_MAX_RECEIVERS (10 * DMQ_N_LANES)
+
+/* sender-side connection serving given lane of destination */
+#define DMQ_CONN_ID(dest_id, lane) ((dest_id) * DMQ_N_LANES + (lane))
+#define DMQ_MAX_CONNS (DMQ_MAX_DESTINATIONS * DMQ_N_LANES)
 
 typedef enum
 {
@@ -101,15 +126,92 @@ typedef struct
 	int			pos;
 	int8		mask_pos;
 	bool		reconnect_requested;
+	/* sender-local: lane this connection serves */
+	DmqLane		lane;
+	/* sender-local: data put into libpq buffer but not flushed yet */
+	size_t		unflushed_bytes;
+	double		unflushed_since;
+	/* sender-local: Active conn waits for WL_SOCKET_WRITEABLE at pos */
+	bool		write_pending;
 } DmqDestination;
 
 typedef struct
 {
-	char		stream_name[DMQ_STREAM_NAME_MAXLEN];
 	int			procno;
 	uint64		procno_gen;
+	DmqLane		lane;			/* lane subscriber listens to */
+} DmqSubscriber;
+
+/*
+ * Subscription to named stream; the subscriber immediately follows the
+ * (maxaligned) key, see SUBSCRIBER_OF. Receiver-local caches of both named
+ * and id streams are laid out the same way.
+ */
+typedef struct
+{
+	char		stream_name[DMQ_STREAM_NAME_MAXLEN];
+	DmqSubscriber s;
 } DmqStreamSubscription;
 
+StaticAssertDecl(offsetof(DmqStreamSubscription, s) == DMQ_STREAM_NAME_MAXLEN,
+				 "subscriber must follow stream name");
+
+/*
+ * Id streams (per-xact replies) are subscribed to on each commit, so they
+ * don't go to the shared hash under the exclusive lock. Instead, each backend
+ * owns a slot indexed by pgprocno where it publishes the stream it currently
+ * listens to: subscriber fields are set once per process, and xid of the
+ * stream is just atomically written on (un)subscribe. Receivers find the
+ * slot through DmqIdBucket chains and cache the result.
+ */
+typedef struct
+{
+	pg_atomic_uint64 xid;		/* 0 if not subscribed */
+	int32		node_id;
+	DmqSubscriber s;
+	int			next;			/* next procno in the bucket, protected by its
+								 * lock */
+} DmqIdSlot;
+
+/*
+ * (node_id, xid) -> procno index of subscribed id slots, chained through
+ * DmqIdSlot.next; -1 terminates the chain. There are MaxBackends buckets, so
+ * chains are about one slot long.
+ */
+typedef struct
+{
+	slock_t		lock;
+	int			head;
+} DmqIdBucket;
+
+#define DMQ_ID_BUCKET(stream_id) \
+	(&dmq_state->id_buckets[((stream_id)->xid + \
+							 (uint64) (stream_id)->node_id * UINT64CONST(0x9E3779B97F4A7C15)) \
+							% MaxBackends])
+
+#define SUBSCRIBER_OF(entry, keysize) \
+	((DmqSubscriber *) ((char *) (entry) + (keysize)))
+
+/* receiver-local copy of subscription, follows the key as well */
+typedef struct
+{
+	DmqSubscriber s;
+	uint64		sub_gen;		/* sub_gens[s.procno] when cached */
+} DmqCachedSubscriber;
+
+/* marks stream id instead of cstring stream name on the wire */
+#define DMQ_STREAM_ID_MARK '\x01'
+
+/* marks batch frame: sequence of (int32 len, message) pairs follows */
+#define DMQ_BATCH_MARK '\x02'
+
+/* sender-local frame being accumulated for the connection */
+typedef struct
+{
+	StringInfoData buf;
+	int			nmsgs;
+} DmqBatch;
+
 /* receiver publishes this in shmem to let subscriber find his shm_mq */
 typedef struct
 {
@@ -121,6 +223,7 @@ typedef struct
 typedef struct
 {
 	char		name[DMQ_NAME_MAXLEN];
+	DmqLane		lane;
 	pid_t		pid;
 	ReceiverDSMHandle *dsm_handles; /* indexed by pgprocno */
 } DmqReceiverSlot;
@@ -130,47 +233,29 @@ struct DmqSharedState
 {
 	LWLock	   *lock;
 
-	/* sender stuff */
-	pid_t		sender_pid;
-	dsm_handle	out_dsm;
+	/* sender stuff, indexed by sender id */
+	pid_t		sender_pid[DMQ_MAX_SENDERS];
+	dsm_handle	out_dsm[DMQ_MAX_SENDERS];
 	DmqDestination destinations[DMQ_MAX_DESTINATIONS];
 	/*
-	 * Stores counters incremented on each reconnect to destination, indexed
-	 * by receiver mask_pos. This allows to detect conn failures to avoid
-	 * infinite waiting for response when request could have been dropped,
-	 * c.f. dmq_fill_sconn_cnt and dmq_purge_failed_participants.
-	 *
-	 * XXX This mechanism is unreliable and ugly.
-	 * Unreliable, because though it saves from infinite waiting for reply, it
-	 * doesn't save from potential deadlocks. Deadlocks may arise whenever a
-	 * loop of nodes makes request-response sequences because request A->B and
-	 * A's response to B's request go via the same TCP channel; thus, if all
-	 * queues of loop in one direction are filled with requests, nobody will
-	 * be able to answer.
+	 * Stores counters incremented on each reconnect of the request lane to
+	 * destination, indexed by receiver mask_pos. This allows to detect conn
+	 * failures to avoid infinite waiting for response when request could
+	 * have been dropped: dmq_push_request remembers the counter and
+	 * dmq_pop_nb reports the counterparty as failed once it changed.
 	 *
-	 * We could control the situation by ensuring 1) all possible requests
-	 * node sends at time could fit in the output buffers 2) node never
-	 * repeats the request until the previous one is delivered or dropped.
-	 * However, to honor the 2), we must terminate send connection whenever
-	 * receive conn failed (and thus we gonna to retry the requests) to flush
-	 * previous possible undelivered requests, which we don't do currently.
-	 *
-	 * Ultimate non-deadlockable solution without such hacks would be to
-	 * divide the job between different channels: A sends its requests to B
-	 * and receives responses from it via one TCP channel, and B sends its
-	 * requests to A and receives responses via another one. Probably this is
-	 * not worthwhile though as it would make dmq more complicated and
-	 * increase number of shm_mqs.
-	 *
-	 * Besides, the counters are ugly because they require the external code
-	 * to remember sender counters before request and check them while
-	 * waiting for reply; moreover, this checking must be based on timeouts
-	 * as nobody would wake the clients on send conn failures.
+	 * Requests and responses used to share one TCP channel, so deadlocks
+	 * were possible whenever a loop of nodes made request-response sequences:
+	 * if all queues of loop in one direction are filled with requests,
+	 * nobody is able to answer. Now requests go via separate connection
+	 * (lane), and responses are never stuck behind them. Responses are
+	 * consumed by the requester, who never blocks on sending, so the
+	 * response lane always drains.
 	 *
 	 * No locks are used because we don't care much about correct/up-to-date
 	 * reads, though well aligned ints are atomic anyway.
 	 */
-	volatile int sconn_cnt[DMQ_MAX_DESTINATIONS];
+	volatile int sconn_cnt[DMQ_N_MASK_POS];
 
 	/*
 	 * Receivers stuff. Some notes on shm_mq management: one of the subtle
@@ -206,7 +291,25 @@ struct DmqSharedState
 	 * could distinguish different processes with the same pgprocno.
 	 */
 	uint64 *procno_gens;
+	/*
+	 * Indexed by pgprocno as well; bumped (under exclusive lock) each time
+	 * the backend subscribes or unsubscribes to a named stream, which lets
+	 * receivers validate their cached subscriptions without looking into the
+	 * shared hash. Id streams are validated against id_slots instead.
+	 */
+	pg_atomic_uint64 *sub_gens;
+	/* indexed by pgprocno, see DmqIdSlot */
+	DmqIdSlot  *id_slots;
+	DmqIdBucket *id_buckets;	/* MaxBackends of them */
 	DmqReceiverSlot receivers[DMQ_MAX_RECEIVERS];
+
+	/*
+	 * Doorbell for the sender: bit per pgprocno, set by backend whenever it
+	 * has put something into its outgoing shm_mq (or detached from it), so
+	 * sender doesn't need to poll MaxBackends queues on each message. Each
+	 * sender has its own DMQ_READY_WORDS, see READY_MASK.
+	 */
+	pg_atomic_uint64 *ready_mask;
 }		   *dmq_state;
 
 /* special value for sconn_cnt[] meaning the connection is dead */
@@ -214,14 +317,36 @@ struct DmqSharedState
 
 static HTAB *dmq_subscriptions;
 
+/*
+ * Receiver-local caches of dmq_subscriptions and id_slots, so that routing a
+ * message usually doesn't require taking dmq_state->lock or scanning slots.
+ * Entries for finished xacts are never looked up again; we just wipe the
+ * whole cache once it grows to DMQ_SUBS_CACHE_SIZE.
+ */
+#define DMQ_SUBS_CACHE_SIZE 1024
+static HTAB *dmq_subs_cache;
+static HTAB *dmq_id_subs_cache;
+
+/* number of sender workers, destination dest_id goes via DMQ_SENDER_OF it */
+static int	dmq_n_senders = 1;
+#define DMQ_SENDER_OF(dest_id) ((dest_id) % dmq_n_senders)
+
 /* Backend-local i/o queues. */
 struct
 {
-	/* to send */
-	shm_mq_handle *mq_outh;
+	/* to send, indexed by sender id */
+	shm_mq_handle *mq_outh[DMQ_MAX_SENDERS];
+	PGPROC	   *mq_out_receiver[DMQ_MAX_SENDERS];	/* dmq sender */
+	bool		outq_exit_registered;
 
 	/* to receive */
 	char	curr_stream_name[DMQ_STREAM_NAME_MAXLEN];
+	bool	curr_stream_is_id;
+	DmqStreamId curr_stream_id;
+	DmqLane	lane;				/* which receivers inhandles are attached to */
+	/* unanswered requests and sconn_cnt of their lane then, see dmq_push_request */
+	uint64	req_pending;
+	int		req_sconn_cnt[DMQ_N_MASK_POS];
 	uint64	my_procno_gen;
 	int			n_inhandles;
 	struct
@@ -305,6 +430,17 @@ receiver_dsm_handles_size(void)
 	return mul_size(sizeof(ReceiverDSMHandle), MaxBackends);
 }
 
+#define DMQ_READY_WORDS ((MaxBackends + 63) / 64)
+#define READY_MASK(sender_id) \
+	(dmq_state->ready_mask + (sender_id) * DMQ_READY_WORDS)
+
+static Size
+ready_mask_size(void)
+{
+	return mul_size(sizeof(pg_atomic_uint64),
+					mul_size(DMQ_READY_WORDS, dmq_n_senders));
+}
+
 /*
  * Set pointer to dmq shared state in all backends.
  */
@@ -318,7 +454,7 @@ dmq_shmem_startup_hook(void)
 		PreviousShmemStartupHook();
 
 	MemSet(&hash_info, 0, sizeof(hash_info));
-	hash_info.keysize = DMQ_NAME_MAXLEN;
+	hash_info.keysize = DMQ_STREAM_NAME_MAXLEN;
 	hash_info.entrysize = sizeof(DmqStreamSubscription);
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
@@ -330,13 +466,19 @@ dmq_shmem_startup_hook(void)
 	{
 		int			i;
 		bool		procno_gens_found;
+		bool		sub_gens_found;
+		bool		id_slots_found;
+		bool		id_buckets_found;
+		bool		ready_mask_found;
 
 		dmq_state->lock = &(GetNamedLWLockTranche("dmq"))->lock;
-		dmq_state->out_dsm = DSM_HANDLE_INVALID;
+		for (i = 0; i < DMQ_MAX_SENDERS; i++)
+		{
+			dmq_state->out_dsm[i] = DSM_HANDLE_INVALID;
+			dmq_state->sender_pid[i] = 0;
+		}
 		memset(dmq_state->destinations, '\0', sizeof(DmqDestination) * DMQ_MAX_DESTINATIONS);
 
-		dmq_state->sender_pid = 0;
-
 		ConditionVariableInit(&dmq_state->shm_mq_creation_cv);
 		dmq_state->procno_gens =
 			ShmemInitStruct("dmq-procnogens",
@@ -345,6 +487,41 @@ dmq_shmem_startup_hook(void)
 		Assert(!procno_gens_found);
 		MemSet(dmq_state->procno_gens, '\0', sizeof(uint64) * MaxBackends);
 
+		dmq_state->sub_gens =
+			ShmemInitStruct("dmq-subgens",
+							mul_size(sizeof(pg_atomic_uint64), MaxBackends),
+							&sub_gens_found);
+		Assert(!sub_gens_found);
+		for (i = 0; i < MaxBackends; i++)
+			pg_atomic_init_u64(&dmq_state->sub_gens[i], 0);
+
+		dmq_state->id_slots =
+			ShmemInitStruct("dmq-idslots",
+							mul_size(sizeof(DmqIdSlot), MaxBackends),
+							&id_slots_found);
+		Assert(!id_slots_found);
+		MemSet(dmq_state->id_slots, '\0', sizeof(DmqIdSlot) * MaxBackends);
+		for (i = 0; i < MaxBackends; i++)
+			pg_atomic_init_u64(&dmq_state->id_slots[i].xid, 0);
+
+		dmq_state->id_buckets =
+			ShmemInitStruct("dmq-idbuckets",
+							mul_size(sizeof(DmqIdBucket), MaxBackends),
+							&id_buckets_found);
+		Assert(!id_buckets_found);
+		for (i = 0; i < MaxBackends; i++)
+		{
+			SpinLockInit(&dmq_state->id_buckets[i].lock);
+			dmq_state->id_buckets[i].head = -1;
+		}
+
+		dmq_state->ready_mask =
+			ShmemInitStruct("dmq-readymask", ready_mask_size(),
+							&ready_mask_found);
+		Assert(!ready_mask_found);
+		for (i = 0; i < DMQ_READY_WORDS * dmq_n_senders; i++)
+			pg_atomic_init_u64(&dmq_state->ready_mask[i], 0);
+
 		for (i = 0; i < DMQ_MAX_RECEIVERS; i++)
 		{
 			bool dsm_handles_found;
@@ -378,15 +555,23 @@ dmq_shmem_size(void)
 	Size		size = 0;
 
 	size = add_size(size, sizeof(struct DmqSharedState));
+	size = add_size(size, ready_mask_size());
+	size = add_size(size, mul_size(sizeof(pg_atomic_uint64), MaxBackends));
 	size = add_size(size, hash_estimate_size(DMQ_MAX_SUBS_PER_BACKEND * MaxBackends,
 											 sizeof(DmqStreamSubscription)));
+	size = add_size(size, mul_size(sizeof(DmqIdSlot), MaxBackends));
+	size = add_size(size, mul_size(sizeof(DmqIdBucket), MaxBackends));
 	return MAXALIGN(size);
 }
 
 void
-dmq_init(int send_timeout, int connect_timeout)
+dmq_init(int send_timeout, int connect_timeout, int n_senders)
 {
 	BackgroundWorker worker;
+	int			i;
+
+	Assert(n_senders >= 1 && n_senders <= DMQ_MAX_SENDERS);
+	dmq_n_senders = n_senders;
 
 	if (!process_shared_preload_libraries_in_progress)
 		return;
@@ -407,9 +592,16 @@ dmq_init(int send_timeout, int connect_timeout)
 
 	sprintf(worker.bgw_library_name, "multimaster");
 	sprintf(worker.bgw_function_name, "dmq_sender_main");
-	snprintf(worker.bgw_name, BGW_MAXLEN, "mtm-dmq-sender");
 	snprintf(worker.bgw_type, BGW_MAXLEN, "mtm-dmq-sender");
-	RegisterBackgroundWorker(&worker);
+	for (i = 0; i < n_senders; i++)
+	{
+		if (n_senders == 1)
+			snprintf(worker.bgw_name, BGW_MAXLEN, "mtm-dmq-sender");
+		else
+			snprintf(worker.bgw_name, BGW_MAXLEN, "mtm-dmq-sender-%d", i);
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
+	}
 
 	/* Register shmem hooks */
 	PreviousShmemStartupHook = shmem_startup_hook;
@@ -436,14 +628,16 @@ dmq_toc_size()
  *
  *****************************************************************************/
 
+/*
+ * Returns -1 on failure, 1 if not everything could be sent without blocking,
+ * 0 otherwise.
+ */
 static int
-fe_send(PGconn *conn, char *msg, size_t len)
+fe_flush(PGconn *conn)
 {
-	if (PQputCopyData(conn, msg, len) < 0)
-		return -1;
+	int			ret = PQflush(conn);
 
-	/* XXX: move PQflush out of the loop? */
-	if (PQflush(conn) < 0)
+	if (ret < 0)
 		return -1;
 
 	/*
@@ -453,32 +647,206 @@ fe_send(PGconn *conn, char *msg, size_t len)
 	if (!PQconsumeInput(conn))
 		return -1;
 
-	return 0;
+	return ret;
 }
 
+/* sender-local: request lane was lost, subscribers must learn that */
+static bool dmq_wake_pending = false;
+
+/* sender-local, indexed by conn_id */
+static DmqBatch dmq_batches[DMQ_MAX_CONNS];
+
+/*
+ * Active connection is lost. Only response lane, which carries heartbeats,
+ * is reported to the hooks; request lane failure is tracked by sconn_cnt.
+ */
 static void
-dmq_send(DmqDestination *conns, int conn_id, char *data, size_t len)
+dmq_conn_lost(DmqDestination *conns, int conn_id)
 {
-	int			ret = fe_send(conns[conn_id].pgconn, data, len);
+	conns[conn_id].state = Idle;
+	conns[conn_id].unflushed_bytes = 0;
+	dmq_batches[conn_id].nmsgs = 0;
 
-	if (ret < 0)
+	if (conns[conn_id].lane == DMQ_LANE_REQUEST)
 	{
-		conns[conn_id].state = Idle;
 		dmq_state->sconn_cnt[conns[conn_id].mask_pos] = DMQSCONN_DEAD;
+		/* we might hold dmq_state->lock here, so wake them later */
+		dmq_wake_pending = true;
+	}
+	else
+		dmq_sender_disconnect_hook(conns[conn_id].receiver_name);
+}
+
+static void
+dmq_conn_failed(DmqDestination *conns, int conn_id)
+{
+	mtm_log(DmqStateFinal,
+			"[DMQ] failed to send message to %s: %s",
+			conns[conn_id].receiver_name,
+			PQerrorMessage(conns[conn_id].pgconn));
 
-		mtm_log(DmqStateFinal,
-				"[DMQ] failed to send message to %s: %s",
-				conns[conn_id].receiver_name,
-				PQerrorMessage(conns[conn_id].pgconn));
+	dmq_conn_lost(conns, conn_id);
+}
 
-		dmq_sender_disconnect_hook(conns[conn_id].receiver_name);
+/*
+ * Put accumulated batch into libpq output buffer. Single message is sent as
+ * is, without batch framing.
+ */
+static bool
+dmq_batch_put(DmqDestination *conns, int conn_id)
+{
+	DmqBatch   *batch = &dmq_batches[conn_id];
+	char	   *data = batch->buf.data;
+	int			len = batch->buf.len;
+
+	if (batch->nmsgs == 0)
+		return true;
+
+	if (batch->nmsgs == 1)
+	{
+		data += 1 + sizeof(int32);
+		len -= 1 + sizeof(int32);
+	}
+	batch->nmsgs = 0;
+
+	if (PQputCopyData(conns[conn_id].pgconn, data, len) < 0)
+	{
+		dmq_conn_failed(conns, conn_id);
+		return false;
+	}
+	return true;
+}
+
+static void
+dmq_flush(DmqDestination *conns, int conn_id)
+{
+	if (conns[conn_id].unflushed_bytes == 0)
+		return;
+
+	if (!dmq_batch_put(conns, conn_id))
+		return;
+
+	switch (fe_flush(conns[conn_id].pgconn))
+	{
+		case -1:
+			dmq_conn_failed(conns, conn_id);
+			break;
+		case 0:
+			conns[conn_id].unflushed_bytes = 0;
+			break;
+		default:
+			/* socket is full, retry on the next loop iteration */
+			break;
 	}
-	else if (data[0] != 'H') /* skip logging heartbeats */
+}
+
+/* Flush everything coalesced during this sender loop iteration */
+static void
+dmq_flush_all(DmqDestination *conns)
+{
+	int			conn_id;
+
+	for (conn_id = 0; conn_id < DMQ_MAX_CONNS; conn_id++)
+	{
+		if (conns[conn_id].active && conns[conn_id].state == Active)
+			dmq_flush(conns, conn_id);
+	}
+}
+
+/*
+ * Socket of Active connection is watched only while libpq couldn't flush
+ * everything because it is full, so that we get back to flushing as soon as
+ * it drains instead of on the next timeout.
+ */
+static void
+dmq_cancel_write_event(WaitEventSet *set, DmqDestination *conn)
+{
+	if (conn->write_pending)
+	{
+		DeleteWaitEvent(set, conn->pos);
+		conn->write_pending = false;
+	}
+}
+
+static void
+dmq_update_write_events(WaitEventSet *set, DmqDestination *conns)
+{
+	int			conn_id;
+
+	for (conn_id = 0; conn_id < DMQ_MAX_CONNS; conn_id++)
+	{
+		DmqDestination *conn = &conns[conn_id];
+		bool		want_write = conn->active && conn->state == Active &&
+			conn->unflushed_bytes > 0;
+
+		if (!want_write)
+			dmq_cancel_write_event(set, conn);
+		else if (!conn->write_pending && want_write)
+		{
+			conn->pos = AddWaitEventToSet(set, WL_SOCKET_WRITEABLE,
+										  PQsocket(conn->pgconn),
+										  NULL, (void *) (uintptr_t) conn_id);
+			conn->write_pending = true;
+		}
+	}
+}
+
+/*
+ * Queue message to the destination. It is only appended to the batch here,
+ * so that all messages for the destination gathered during the loop
+ * iteration go out in one frame and one write in dmq_flush_all. Flush right
+ * away if we have been coalescing for too long, though.
+ */
+static void
+dmq_send(DmqDestination *conns, int conn_id, char *data, size_t len)
+{
+	DmqDestination *conn = &conns[conn_id];
+	DmqBatch   *batch = &dmq_batches[conn_id];
+
+	/* no room in the frame, start another one */
+	if (batch->nmsgs > 0 &&
+		batch->buf.len + sizeof(int32) + len > DMQ_BATCH_BYTES)
+	{
+		if (!dmq_batch_put(conns, conn_id))
+			return;
+	}
+
+	if (1 + sizeof(int32) + len > DMQ_BATCH_BYTES)
+	{
+		/* too large to be batched */
+		if (PQputCopyData(conn->pgconn, data, len) < 0)
+		{
+			dmq_conn_failed(conns, conn_id);
+			return;
+		}
+	}
+	else
+	{
+		if (batch->nmsgs == 0)
+		{
+			if (batch->buf.data == NULL)
+				initStringInfo(&batch->buf);
+			resetStringInfo(&batch->buf);
+			appendStringInfoChar(&batch->buf, DMQ_BATCH_MARK);
+		}
+		pq_sendint32(&batch->buf, (int32) len);
+		appendBinaryStringInfo(&batch->buf, data, len);
+		batch->nmsgs++;
+	}
+
+	if (data[0] != 'H') /* skip logging heartbeats */
 	{
 		mtm_log(DmqTraceOutgoing,
 				"[DMQ] sent message (l=%zu, m=%s) to %s",
-				len, (char *) data, conns[conn_id].receiver_name);
+				len, (char *) data, conn->receiver_name);
 	}
+
+	if (conn->unflushed_bytes == 0)
+		conn->unflushed_since = dmq_now();
+	conn->unflushed_bytes += len;
+	if (conn->unflushed_bytes >= DMQ_FLUSH_BYTES ||
+		dmq_now() - conn->unflushed_since >= DMQ_FLUSH_DELAY_MS)
+		dmq_flush(conns, conn_id);
 }
 
 static void
@@ -498,6 +866,69 @@ dmq_sender_at_exit(int status, Datum arg)
 	LWLockRelease(dmq_state->lock);
 }
 
+/*
+ * Send everything backend with given pgprocno has put into its queue.
+ * Returns true if there was something.
+ */
+static bool
+dmq_sender_drain(shm_mq_handle **mq_handles, int procno, dsm_segment *seg,
+				 DmqDestination *conns)
+{
+	bool		got_messages = false;
+
+	for (;;)
+	{
+		void	   *data;
+		Size		len;
+		shm_mq_result res;
+
+		res = shm_mq_receive(mq_handles[procno], &len, &data, true);
+		if (res == SHM_MQ_SUCCESS)
+		{
+			int			conn_id;
+
+			/* first byte is connection_id, see DMQ_CONN_ID */
+			conn_id = *(char *) data;
+			data = (char *) data + 1;
+			len -= 1;
+			Assert(0 <= conn_id && conn_id < DMQ_MAX_CONNS);
+
+			if (conns[conn_id].active && conns[conn_id].state == Active)
+			{
+				dmq_send(conns, conn_id, data, len);
+			}
+			else
+			{
+				mtm_log(WARNING,
+						"[DMQ] dropping message (l=%zu, m=%s) to disconnected %s",
+						len, (char *) data, conns[conn_id].receiver_name);
+			}
+
+			got_messages = true;
+		}
+		else if (res == SHM_MQ_DETACHED)
+		{
+			shm_mq	   *mq = shm_mq_get_queue(mq_handles[procno]);
+
+			/*
+			 * Overwrite old mq struct since mq api don't have a way to
+			 * reattach detached queue.
+			 */
+			shm_mq_detach(mq_handles[procno]);
+			mq = shm_mq_create(mq, DMQ_MQ_SIZE);
+			shm_mq_set_receiver(mq, MyProc);
+			mq_handles[procno] = shm_mq_attach(mq, seg, NULL);
+
+			mtm_log(DmqTraceShmMq,
+					"[DMQ] sender reattached shm_mq to procno %d", procno);
+			break;
+		}
+		else
+			break;
+	}
+	return got_messages;
+}
+
 void
 dmq_sender_main(Datum main_arg)
 {
@@ -506,7 +937,7 @@ dmq_sender_main(Datum main_arg)
 	shm_toc    *toc;
 	shm_mq_handle **mq_handles;
 	WaitEventSet *set;
-	DmqDestination conns[DMQ_MAX_DESTINATIONS];
+	DmqDestination conns[DMQ_MAX_CONNS];
 	int			heartbeat_send_timeout;
 	int			connect_timeout;
 	StringInfoData heartbeat_buf; /* heartbeat data is accumulated here */
@@ -514,8 +945,12 @@ dmq_sender_main(Datum main_arg)
 	 * Seconds dmq_state->sconn_cnt to save the counter value when
 	 * conn is dead.
 	 */
-	int			sconn_cnt[DMQ_MAX_DESTINATIONS];
+	int			sconn_cnt[DMQ_N_MASK_POS];
 	double		prev_timer_at = dmq_now();
+	bool		timer_scan = true;
+	int			w;
+	int			sender_id = DatumGetInt32(main_arg);
+	pg_atomic_uint64 *ready_mask;
 
 	MtmBackgroundWorker = true; /* includes bgw name in mtm_log */
 
@@ -546,17 +981,21 @@ dmq_sender_main(Datum main_arg)
 		mq_handles[i] = shm_mq_attach(mq, seg, NULL);
 	}
 
-	for (i = 0; i < DMQ_MAX_DESTINATIONS; i++)
+	for (i = 0; i < DMQ_MAX_CONNS; i++)
 	{
 		conns[i].active = false;
+		conns[i].write_pending = false;
 	}
 
+	ready_mask = READY_MASK(sender_id);
+
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
-	dmq_state->sender_pid = MyProcPid;
-	dmq_state->out_dsm = dsm_segment_handle(seg);
+	dmq_state->sender_pid[sender_id] = MyProcPid;
+	dmq_state->out_dsm[sender_id] = dsm_segment_handle(seg);
 	LWLockRelease(dmq_state->lock);
 
-	set = CreateWaitEventSet(CurrentMemoryContext, 15);
+	/* postmaster death, latch and at most one event per connection */
+	set = CreateWaitEventSet(CurrentMemoryContext, DMQ_MAX_CONNS + 2);
 	AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
 	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
 
@@ -580,95 +1019,106 @@ dmq_sender_main(Datum main_arg)
 		{
 			got_SIGHUP = false;
 
-			LWLockAcquire(dmq_state->lock, LW_SHARED);
+			/* exclusive as we clear reconnect_requested */
+			LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
 			for (i = 0; i < DMQ_MAX_DESTINATIONS; i++)
 			{
 				DmqDestination *dest = &(dmq_state->destinations[i]);
+				DmqLane		lane;
 
-				/* start connection for a freshly added destination */
-				if (dest->active && !conns[i].active)
-				{
-					conns[i] = *dest;
-					Assert(conns[i].pgconn == NULL);
-					conns[i].state = Idle;
-					sconn_cnt[dest->mask_pos] = 0;
-					dmq_state->sconn_cnt[dest->mask_pos] = DMQSCONN_DEAD;
-					prev_timer_at = 0;	/* do not wait for timer event */
-				}
-				/* close connection to deleted destination */
-				else if (!dest->active && conns[i].active)
-				{
-					PQfinish(conns[i].pgconn);
-					conns[i].active = false;
-					conns[i].pgconn = NULL;
-				}
-				else if (dest->active && conns[i].active &&
-						 dest->reconnect_requested)
+				/* served by another sender */
+				if (DMQ_SENDER_OF(i) != sender_id)
+					continue;
+
+				for (lane = 0; lane < DMQ_N_LANES; lane++)
 				{
-					dest->reconnect_requested = false;
-					PQfinish(conns[i].pgconn);
-					conns[i].pgconn = NULL;
-					if (conns[i].state == Active)
+					int			conn_id = DMQ_CONN_ID(i, lane);
+
+					/* start connection for a freshly added destination */
+					if (dest->active && !conns[conn_id].active)
+					{
+						conns[conn_id] = *dest;
+						Assert(conns[conn_id].pgconn == NULL);
+						conns[conn_id].lane = lane;
+						conns[conn_id].write_pending = false;
+						conns[conn_id].state = Idle;
+						if (lane == DMQ_LANE_REQUEST)
+						{
+							sconn_cnt[dest->mask_pos] = 0;
+							dmq_state->sconn_cnt[dest->mask_pos] = DMQSCONN_DEAD;
+						}
+						prev_timer_at = 0;	/* do not wait for timer event */
+					}
+					/* close connection to deleted destination */
+					else if (!dest->active && conns[conn_id].active)
 					{
-						dmq_sender_disconnect_hook(conns[i].receiver_name);
+						dmq_cancel_write_event(set, &conns[conn_id]);
+						PQfinish(conns[conn_id].pgconn);
+						conns[conn_id].active = false;
+						conns[conn_id].pgconn = NULL;
+					}
+					else if (dest->active && conns[conn_id].active &&
+							 dest->reconnect_requested)
+					{
+						dmq_cancel_write_event(set, &conns[conn_id]);
+						PQfinish(conns[conn_id].pgconn);
+						conns[conn_id].pgconn = NULL;
+						if (conns[conn_id].state == Active)
+							dmq_conn_lost(conns, conn_id);
+						conns[conn_id].state = Idle;
+						if (lane == DMQ_LANE_REQUEST)
+						{
+							dmq_state->sconn_cnt[dest->mask_pos] = DMQSCONN_DEAD;
+							dmq_wake_pending = true;
+						}
 					}
-					conns[i].state = Idle;
-					dmq_state->sconn_cnt[dest->mask_pos] = DMQSCONN_DEAD;
 				}
+				dest->reconnect_requested = false;
 			}
 			LWLockRelease(dmq_state->lock);
 		}
 
 		/*
 		 * Transfer data from backend queues to their remote counterparts.
+		 * Look only at queues whose owners rang the doorbell; all of them
+		 * are rescanned on timer just in case.
 		 */
-		for (i = 0; i < MaxBackends; i++)
+		for (w = 0; w < DMQ_READY_WORDS; w++)
 		{
-			void	   *data;
-			Size		len;
-			shm_mq_result res;
-
-			res = shm_mq_receive(mq_handles[i], &len, &data, true);
-			if (res == SHM_MQ_SUCCESS)
-			{
-				int			conn_id;
+			uint64		ready;
 
-				/* first byte is connection_id */
-				conn_id = *(char *) data;
-				data = (char *) data + 1;
-				len -= 1;
-				Assert(0 <= conn_id && conn_id < DMQ_MAX_DESTINATIONS);
-
-				if (conns[conn_id].state == Active)
-				{
-					dmq_send(conns, conn_id, data, len);
-				}
-				else
-				{
-					mtm_log(WARNING,
-							"[DMQ] dropping message (l=%zu, m=%s) to disconnected %s",
-							len, (char *) data, conns[conn_id].receiver_name);
-				}
+			if (timer_scan)
+				ready = ~UINT64CONST(0);
+			else if (pg_atomic_read_u64(&ready_mask[w]) == 0)
+				continue;
+			else
+				ready = pg_atomic_exchange_u64(&ready_mask[w], 0);
 
-				wait = false;
-			}
-			else if (res == SHM_MQ_DETACHED)
+			while (ready != 0)
 			{
-				shm_mq	   *mq = shm_mq_get_queue(mq_handles[i]);
+				int			bit = pg_rightmost_one_pos64(ready);
 
-				/*
-				 * Overwrite old mq struct since mq api don't have a way to
-				 * reattach detached queue.
-				 */
-				shm_mq_detach(mq_handles[i]);
-				mq = shm_mq_create(mq, DMQ_MQ_SIZE);
-				shm_mq_set_receiver(mq, MyProc);
-				mq_handles[i] = shm_mq_attach(mq, seg, NULL);
-
-				mtm_log(DmqTraceShmMq,
-						"[DMQ] sender reattached shm_mq to procno %d", i);
+				ready &= ready - 1;
+				i = w * 64 + bit;
+				if (i >= MaxBackends)
+					break;
+				if (dmq_sender_drain(mq_handles, i, seg, conns))
+					wait = false;
 			}
 		}
+		timer_scan = false;
+		dmq_flush_all(conns);
+		dmq_update_write_events(set, conns);
+
+		/*
+		 * Requests sent via lost request lane might have been dropped; let
+		 * those waiting for answers find out in dmq_pop_nb right away.
+		 */
+		if (dmq_wake_pending)
+		{
+			dmq_wake_pending = false;
+			dmq_wake_subscribers();
+		}
 
 		/*
 		 * Generate timeout or socket events.
@@ -682,6 +1132,7 @@ dmq_sender_main(Datum main_arg)
 		{
 			prev_timer_at = now_millisec;
 			timer_event = true;
+			timer_scan = true;
 		}
 		else
 		{
@@ -697,7 +1148,7 @@ dmq_sender_main(Datum main_arg)
 		{
 			uintptr_t	conn_id;
 
-			for (conn_id = 0; conn_id < DMQ_MAX_DESTINATIONS; conn_id++)
+			for (conn_id = 0; conn_id < DMQ_MAX_CONNS; conn_id++)
 			{
 				if (!conns[conn_id].active)
 					continue;
@@ -707,6 +1158,7 @@ dmq_sender_main(Datum main_arg)
 				{
 					double		pqtime;
 
+					dmq_cancel_write_event(set, &conns[conn_id]);
 					if (conns[conn_id].pgconn)
 						PQfinish(conns[conn_id].pgconn);
 
@@ -746,11 +1198,16 @@ dmq_sender_main(Datum main_arg)
 					/* stream name is cstring by convention */
 					appendStringInfoChar(&heartbeat_buf, 'H');
 					appendStringInfoChar(&heartbeat_buf, '\0');
-					/* Allow user to stuff some payload into the heartbeat */
-					if (dmq_sender_heartbeat_hook != NULL)
+					/*
+					 * Allow user to stuff some payload into the heartbeat;
+					 * request lane heartbeats only keep receiver alive.
+					 */
+					if (dmq_sender_heartbeat_hook != NULL &&
+						conns[conn_id].lane == DMQ_LANE_RESPONSE)
 						dmq_sender_heartbeat_hook(conns[conn_id].receiver_name,
 												  &heartbeat_buf);
 					dmq_send(conns, conn_id, heartbeat_buf.data, heartbeat_buf.len);
+					dmq_flush(conns, conn_id);
 				}
 				/*
 				 * Do we need to abort connection attempt due to timeout?
@@ -834,8 +1291,9 @@ dmq_sender_main(Datum main_arg)
 						else if (status == PGRES_POLLING_OK)
 						{
 							char	   *sender_name = conns[conn_id].sender_name;
-							char	   *query = psprintf("select mtm.dmq_receiver_loop('%s', %d)",
-														 sender_name, conns[conn_id].recv_timeout);
+							char	   *query = psprintf("select mtm.dmq_receiver_loop('%s', %d, %d)",
+														 sender_name, conns[conn_id].recv_timeout,
+														 (int) conns[conn_id].lane);
 
 							conns[conn_id].state = Negotiating;
 							ModifyWaitEvent(set, pos, WL_SOCKET_READABLE, NULL);
@@ -887,33 +1345,40 @@ dmq_sender_main(Datum main_arg)
 						 */
 
 						conns[conn_id].state = Active;
+						conns[conn_id].unflushed_bytes = 0;
 						DeleteWaitEvent(set, event.pos);
 						PQsetnonblocking(conns[conn_id].pgconn, 1);
-						sconn_cnt[mask_pos]++;
-						dmq_state->sconn_cnt[mask_pos] = sconn_cnt[mask_pos];
 
 						mtm_log(DmqStateFinal,
-								"[DMQ] connected to %s",
-								conns[conn_id].receiver_name);
+								"[DMQ] connected to %s (%s lane)",
+								conns[conn_id].receiver_name,
+								conns[conn_id].lane == DMQ_LANE_REQUEST ?
+								"request" : "response");
 
-						dmq_sender_connect_hook(conns[conn_id].receiver_name);
+						if (conns[conn_id].lane == DMQ_LANE_REQUEST)
+						{
+							sconn_cnt[mask_pos]++;
+							dmq_state->sconn_cnt[mask_pos] = sconn_cnt[mask_pos];
+						}
+						else
+							dmq_sender_connect_hook(conns[conn_id].receiver_name);
 					}
 					break;
 
-					/* Do nothing and check that connection is still alive */
+					/*
+					 * Socket got writeable again, the rest is flushed by
+					 * dmq_flush_all on this iteration.
+					 */
 				case Active:
-					Assert(event.events & WL_SOCKET_READABLE);
+					Assert(event.events & WL_SOCKET_WRITEABLE);
 					if (!PQconsumeInput(conns[conn_id].pgconn))
 					{
-						conns[conn_id].state = Idle;
-						dmq_state->sconn_cnt[conns[conn_id].mask_pos] = DMQSCONN_DEAD;
-
 						mtm_log(DmqStateFinal,
 								"[DMQ] connection error with %s: %s",
 								conns[conn_id].receiver_name,
 								PQerrorMessage(conns[conn_id].pgconn));
 
-						dmq_sender_disconnect_hook(conns[conn_id].receiver_name);
+						dmq_conn_lost(conns, conn_id);
 					}
 					break;
 			}
@@ -1001,15 +1466,190 @@ dmq_receiver_recreate_mq(DmqReceiverSlot *my_slot,
 	mtm_log(DmqTraceShmMq, "[DMQ] created shm_mq to proc <%d, " UINT64_FORMAT ">, dsm handle %u",
 			procno, procno_gen, dsm_segment_handle(*seg_p));
 
-	/*
-	 * This often duplicates cv broadcast, but not always: subscriber might
-	 * not requested mq recreation directly but just subscribed to the stream
-	 * and went to sleep on latch, and we got here through message
-	 * receival. e.g. like mtm monitor with his permanent streams behaves like
-	 * this. OTOH, removing cv altogether would require to wake all
-	 * subscribers in dmq_receiver_at_exit, which is not too elegant as well.
-	 */
-	SetLatch(&ProcGlobal->allProcs[procno].procLatch);
+	/*
+	 * This often duplicates cv broadcast, but not always: subscriber might
+	 * not requested mq recreation directly but just subscribed to the stream
+	 * and went to sleep on latch, and we got here through message
+	 * receival. e.g. like mtm monitor with his permanent streams behaves like
+	 * this. OTOH, removing cv altogether would require to wake all
+	 * subscribers in dmq_receiver_at_exit, which is not too elegant as well.
+	 */
+	SetLatch(&ProcGlobal->allProcs[procno].procLatch);
+}
+
+/* for logging */
+static const char *
+dmq_stream_str(const char *stream_name, const DmqStreamId *stream_id)
+{
+	static char buf[DMQ_STREAM_NAME_MAXLEN];
+
+	if (stream_name != NULL)
+		return stream_name;
+	snprintf(buf, sizeof(buf), "%d/" UINT64_FORMAT,
+			 stream_id->node_id, stream_id->xid);
+	return buf;
+}
+
+/* remember subscriber in receiver-local cache, wiping it if it is full */
+static void
+dmq_cache_subscriber(HTAB *cache, const void *key, Size keysize,
+					 DmqSubscriber *sub, uint64 sub_gen)
+{
+	void	   *entry;
+	DmqCachedSubscriber *cached;
+
+	entry = hash_search(cache, key, HASH_FIND, NULL);
+	if (entry == NULL && hash_get_num_entries(cache) >= DMQ_SUBS_CACHE_SIZE)
+	{
+		HASH_SEQ_STATUS hash_seq;
+		void	   *old;
+
+		hash_seq_init(&hash_seq, cache);
+		while ((old = hash_seq_search(&hash_seq)) != NULL)
+			hash_search(cache, old, HASH_REMOVE, NULL);
+	}
+
+	entry = hash_search(cache, key, HASH_ENTER, NULL);
+	cached = (DmqCachedSubscriber *) SUBSCRIBER_OF(entry, keysize);
+	cached->s = *sub;
+	cached->sub_gen = sub_gen;
+}
+
+static bool
+dmq_id_slot_matches(int procno, const DmqStreamId *stream_id)
+{
+	DmqIdSlot  *slot = &dmq_state->id_slots[procno];
+
+	if (pg_atomic_read_u64(&slot->xid) != stream_id->xid)
+		return false;
+	/* slot fields are written before xid */
+	pg_read_barrier();
+	return slot->node_id == stream_id->node_id;
+}
+
+/*
+ * Find subscriber of stream given by id. Cached entry is valid as long as
+ * its backend still listens to the stream; otherwise look into the stream's
+ * bucket, which normally happens once per xact.
+ */
+static bool
+dmq_find_id_subscriber(const DmqStreamId *stream_id, DmqSubscriber *sub)
+{
+	void	   *entry;
+	DmqIdBucket *bucket;
+	int			procno;
+	bool		found = false;
+
+	if (dmq_id_subs_cache == NULL)
+	{
+		HASHCTL		hash_info;
+
+		MemSet(&hash_info, 0, sizeof(hash_info));
+		hash_info.keysize = sizeof(DmqStreamId);
+		hash_info.entrysize = sizeof(DmqStreamId) + sizeof(DmqCachedSubscriber);
+		dmq_id_subs_cache = hash_create("dmq_id_subs_cache",
+										DMQ_SUBS_CACHE_SIZE, &hash_info,
+										HASH_ELEM | HASH_BLOBS);
+	}
+
+	entry = hash_search(dmq_id_subs_cache, stream_id, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		DmqCachedSubscriber *cached;
+
+		cached = (DmqCachedSubscriber *) SUBSCRIBER_OF(entry, sizeof(DmqStreamId));
+		if (dmq_id_slot_matches(cached->s.procno, stream_id))
+		{
+			*sub = dmq_state->id_slots[cached->s.procno].s;
+			return true;
+		}
+		hash_search(dmq_id_subs_cache, stream_id, HASH_REMOVE, NULL);
+	}
+
+	if (stream_id->xid == 0)
+		return false;
+
+	bucket = DMQ_ID_BUCKET(stream_id);
+	SpinLockAcquire(&bucket->lock);
+	for (procno = bucket->head; procno != -1;
+		 procno = dmq_state->id_slots[procno].next)
+	{
+		if (dmq_id_slot_matches(procno, stream_id))
+		{
+			*sub = dmq_state->id_slots[procno].s;
+			found = true;
+			break;
+		}
+	}
+	SpinLockRelease(&bucket->lock);
+
+	if (found)
+		dmq_cache_subscriber(dmq_id_subs_cache, stream_id,
+							 sizeof(DmqStreamId), sub, 0);
+	return found;
+}
+
+/*
+ * Find subscriber of stream given either by name or by id. Cached named
+ * entry is valid as long as its backend hasn't (un)subscribed since we looked
+ * it up; otherwise consult the shared hash.
+ */
+static bool
+dmq_find_subscriber(const char *stream_name, const DmqStreamId *stream_id,
+					DmqSubscriber *sub)
+{
+	void	   *entry;
+	void	   *psub;
+	uint64		sub_gen = 0;
+	bool		found;
+
+	if (stream_name == NULL)
+		return dmq_find_id_subscriber(stream_id, sub);
+
+	if (dmq_subs_cache == NULL)
+	{
+		HASHCTL		hash_info;
+
+		MemSet(&hash_info, 0, sizeof(hash_info));
+		hash_info.keysize = DMQ_STREAM_NAME_MAXLEN;
+		hash_info.entrysize = DMQ_STREAM_NAME_MAXLEN + sizeof(DmqCachedSubscriber);
+		dmq_subs_cache = hash_create("dmq_subs_cache", DMQ_SUBS_CACHE_SIZE,
+									 &hash_info, HASH_ELEM);
+	}
+
+	entry = hash_search(dmq_subs_cache, stream_name, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		DmqCachedSubscriber *cached;
+
+		cached = (DmqCachedSubscriber *) SUBSCRIBER_OF(entry, DMQ_STREAM_NAME_MAXLEN);
+		if (pg_atomic_read_u64(&dmq_state->sub_gens[cached->s.procno]) ==
+			cached->sub_gen)
+		{
+			*sub = cached->s;
+			return true;
+		}
+	}
+
+	LWLockAcquire(dmq_state->lock, LW_SHARED);
+	psub = hash_search(dmq_subscriptions, stream_name, HASH_FIND, &found);
+	if (found)
+	{
+		*sub = *SUBSCRIBER_OF(psub, DMQ_STREAM_NAME_MAXLEN);
+		sub_gen = pg_atomic_read_u64(&dmq_state->sub_gens[sub->procno]);
+	}
+	LWLockRelease(dmq_state->lock);
+
+	if (!found)
+	{
+		if (entry != NULL)
+			hash_search(dmq_subs_cache, stream_name, HASH_REMOVE, NULL);
+		return false;
+	}
+
+	dmq_cache_subscriber(dmq_subs_cache, stream_name, DMQ_STREAM_NAME_MAXLEN,
+						 sub, sub_gen);
+	return true;
 }
 
 /* hand over message to the subscriber */
@@ -1018,20 +1658,27 @@ dmq_handle_message(StringInfo msg, DmqReceiverSlot *my_slot,
 				   dsm_segment **segs, shm_mq_handle **mq_handles,
 				   void *extra)
 {
-	const char *stream_name;
+	const char *stream_name = NULL;
+	DmqStreamId stream_id;
 	const char *body;
 	int			body_len;
-	bool		found;
-	DmqStreamSubscription sub;
-	DmqStreamSubscription *psub;
+	DmqSubscriber sub;
 	shm_mq_result res;
 
 	/*
-	 * Consume stream_name packed as a cstring and interpret rest of the data
-	 * as message body with unknown format that we are going to send down to
-	 * the subscribed backend.
+	 * Consume stream id or stream_name packed as a cstring and interpret rest
+	 * of the data as message body with unknown format that we are going to
+	 * send down to the subscribed backend.
 	 */
-	stream_name = pq_getmsgrawstring(msg);
+	if (msg->cursor < msg->len && msg->data[msg->cursor] == DMQ_STREAM_ID_MARK)
+	{
+		pq_getmsgbyte(msg);
+		stream_id.node_id = pq_getmsgint(msg, 4);
+		stream_id.pad = 0;
+		stream_id.xid = pq_getmsgint64(msg);
+	}
+	else
+		stream_name = pq_getmsgrawstring(msg);
 	body_len = msg->len - msg->cursor;
 	body = pq_getmsgbytes(msg, body_len);
 	pq_getmsgend(msg);
@@ -1039,13 +1686,14 @@ dmq_handle_message(StringInfo msg, DmqReceiverSlot *my_slot,
 	/*
 	 * Stream name "H" is reserved for heartbeats.
 	 */
-	if (strcmp(stream_name, "H") == 0)
+	if (stream_name != NULL && strcmp(stream_name, "H") == 0)
 	{
 		/*
 		 * Allow user to read a payload potentially written by
 		 * dmq_sender_heartbeat_hook
 		 */
-		if (dmq_receiver_heartbeat_hook != NULL)
+		if (dmq_receiver_heartbeat_hook != NULL &&
+			my_slot->lane == DMQ_LANE_RESPONSE)
 		{
 			StringInfoData body_s; /* skip stream name */
 
@@ -1058,24 +1706,12 @@ dmq_handle_message(StringInfo msg, DmqReceiverSlot *my_slot,
 		return;
 	}
 
-	/*
-	 * Find subscriber. XXX: we can cache that and re-read shared memory upon
-	 * a signal, but likely that won't show any measurable speedup.
-	 */
-	LWLockAcquire(dmq_state->lock, LW_SHARED);
-	psub = (DmqStreamSubscription *) hash_search(dmq_subscriptions,
-												 stream_name, HASH_FIND,
-												 &found);
 	/*
 	 * that's quite stupid, but gcc complains 'sub.procno etc might be used
 	 * uninitialized' without this
 	 */
-	MemSet(&sub, '\0', sizeof(DmqStreamSubscription));
-	if (found)
-		sub = *psub;
-	LWLockRelease(dmq_state->lock);
-
-	if (!found)
+	MemSet(&sub, '\0', sizeof(DmqSubscriber));
+	if (!dmq_find_subscriber(stream_name, &stream_id, &sub))
 	{
 		/*
 		 * Beware of using WARNING/NOTICEs in the receiver code; they will go
@@ -1084,7 +1720,19 @@ dmq_handle_message(StringInfo msg, DmqReceiverSlot *my_slot,
 		 */
 		mtm_log(COMMERROR,
 				"[DMQ] subscription %s is not found (body = %s), dropping message",
-				stream_name, body);
+				dmq_stream_str(stream_name, &stream_id), body);
+		return;
+	}
+
+	/*
+	 * Subscriber doesn't listen to this lane; sender pushed request with
+	 * dmq_push_buffer or vice versa.
+	 */
+	if (sub.lane != my_slot->lane)
+	{
+		mtm_log(COMMERROR,
+				"[DMQ] message to %s arrived via wrong lane, dropping it",
+				dmq_stream_str(stream_name, &stream_id));
 		return;
 	}
 
@@ -1106,8 +1754,8 @@ dmq_handle_message(StringInfo msg, DmqReceiverSlot *my_slot,
 	}
 
 	mtm_log(DmqTraceIncoming,
-			"[DMQ] got message %s.%s (len=%d), passing to %d", stream_name, body,
-			body_len, sub.procno);
+			"[DMQ] got message %s.%s (len=%d), passing to %d",
+			dmq_stream_str(stream_name, &stream_id), body, body_len, sub.procno);
 
 	/*
 	 * XXX: there used to be per-subscription support for dropping messages if
@@ -1130,7 +1778,33 @@ dmq_handle_message(StringInfo msg, DmqReceiverSlot *my_slot,
 		res = shm_mq_send(mq_handles[sub.procno], body_len, body, false);
 		if (res == SHM_MQ_DETACHED)
 			mtm_log(COMMERROR, "[DMQ] queue %d is detached, dropping message (stream=%s)",
-					sub.procno, stream_name);
+					sub.procno, dmq_stream_str(stream_name, &stream_id));
+	}
+}
+
+/* split batch frame (see dmq_send) or handle the single message */
+static void
+dmq_handle_frame(StringInfo frame, DmqReceiverSlot *my_slot,
+				 dsm_segment **segs, shm_mq_handle **mq_handles,
+				 void *extra)
+{
+	if (frame->cursor >= frame->len ||
+		frame->data[frame->cursor] != DMQ_BATCH_MARK)
+	{
+		dmq_handle_message(frame, my_slot, segs, mq_handles, extra);
+		return;
+	}
+
+	pq_getmsgbyte(frame);
+	while (frame->cursor < frame->len)
+	{
+		StringInfoData msg;
+		int			len = pq_getmsgint(frame, 4);
+
+		msg.data = (char *) pq_getmsgbytes(frame, len);
+		msg.len = msg.maxlen = len;
+		msg.cursor = 0;
+		dmq_handle_message(&msg, my_slot, segs, mq_handles, extra);
 	}
 }
 
@@ -1307,6 +1981,26 @@ _pq_getbyte_if_available(unsigned char *c)
 	return 0;
 }
 
+static void
+dmq_receiver_ensure_mq(DmqReceiverSlot *my_slot, DmqSubscriber *sub,
+					   dsm_segment **segs, shm_mq_handle **mq_handles)
+{
+	/* subscriber won't attach to the queue of another lane */
+	if (sub->lane != my_slot->lane)
+		return;
+
+	if (mq_handles[sub->procno] != NULL &&
+		my_slot->dsm_handles[sub->procno].procno_gen == sub->procno_gen)
+	{
+		/* queue is already good */
+		return;
+	}
+
+	dmq_receiver_recreate_mq(my_slot, sub->procno, sub->procno_gen,
+							 &segs[sub->procno], &mq_handles[sub->procno],
+							 true);
+}
+
 /*
  * For each subscription, create shm_mq to subscriber if we don't have it yet.
  */
@@ -1316,6 +2010,7 @@ dmq_receiver_recreate_mqs(DmqReceiverSlot *my_slot, dsm_segment **segs,
 {
 	HASH_SEQ_STATUS hash_seq;
 	DmqStreamSubscription *sub;
+	int			procno;
 
 	/*
 	 * can make separate lock for subs and create mqs after releasing the
@@ -1325,20 +2020,21 @@ dmq_receiver_recreate_mqs(DmqReceiverSlot *my_slot, dsm_segment **segs,
 
 	hash_seq_init(&hash_seq, dmq_subscriptions);
 	while ((sub = hash_seq_search(&hash_seq)) != NULL)
+		dmq_receiver_ensure_mq(my_slot, &sub->s, segs, mq_handles);
+
+	LWLockRelease(dmq_state->lock);
+
+	for (procno = 0; procno < MaxBackends; procno++)
 	{
-		if (mq_handles[sub->procno] != NULL &&
-			my_slot->dsm_handles[sub->procno].procno_gen == sub->procno_gen)
-		{
-			/* queue is already good */
-			continue;
-		}
+		DmqIdSlot  *slot = &dmq_state->id_slots[procno];
+		DmqSubscriber id_sub;
 
-		dmq_receiver_recreate_mq(my_slot, sub->procno, sub->procno_gen,
-								 &segs[sub->procno], &mq_handles[sub->procno],
-								 true);
+		if (pg_atomic_read_u64(&slot->xid) == 0)
+			continue;
+		pg_read_barrier();
+		id_sub = slot->s;
+		dmq_receiver_ensure_mq(my_slot, &id_sub, segs, mq_handles);
 	}
-
-	LWLockRelease(dmq_state->lock);
 	/* let subscribers know we are done */
 	ConditionVariableBroadcast(&dmq_state->shm_mq_creation_cv);
 }
@@ -1348,6 +2044,7 @@ dmq_receiver_at_exit(int status, Datum receiver)
 {
 	int			receiver_id = DatumGetInt32(receiver);
 	char		sender_name[DMQ_NAME_MAXLEN];
+	DmqLane		lane;
 
 	/*
 	 * We want the slot to be freed even if hook errors out, so order is
@@ -1356,16 +2053,36 @@ dmq_receiver_at_exit(int status, Datum receiver)
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
 	strncpy(sender_name, dmq_state->receivers[receiver_id].name,
 			DMQ_NAME_MAXLEN);
+	lane = dmq_state->receivers[receiver_id].lane;
 	dmq_state->receivers[receiver_id].name[0] = '\0';
 	LWLockRelease(dmq_state->lock);
 
 	/* tell subscribers it is pointless to wait for shm_mq creation */
 	ConditionVariableBroadcast(&dmq_state->shm_mq_creation_cv);
 
-	if (dmq_receiver_stop_hook)
+	if (dmq_receiver_stop_hook && lane == DMQ_LANE_RESPONSE)
 		dmq_receiver_stop_hook(sender_name);
 }
 
+/* caller must hold dmq_state->lock */
+static bool
+dmq_have_request_subscribers(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	DmqStreamSubscription *sub;
+
+	hash_seq_init(&hash_seq, dmq_subscriptions);
+	while ((sub = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (sub->s.lane == DMQ_LANE_REQUEST)
+		{
+			hash_seq_term(&hash_seq);
+			return true;
+		}
+	}
+	return false;
+}
+
 /* xxx should wrap all this in try/catch to turn any ERROR into FATAL */
 Datum
 dmq_receiver_loop(PG_FUNCTION_ARGS)
@@ -1385,13 +2102,21 @@ dmq_receiver_loop(PG_FUNCTION_ARGS)
 	int			j;
 	int			receiver_id = -1;
 	int			recv_timeout;
+	DmqLane		lane = DMQ_LANE_RESPONSE;
 	double		last_message_at = dmq_now();
 	void		*extra = NULL;
 
 	sender_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
 	recv_timeout = PG_GETARG_INT32(1);
+	if (PG_NARGS() > 2)
+		lane = PG_GETARG_INT32(2);
+	if (lane != DMQ_LANE_RESPONSE && lane != DMQ_LANE_REQUEST)
+		mtm_log(ERROR, "[DMQ] invalid lane %d", lane);
 
-	proc_name = psprintf("mtm-dmq-receiver %s", sender_name);
+	if (lane == DMQ_LANE_REQUEST)
+		proc_name = psprintf("mtm-dmq-receiver %s requests", sender_name);
+	else
+		proc_name = psprintf("mtm-dmq-receiver %s", sender_name);
 	set_ps_display(proc_name);
 
 	segs = palloc0(MaxBackends * sizeof(dsm_segment *));
@@ -1400,13 +2125,25 @@ dmq_receiver_loop(PG_FUNCTION_ARGS)
 	/* register ourself in dmq_state */
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
 
+	/*
+	 * Requests arriving before anyone serves them would be dropped, and the
+	 * requester would wait for the answer infinitely; let sender retry
+	 * later instead.
+	 */
+	if (lane == DMQ_LANE_REQUEST && !dmq_have_request_subscribers())
+	{
+		LWLockRelease(dmq_state->lock);
+		mtm_log(ERROR, "[DMQ] nobody serves requests yet");
+	}
+
 	for (i = 0; i < DMQ_MAX_RECEIVERS; i++)
 	{
 		if (dmq_state->receivers[i].name[0] == '\0') /* free slot */
 		{
 			receiver_id = i;
 		}
-		else if (strcmp(dmq_state->receivers[i].name, sender_name) == 0)
+		else if (strcmp(dmq_state->receivers[i].name, sender_name) == 0 &&
+				 dmq_state->receivers[i].lane == lane)
 		{
 			mtm_log(ERROR, "[DMQ] sender '%s' already connected", sender_name);
 		}
@@ -1416,6 +2153,7 @@ dmq_receiver_loop(PG_FUNCTION_ARGS)
 		mtm_log(ERROR, "[DMQ] maximum number of dmq-receivers reached");
 
 	strncpy(dmq_state->receivers[receiver_id].name, sender_name, DMQ_NAME_MAXLEN);
+	dmq_state->receivers[receiver_id].lane = lane;
 	dmq_state->receivers[receiver_id].pid = MyProcPid;
 	for (j = 0; j < MaxBackends; j++)
 		dmq_state->receivers[receiver_id].dsm_handles[j].h = DSM_HANDLE_INVALID;
@@ -1442,7 +2180,8 @@ dmq_receiver_loop(PG_FUNCTION_ARGS)
 
 	ModifyWaitEvent(FeBeWaitSetCompat(), 0, WL_SOCKET_READABLE, NULL);
 
-	if (dmq_receiver_start_hook)
+	/* request lane receiver doesn't get heartbeat payload, see sender */
+	if (dmq_receiver_start_hook && lane == DMQ_LANE_RESPONSE)
 		extra = dmq_receiver_start_hook(sender_name);
 
 	/* do not hold globalxmin. XXX: try to carefully release snaps */
@@ -1483,8 +2222,8 @@ dmq_receiver_loop(PG_FUNCTION_ARGS)
 
 			if (rc > 0)
 			{
-				dmq_handle_message(&s, &dmq_state->receivers[receiver_id],
-								   segs, mq_handles, extra);
+				dmq_handle_frame(&s, &dmq_state->receivers[receiver_id],
+								 segs, mq_handles, extra);
 				last_message_at = dmq_now();
 				reader_state = NeedByte;
 			}
@@ -1498,8 +2237,15 @@ dmq_receiver_loop(PG_FUNCTION_ARGS)
 			break;
 		}
 
-		nevents = WaitEventSetWait(FeBeWaitSetCompat(), 250, &event, 1,
-								   WAIT_EVENT_CLIENT_READ);
+		/*
+		 * Got something, so more messages might be already in recv_buffer;
+		 * socket wouldn't wake us up for them.
+		 */
+		if (rc > 0)
+			nevents = 0;
+		else
+			nevents = WaitEventSetWait(FeBeWaitSetCompat(), 250, &event, 1,
+									   WAIT_EVENT_CLIENT_READ);
 
 		if (nevents > 0 && event.events & WL_LATCH_SET)
 		{
@@ -1542,22 +2288,24 @@ void
 dmq_terminate_receiver(char *name)
 {
 	int			i;
-	pid_t		pid = 0;
+	int			n_pids = 0;
+	pid_t		pids[DMQ_N_LANES];
 
+	/* receivers of all lanes */
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
-	for (i = 0; i < DMQ_MAX_RECEIVERS; i++)
+	for (i = 0; i < DMQ_MAX_RECEIVERS && n_pids < DMQ_N_LANES; i++)
 	{
 		if (strncmp(dmq_state->receivers[i].name, name, DMQ_NAME_MAXLEN) == 0)
 		{
-			pid = dmq_state->receivers[i].pid;
-			Assert(pid > 0);
-			break;
+			pids[n_pids] = dmq_state->receivers[i].pid;
+			Assert(pids[n_pids] > 0);
+			n_pids++;
 		}
 	}
 	LWLockRelease(dmq_state->lock);
 
-	if (pid != 0)
-		kill(pid, SIGTERM);
+	for (i = 0; i < n_pids; i++)
+		kill(pids[i], SIGTERM);
 }
 
 
@@ -1567,8 +2315,37 @@ dmq_terminate_receiver(char *name)
  *
  *****************************************************************************/
 
+/*
+ * Tell the sender we have put something into our queue (or detached from it).
+ * Must be done after the queue change and before waking the sender; shm_mq
+ * wakes him by itself, but too early for us.
+ */
+static void
+dmq_ring_doorbell(int sender_id)
+{
+	int			procno = MyProc->pgprocno;
+
+	pg_atomic_fetch_or_u64(&READY_MASK(sender_id)[procno / 64],
+						   UINT64CONST(1) << (procno % 64));
+	if (dmq_local.mq_out_receiver[sender_id] != NULL)
+		SetLatch(&dmq_local.mq_out_receiver[sender_id]->procLatch);
+}
+
+static void
+dmq_outq_at_exit(int status, Datum arg)
+{
+	int			sender_id;
+
+	/* runs after dsm detach, so senders will find queues detached */
+	for (sender_id = 0; sender_id < dmq_n_senders; sender_id++)
+	{
+		if (dmq_local.mq_outh[sender_id] != NULL)
+			dmq_ring_doorbell(sender_id);
+	}
+}
+
 static void
-ensure_outq_handle()
+ensure_outq_handle(int sender_id)
 {
 	dsm_segment *seg;
 	shm_toc    *toc;
@@ -1577,10 +2354,10 @@ ensure_outq_handle()
 	my_shm_mq *my_mq;
 
 
-	if (dmq_local.mq_outh != NULL)
+	if (dmq_local.mq_outh[sender_id] != NULL)
 		return;
 
-	seg = dsm_attach(dmq_state->out_dsm);
+	seg = dsm_attach(dmq_state->out_dsm[sender_id]);
 	if (seg == NULL)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
@@ -1605,8 +2382,39 @@ ensure_outq_handle()
 	shm_mq_set_sender(outq, MyProc);
 
 	oldctx = MemoryContextSwitchTo(TopMemoryContext);
-	dmq_local.mq_outh = shm_mq_attach(outq, seg, NULL);
+	dmq_local.mq_outh[sender_id] = shm_mq_attach(outq, seg, NULL);
 	MemoryContextSwitchTo(oldctx);
+
+	dmq_local.mq_out_receiver[sender_id] = shm_mq_get_receiver(outq);
+	if (!dmq_local.outq_exit_registered)
+	{
+		on_shmem_exit(dmq_outq_at_exit, (Datum) 0);
+		dmq_local.outq_exit_registered = true;
+	}
+}
+
+/*
+ * shm_mq_send, ringing the doorbell after each portion of data written:
+ * message larger than the queue is transferred in several rounds, and sender
+ * must learn about each of them.
+ */
+static shm_mq_result
+dmq_shm_mq_send(int sender_id, Size len, const void *data)
+{
+	shm_mq_result res;
+
+	for (;;)
+	{
+		res = shm_mq_send(dmq_local.mq_outh[sender_id], len, data, true);
+		dmq_ring_doorbell(sender_id);
+		if (res != SHM_MQ_WOULD_BLOCK)
+			return res;
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, 0,
+						 WAIT_EVENT_MQ_SEND);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
 }
 
 void
@@ -1615,10 +2423,10 @@ dmq_push(DmqDestinationId dest_id, char *stream_name, char *msg)
 	shm_mq_result res;
 	StringInfoData buf;
 
-	ensure_outq_handle();
+	ensure_outq_handle(DMQ_SENDER_OF(dest_id));
 
 	initStringInfo(&buf);
-	pq_sendbyte(&buf, dest_id);
+	pq_sendbyte(&buf, DMQ_CONN_ID(dest_id, DMQ_LANE_RESPONSE));
 	pq_sendbytes(&buf, stream_name, strlen(stream_name) + 1);
 	pq_send_ascii_string(&buf, msg);
 
@@ -1626,24 +2434,26 @@ dmq_push(DmqDestinationId dest_id, char *stream_name, char *msg)
 			buf.len, buf.len, buf.data);
 
 	/* XXX: use sendv instead */
-	res = shm_mq_send(dmq_local.mq_outh, buf.len, buf.data, false);
+	res = dmq_shm_mq_send(DMQ_SENDER_OF(dest_id), buf.len, buf.data);
 	pfree(buf.data);
 	if (res != SHM_MQ_SUCCESS)
 		mtm_log(ERROR, "[DMQ] dmq_push: can't send to queue");
 }
 
 
-void
-dmq_push_buffer(DmqDestinationId dest_id, char *stream_name, const void *payload, size_t len)
+static void
+dmq_push_buffer_lane(DmqDestinationId dest_id, DmqLane lane, char *stream_name,
+					 const void *payload, size_t len)
 {
 	StringInfoData buf;
 	shm_mq_result res;
 
-	ensure_outq_handle();
+	ensure_outq_handle(DMQ_SENDER_OF(dest_id));
 
 	initStringInfo(&buf);
-	pq_sendbyte(&buf, dest_id);
+	pq_sendbyte(&buf, DMQ_CONN_ID(dest_id, lane));
 	Assert(strlen(stream_name) + 1 <= DMQ_STREAM_NAME_MAXLEN);
+	Assert(stream_name[0] != DMQ_STREAM_ID_MARK);
 	pq_sendbytes(&buf, stream_name, strlen(stream_name) + 1);
 	pq_sendbytes(&buf, payload, len);
 
@@ -1651,7 +2461,70 @@ dmq_push_buffer(DmqDestinationId dest_id, char *stream_name, const void *payload
 			buf.len, buf.len, buf.data);
 
 	/* XXX: use sendv instead */
-	res = shm_mq_send(dmq_local.mq_outh, buf.len, buf.data, false);
+	res = dmq_shm_mq_send(DMQ_SENDER_OF(dest_id), buf.len, buf.data);
+	pfree(buf.data);
+	if (res != SHM_MQ_SUCCESS)
+		mtm_log(WARNING, "[DMQ] dmq_push: can't send to queue");
+}
+
+void
+dmq_push_buffer(DmqDestinationId dest_id, char *stream_name, const void *payload, size_t len)
+{
+	dmq_push_buffer_lane(dest_id, DMQ_LANE_RESPONSE, stream_name, payload, len);
+}
+
+/*
+ * Push a message the counterparty is going to answer. It goes through the
+ * request lane; if that lane reconnects before we get the answer, the
+ * request might have been lost and dmq_pop_nb reports the counterparty as
+ * failed, so caller must be subscribed to the reply stream by now.
+ */
+void
+dmq_push_request(DmqDestinationId dest_id, char *stream_name, const void *payload, size_t len)
+{
+	int8		mask_pos = dmq_state->destinations[dest_id].mask_pos;
+
+	/* the oldest in-flight request counts */
+	if (!BIT_CHECK(dmq_local.req_pending, mask_pos))
+	{
+		dmq_local.req_sconn_cnt[mask_pos] = dmq_state->sconn_cnt[mask_pos];
+		BIT_SET(dmq_local.req_pending, mask_pos);
+	}
+
+	dmq_push_buffer_lane(dest_id, DMQ_LANE_REQUEST, stream_name, payload, len);
+}
+
+/*
+ * Caller got the answer to its dmq_push_request to mask_pos, so reconnect of
+ * the request lane doesn't lose anything anymore. Must be called only for
+ * the right answer: stale replies of earlier requests may arrive as well.
+ */
+void
+dmq_request_answered(int8 mask_pos)
+{
+	BIT_CLEAR(dmq_local.req_pending, mask_pos);
+}
+
+void
+dmq_push_buffer_id(DmqDestinationId dest_id, DmqStreamId stream_id,
+				   const void *payload, size_t len)
+{
+	StringInfoData buf;
+	shm_mq_result res;
+
+	ensure_outq_handle(DMQ_SENDER_OF(dest_id));
+
+	initStringInfo(&buf);
+	pq_sendbyte(&buf, DMQ_CONN_ID(dest_id, DMQ_LANE_RESPONSE));
+	pq_sendbyte(&buf, DMQ_STREAM_ID_MARK);
+	pq_sendint32(&buf, stream_id.node_id);
+	pq_sendint64(&buf, stream_id.xid);
+	pq_sendbytes(&buf, payload, len);
+
+	mtm_log(DmqTraceOutgoing, "[DMQ] pushing l=%d to stream %d/" UINT64_FORMAT,
+			buf.len, stream_id.node_id, stream_id.xid);
+
+	res = dmq_shm_mq_send(DMQ_SENDER_OF(dest_id), buf.len, buf.data);
 	pfree(buf.data);
 	if (res != SHM_MQ_SUCCESS)
 		mtm_log(WARNING, "[DMQ] dmq_push: can't send to queue");
@@ -1698,7 +2571,8 @@ dmq_reattach_shm_mq(int handle_id)
 
 			/* XXX: change to hash maybe */
 			if (strcmp(rslot->name,
-					   dmq_local.inhandles[handle_id].name) == 0)
+					   dmq_local.inhandles[handle_id].name) == 0 &&
+				rslot->lane == dmq_local.lane)
 			{
 				receiver_pid = rslot->pid;
 
@@ -1887,11 +2761,31 @@ void dmq_reattach_receivers(void)
  * local mem and automatically unsubscribe all of them on exit), but currently
  * there is no real need for that.
  */
-void
-dmq_stream_subscribe(char *stream_name)
+/* drop our queues from receivers of another lane */
+static void
+dmq_switch_lane(DmqLane lane)
+{
+	int			i;
+
+	for (i = 0; i < dmq_local.n_inhandles; i++)
+	{
+		if (dmq_local.inhandles[i].dsm_seg != NULL)
+		{
+			/* mq is detached automatically in dsm detach cb */
+			dsm_detach(dmq_local.inhandles[i].dsm_seg);
+			dmq_local.inhandles[i].dsm_seg = NULL;
+		}
+		dmq_local.inhandles[i].mqh = NULL;
+	}
+	dmq_local.lane = lane;
+}
+
+static void
+dmq_stream_subscribe_internal(const char *stream_name,
+							  const DmqStreamId *stream_id, DmqLane lane)
 {
 	bool		found;
-	DmqStreamSubscription *sub;
+	DmqSubscriber *sub;
 
 	/*
 	 * If our process subscribes for the first time obtain a procno gen.
@@ -1904,19 +2798,55 @@ dmq_stream_subscribe(char *stream_name)
 				MyProc->pgprocno, dmq_local.my_procno_gen);
 	}
 
-	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
-	sub = (DmqStreamSubscription *) hash_search(dmq_subscriptions, stream_name,
-												HASH_ENTER, &found);
-	if (found)
+	if (stream_name != NULL)
 	{
-		mtm_log(ERROR,
-				"[DMQ] procno %d: %s: subscription is already active for procno %d / %s",
-				MyProc->pgprocno, stream_name, sub->procno, sub->stream_name);
+		LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
+		sub = &((DmqStreamSubscription *)
+				hash_search(dmq_subscriptions, stream_name,
+							HASH_ENTER, &found))->s;
+		if (found)
+		{
+			mtm_log(ERROR,
+					"[DMQ] procno %d: %s: subscription is already active for procno %d",
+					MyProc->pgprocno, stream_name, sub->procno);
+		}
+		sub->procno = MyProc->pgprocno;
+		sub->procno_gen = dmq_local.my_procno_gen;
+		sub->lane = lane;
+		pg_atomic_fetch_add_u64(&dmq_state->sub_gens[MyProc->pgprocno], 1);
+		LWLockRelease(dmq_state->lock);
+	}
+	else
+	{
+		/* no locks: the slot is ours, see DmqIdSlot */
+		DmqIdSlot  *slot = &dmq_state->id_slots[MyProc->pgprocno];
+		DmqIdBucket *bucket = DMQ_ID_BUCKET(stream_id);
+
+		Assert(stream_id->xid != 0);
+		Assert(pg_atomic_read_u64(&slot->xid) == 0);
+		slot->node_id = stream_id->node_id;
+		slot->s.procno = MyProc->pgprocno;
+		slot->s.procno_gen = dmq_local.my_procno_gen;
+		slot->s.lane = lane;
+		pg_write_barrier();
+		pg_atomic_write_u64(&slot->xid, stream_id->xid);
+
+		SpinLockAcquire(&bucket->lock);
+		slot->next = bucket->head;
+		bucket->head = MyProc->pgprocno;
+		SpinLockRelease(&bucket->lock);
+	}
+
+	if (lane != dmq_local.lane)
+		dmq_switch_lane(lane);
+	dmq_local.req_pending = 0;
+	if (stream_name != NULL)
+		strncpy(dmq_local.curr_stream_name, stream_name, DMQ_STREAM_NAME_MAXLEN);
+	else
+	{
+		dmq_local.curr_stream_is_id = true;
+		dmq_local.curr_stream_id = *stream_id;
 	}
-	sub->procno = MyProc->pgprocno;
-	sub->procno_gen = dmq_local.my_procno_gen;
-	LWLockRelease(dmq_state->lock);
-	strncpy(dmq_local.curr_stream_name, stream_name, DMQ_STREAM_NAME_MAXLEN);
 
 	/*
 	 * The typical usage is
@@ -1930,40 +2860,71 @@ dmq_stream_subscribe(char *stream_name)
 	dmq_reattach_receivers();
 }
 
-/* unsubscribe from the current stream */
 void
-dmq_stream_unsubscribe(void)
+dmq_stream_subscribe(char *stream_name)
 {
-	bool		found;
-
-	if (dmq_local.curr_stream_name[0] == '\0')
-		return;
-
-	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
-	hash_search(dmq_subscriptions, dmq_local.curr_stream_name, HASH_REMOVE,
-				&found);
-	LWLockRelease(dmq_state->lock);
-	dmq_local.curr_stream_name[0] = '\0';
+	Assert(stream_name[0] != DMQ_STREAM_ID_MARK);
+	dmq_stream_subscribe_internal(stream_name, NULL, DMQ_LANE_RESPONSE);
+}
 
-	Assert(found);
+/* same as dmq_stream_subscribe, but for stream identified by id */
+void
+dmq_stream_subscribe_id(DmqStreamId stream_id)
+{
+	dmq_stream_subscribe_internal(NULL, &stream_id, DMQ_LANE_RESPONSE);
 }
 
 /*
- * Fills (preallocated) sconn_cnt with current values of sender
- * connection counters to guys in participants mask (as registered in
- * dmq_destination_add), which allows to reveal connection failures, possibly
- * resulted in losing request -- and thus stop hopeless waiting for response.
+ * Subscribe to stream receiving dmq_push_request messages. Receiving via
+ * request lane doesn't report connection failures in dmq_pop_nb: whoever
+ * serves requests doesn't wait for anything in particular.
  */
 void
-dmq_get_sendconn_cnt(uint64 participants, int *sconn_cnt)
+dmq_stream_subscribe_requests(char *stream_name)
 {
-	int i;
+	Assert(stream_name[0] != DMQ_STREAM_ID_MARK);
+	dmq_stream_subscribe_internal(stream_name, NULL, DMQ_LANE_REQUEST);
+}
 
-	for (i = 0; i < DMQ_N_MASK_POS; i++)
+/* unsubscribe from the current stream */
+void
+dmq_stream_unsubscribe(void)
+{
+	bool		found;
+
+	if (dmq_local.curr_stream_name[0] == '\0' && !dmq_local.curr_stream_is_id)
+		return;
+
+	if (dmq_local.curr_stream_is_id)
 	{
-		if (BIT_CHECK(participants, i))
-			sconn_cnt[i] = dmq_state->sconn_cnt[i];
+		DmqIdBucket *bucket = DMQ_ID_BUCKET(&dmq_local.curr_stream_id);
+		int		   *link;
+
+		SpinLockAcquire(&bucket->lock);
+		link = &bucket->head;
+		while (*link != -1 && *link != MyProc->pgprocno)
+			link = &dmq_state->id_slots[*link].next;
+		Assert(*link == MyProc->pgprocno);
+		if (*link != -1)
+			*link = dmq_state->id_slots[MyProc->pgprocno].next;
+		SpinLockRelease(&bucket->lock);
+
+		pg_atomic_write_u64(&dmq_state->id_slots[MyProc->pgprocno].xid, 0);
+		found = true;
 	}
+	else
+	{
+		LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
+		hash_search(dmq_subscriptions, dmq_local.curr_stream_name,
+					HASH_REMOVE, &found);
+		pg_atomic_fetch_add_u64(&dmq_state->sub_gens[MyProc->pgprocno], 1);
+		LWLockRelease(dmq_state->lock);
+	}
+	dmq_local.curr_stream_name[0] = '\0';
+	dmq_local.curr_stream_is_id = false;
+	dmq_local.req_pending = 0;
+
+	Assert(found);
 }
 
 /* XXX: this is never used, not well maintained and should be removed */
@@ -2053,6 +3014,13 @@ dmq_pop(int8 *sender_mask_pos, StringInfo msg, uint64 mask)
  * this reattach acts like an error flush (the error won't be reported again)
  * and at the same time a reconnection attempt.
  *
+ * Requests might also be lost in the other direction: counterparty we've
+ * sent dmq_push_request to since subscription is reported as failed (once)
+ * if the request lane to it has reconnected since then.
+ *
+ * Subscribers of request lane don't get failures at all; dead queues are
+ * silently reattached.
+ *
  * Returns true if successfully filled msg, false otherwise; in the latter
  * case, *wait is true if failed shmem_mq was successfully reestablished,
  * i.e. caller might not haste to exclude the failed sender (if any).
@@ -2064,10 +3032,29 @@ dmq_pop_nb(int8 *sender_mask_pos, StringInfo msg, uint64 mask, bool *wait)
 	shm_mq_result res;
 	int			i;
 	uint64 unchecked_participants = mask;
+	uint64		pending = dmq_local.req_pending & mask;
 
 	*wait = true;
 	*sender_mask_pos = -1;
 
+	while (pending != 0)
+	{
+		int			mask_pos = pg_rightmost_one_pos64(pending);
+		int			cnt = dmq_state->sconn_cnt[mask_pos];
+
+		pending &= pending - 1;
+		if (dmq_local.req_sconn_cnt[mask_pos] == DMQSCONN_DEAD ||
+			dmq_local.req_sconn_cnt[mask_pos] != cnt)
+		{
+			BIT_CLEAR(dmq_local.req_pending, mask_pos);
+			*sender_mask_pos = mask_pos;
+			mtm_log(DmqTraceIncoming,
+					"[DMQ] dmq_pop_nb: request lane to %d reconnected, request might be lost",
+					mask_pos);
+			return false;
+		}
+	}
+
 	for (i = 0; i < dmq_local.n_inhandles; i++)
 	{
 		Size		len;
@@ -2082,6 +3069,14 @@ dmq_pop_nb(int8 *sender_mask_pos, StringInfo msg, uint64 mask, bool *wait)
 		else
 			res = SHM_MQ_DETACHED;
 
+		if (res == SHM_MQ_DETACHED && dmq_local.lane == DMQ_LANE_REQUEST)
+		{
+			if (dmq_reattach_shm_mq(i))
+				*wait = false;
+			BIT_CLEAR(unchecked_participants, dmq_local.inhandles[i].mask_pos);
+			continue;
+		}
+
 		if (res == SHM_MQ_SUCCESS)
 		{
 			msg->data = data;
@@ -2128,25 +3123,47 @@ dmq_pop_nb(int8 *sender_mask_pos, StringInfo msg, uint64 mask, bool *wait)
 }
 
 /*
- * Accepts bitmask of participants and sconn_cnt counters with send
- * connections counters as passed to (and the latter filled by)
- * dmq_fill_sconn_cnt, returns this mask after unsetting bits for those
- * counterparties with whom we've lost the send connection since.
+ * Set latches of all subscribed backends, e.g. to make them reconsider
+ * whether waiting for the answer still makes sense.
  */
-uint64
-dmq_purge_failed_participants(uint64 participants, int *sconn_cnt)
+void
+dmq_wake_subscribers(void)
 {
-	int i;
-	uint64 res = participants;
+	HASH_SEQ_STATUS hash_seq;
+	DmqStreamSubscription *sub;
+	int			procno;
 
-	for (i = 0; i < DMQ_N_MASK_POS; i++)
+	LWLockAcquire(dmq_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, dmq_subscriptions);
+	while ((sub = hash_seq_search(&hash_seq)) != NULL)
+		SetLatch(&ProcGlobal->allProcs[sub->s.procno].procLatch);
+
+	LWLockRelease(dmq_state->lock);
+
+	for (procno = 0; procno < MaxBackends; procno++)
+	{
+		if (pg_atomic_read_u64(&dmq_state->id_slots[procno].xid) != 0)
+			SetLatch(&ProcGlobal->allProcs[procno].procLatch);
+	}
+}
+
+/* make senders reread destinations */
+static void
+dmq_signal_senders(void)
+{
+	pid_t		sender_pids[DMQ_MAX_SENDERS];
+	int			i;
+
+	LWLockAcquire(dmq_state->lock, LW_SHARED);
+	memcpy(sender_pids, dmq_state->sender_pid, sizeof(sender_pids));
+	LWLockRelease(dmq_state->lock);
+
+	for (i = 0; i < dmq_n_senders; i++)
 	{
-		if (BIT_CHECK(participants, i) &&
-			(sconn_cnt[i] == DMQSCONN_DEAD ||
-			 sconn_cnt[i] != dmq_state->sconn_cnt[i]))
-			BIT_CLEAR(res, i);
+		if (sender_pids[i])
+			kill(sender_pids[i], SIGHUP);
 	}
-	return res;
 }
 
 /*
@@ -2159,7 +3176,6 @@ dmq_destination_add(char *connstr, char *sender_name, char *receiver_name,
 					int8 recv_mask_pos, int recv_timeout)
 {
 	DmqDestinationId dest_id;
-	pid_t		sender_pid;
 
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
 	for (dest_id = 0; dest_id < DMQ_MAX_DESTINATIONS; dest_id++)
@@ -2177,11 +3193,9 @@ dmq_destination_add(char *connstr, char *sender_name, char *receiver_name,
 			break;
 		}
 	}
-	sender_pid = dmq_state->sender_pid;
 	LWLockRelease(dmq_state->lock);
 
-	if (sender_pid)
-		kill(sender_pid, SIGHUP);
+	dmq_signal_senders();
 
 	if (dest_id == DMQ_MAX_DESTINATIONS)
 		mtm_log(ERROR, "Can't add new destination. DMQ_MAX_DESTINATIONS reached.");
@@ -2194,7 +3208,6 @@ void
 dmq_destination_drop(char *receiver_name)
 {
 	DmqDestinationId dest_id;
-	pid_t		sender_pid;
 
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
 	for (dest_id = 0; dest_id < DMQ_MAX_DESTINATIONS; dest_id++)
@@ -2210,11 +3223,9 @@ dmq_destination_drop(char *receiver_name)
 				break;
 		}
 	}
-	sender_pid = dmq_state->sender_pid;
 	LWLockRelease(dmq_state->lock);
 
-	if (sender_pid)
-		kill(sender_pid, SIGHUP);
+	dmq_signal_senders();
 }
 
 /* ask dmq sender to reconnect */
@@ -2222,7 +3233,6 @@ void
 dmq_destination_reconnect(char *receiver_name)
 {
 	DmqDestinationId dest_id;
-	pid_t		sender_pid;
 
 	LWLockAcquire(dmq_state->lock, LW_EXCLUSIVE);
 	for (dest_id = 0; dest_id < DMQ_MAX_DESTINATIONS; dest_id++)
@@ -2238,9 +3248,7 @@ dmq_destination_reconnect(char *receiver_name)
 				break;
 		}
 	}
-	sender_pid = dmq_state->sender_pid;
 	LWLockRelease(dmq_state->lock);
 
-	if (sender_pid)
-		kill(sender_pid, SIGHUP);
+	dmq_signal_senders();
 }
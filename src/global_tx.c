@@ -19,10 +19,13 @@
 
 #include "postgres.h"
 
+#include <ctype.h>
+
 #include "access/twophase.h"
 #include "catalog/pg_authid.h"
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
+#include "pgstat.h"
 #include "storage/ipc.h"
 #include "utils/lsyscache.h"
 #include "utils/pg_lsn.h"
@@ -38,6 +41,9 @@ gtx_shared_data *gtx_shared;
 static GlobalTx *my_locked_gtx;
 static bool gtx_exit_registered;
 
+PG_FUNCTION_INFO_V1(mtm_global_tx_lookup_check);
+PG_FUNCTION_INFO_V1(mtm_xstate_check);
+
 char const *const GlobalTxStatusMnem[] =
 {
 	"GTXInvalid",
@@ -67,50 +73,129 @@ term_cmp(GlobalTxTerm t1, GlobalTxTerm t2)
 		return 1;
 }
 
-#define XStateVersion 1
+/*
+ * state_3pc is written on each prepare and precommit and parsed on each
+ * apply of them, so it is a fixed size record rather than printf'ed text.
+ * The core stores and replicates it as a cstring though, so the record is
+ * encoded with 6 bits per char (base64 alphabet, no padding) and prefixed
+ * with XSTATE_BINARY_MARK. Record layout, integers are little endian:
+ *
+ *	0	version (XStateVersion)
+ *	1	status
+ *	2	coordinator
+ *	3	proposal.node_id
+ *	4	accepted.node_id
+ *	5	reserved, zero (2 bytes)
+ *	7	proposal.ballot (4 bytes)
+ *	11	accepted.ballot (4 bytes)
+ *	15	xid (8 bytes)
+ *	23	gen_num (8 bytes)
+ *	31	configured (8 bytes)
+ *
+ * Version 1 was text "1-coordinator-xid-gen_num-configured-status-
+ * proposal-accepted"; it is still accepted on read so that xacts prepared
+ * before upgrade can be resolved. Their state is rewritten in the new format
+ * on the next update.
+ */
+#define XStateVersion 2
+#define XSTATE_BINARY_MARK '#'
+#define XSTATE_RECORD_SIZE 39
+#define XSTATE_ENCODED_LEN (1 + XSTATE_RECORD_SIZE / 3 * 4)
+
+StaticAssertDecl(XSTATE_RECORD_SIZE % 3 == 0,
+				 "xstate record must be encoded without padding");
+StaticAssertDecl(MTM_MAX_NODES <= PG_UINT8_MAX,
+				 "node id must fit into xstate record byte");
+
+static const char xstate_alphabet[] =
+"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline int
+xstate_char_value(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+static inline void
+xstate_put(uint8 *rec, int off, uint64 val, int size)
+{
+	int			i;
+
+	for (i = 0; i < size; i++)
+		rec[off + i] = (uint8) (val >> (8 * i));
+}
+
+static inline uint64
+xstate_get(const uint8 *rec, int off, int size)
+{
+	uint64		val = 0;
+	int			i;
+
+	for (i = 0; i < size; i++)
+		val |= (uint64) rec[off + i] << (8 * i);
+	return val;
+}
 
 char *
 serialize_xstate(XactInfo *xinfo, GTxState *gtx_state)
 {
-	char	   *state;
-	char	   *status_abbr;
-
-	if (gtx_state->status == GTXInvalid)
-		status_abbr = "in";
-	else if (gtx_state->status == GTXPreCommitted)
-		status_abbr = "pc";
-	else if (gtx_state->status == GTXPreAborted)
-		status_abbr = "pa";
-	else if (gtx_state->status == GTXCommitted)
-		status_abbr = "cm";
-	else
+	uint8		rec[XSTATE_RECORD_SIZE];
+	char	   *state = palloc(XSTATE_ENCODED_LEN + 1);
+	char	   *out = state;
+	int			i;
+
+	Assert(xinfo->coordinator >= 0 && xinfo->coordinator <= MTM_MAX_NODES);
+	Assert(gtx_state->proposal.node_id >= 0 &&
+		   gtx_state->proposal.node_id <= MTM_MAX_NODES);
+	Assert(gtx_state->accepted.node_id >= 0 &&
+		   gtx_state->accepted.node_id <= MTM_MAX_NODES);
+
+	rec[0] = XStateVersion;
+	rec[1] = (uint8) gtx_state->status;
+	rec[2] = (uint8) xinfo->coordinator;
+	rec[3] = (uint8) gtx_state->proposal.node_id;
+	rec[4] = (uint8) gtx_state->accepted.node_id;
+	rec[5] = rec[6] = 0;
+	xstate_put(rec, 7, (uint32) gtx_state->proposal.ballot, 4);
+	xstate_put(rec, 11, (uint32) gtx_state->accepted.ballot, 4);
+	xstate_put(rec, 15, xinfo->xid, 8);
+	xstate_put(rec, 23, xinfo->gen_num, 8);
+	xstate_put(rec, 31, xinfo->configured, 8);
+
+	*out++ = XSTATE_BINARY_MARK;
+	for (i = 0; i < XSTATE_RECORD_SIZE; i += 3)
 	{
-		Assert(gtx_state->status == GTXAborted);
-		status_abbr = "ab";
+		uint32		chunk = (rec[i] << 16) | (rec[i + 1] << 8) | rec[i + 2];
+
+		*out++ = xstate_alphabet[(chunk >> 18) & 0x3F];
+		*out++ = xstate_alphabet[(chunk >> 12) & 0x3F];
+		*out++ = xstate_alphabet[(chunk >> 6) & 0x3F];
+		*out++ = xstate_alphabet[chunk & 0x3F];
 	}
+	*out = '\0';
+	Assert(out - state == XSTATE_ENCODED_LEN);
 
-	state = psprintf("%d-%d-" XID_FMT "-%" INT64_MODIFIER "X-%" INT64_MODIFIER "X-%s-%d:%d-%d:%d",
-					 XStateVersion,
-					 xinfo->coordinator,
-					 xinfo->xid,
-					 xinfo->gen_num,
-					 xinfo->configured,
-					 status_abbr,
-					 gtx_state->proposal.ballot, gtx_state->proposal.node_id,
-					 gtx_state->accepted.ballot, gtx_state->accepted.node_id);
 	return state;
 }
 
-/* returns 0 on success */
-int
-deserialize_xstate(const char *state, XactInfo *xinfo, GTxState *gtx_state,
-				   int elevel)
+/* version 1 text state, see comment above XStateVersion */
+static int
+deserialize_xstate_text(const char *state, XactInfo *xinfo,
+						GTxState *gtx_state, int elevel)
 {
 	int			n_parsed = 0;
 	char		status_abbr[3]; /* must be big enough for '\0' */
 
-	Assert(state);
-
 	n_parsed = sscanf(state, "%*d-%d-" XID_FMT "-%" INT64_MODIFIER "X-%" INT64_MODIFIER "X-%2s-%d:%d-%d:%d",
 					  &xinfo->coordinator,
 					  &xinfo->xid,
@@ -144,6 +229,59 @@ deserialize_xstate(const char *state, XactInfo *xinfo, GTxState *gtx_state,
 	return 0;
 }
 
+/* returns 0 on success */
+int
+deserialize_xstate(const char *state, XactInfo *xinfo, GTxState *gtx_state,
+				   int elevel)
+{
+	uint8		rec[XSTATE_RECORD_SIZE];
+	const char *in = state + 1;
+	int			i;
+
+	Assert(state);
+
+	if (state[0] != XSTATE_BINARY_MARK)
+		return deserialize_xstate_text(state, xinfo, gtx_state, elevel);
+
+	if (strlen(state) != XSTATE_ENCODED_LEN)
+		goto bad_state;
+
+	for (i = 0; i < XSTATE_RECORD_SIZE; i += 3)
+	{
+		int			v0 = xstate_char_value(*in++);
+		int			v1 = xstate_char_value(*in++);
+		int			v2 = xstate_char_value(*in++);
+		int			v3 = xstate_char_value(*in++);
+		uint32		chunk;
+
+		if ((v0 | v1 | v2 | v3) < 0)
+			goto bad_state;
+		chunk = (v0 << 18) | (v1 << 12) | (v2 << 6) | v3;
+		rec[i] = (uint8) (chunk >> 16);
+		rec[i + 1] = (uint8) (chunk >> 8);
+		rec[i + 2] = (uint8) chunk;
+	}
+
+	if (rec[0] != XStateVersion || rec[1] > GTXAborted)
+		goto bad_state;
+
+	gtx_state->status = (GlobalTxStatus) rec[1];
+	xinfo->coordinator = rec[2];
+	gtx_state->proposal.node_id = rec[3];
+	gtx_state->accepted.node_id = rec[4];
+	gtx_state->proposal.ballot = (int32) xstate_get(rec, 7, 4);
+	gtx_state->accepted.ballot = (int32) xstate_get(rec, 11, 4);
+	xinfo->xid = (TransactionId) xstate_get(rec, 15, 8);
+	xinfo->gen_num = xstate_get(rec, 23, 8);
+	xinfo->configured = xstate_get(rec, 31, 8);
+	return 0;
+
+bad_state:
+	mtm_log(elevel, "GlobalTxLoadAll: failed to deparse state_3pc %s, ignoring it",
+			state);
+	return -1;
+}
+
 void
 GlobalTxAtExit(int code, Datum arg)
 {
@@ -158,11 +296,13 @@ MtmGlobalTxInit()
 
 	size = add_size(size, sizeof(gtx_shared_data));
 	size = add_size(size, hash_estimate_size(2*MaxConnections,
+											 sizeof(GlobalTxByXid)));
+	size = add_size(size, hash_estimate_size(Max(max_prepared_xacts, 1),
 											 sizeof(GlobalTx)));
 	size = MAXALIGN(size);
 
 	RequestAddinShmemSpace(size);
-	RequestNamedLWLockTranche("mtm-gtx-lock", 1);
+	RequestNamedLWLockTranche("mtm-gtx-lock", GTX_NUM_PARTITIONS);
 }
 
 void
@@ -171,10 +311,6 @@ MtmGlobalTxShmemStartup(void)
 	HASHCTL		info;
 	bool		found;
 
-	memset(&info, 0, sizeof(info));
-	info.keysize = GIDSIZE;
-	info.entrysize = sizeof(GlobalTx);
-
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
 	gtx_shared = ShmemInitStruct("mtm-gtx",
@@ -182,10 +318,29 @@ MtmGlobalTxShmemStartup(void)
 								 &found);
 
 	if (!found)
-		gtx_shared->lock = &(GetNamedLWLockTranche("mtm-gtx-lock"))->lock;
+	{
+		int			i;
 
-	gtx_shared->gid2gtx = ShmemInitHash("gid2gtx", 2*MaxConnections, 2*MaxConnections,
-							&info, HASH_ELEM);
+		gtx_shared->locks = GetNamedLWLockTranche("mtm-gtx-lock");
+		for (i = 0; i < GTX_NUM_PARTITIONS; i++)
+			ConditionVariableInit(&gtx_shared->release_cvs[i]);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(GlobalTxKey);
+	info.entrysize = sizeof(GlobalTxByXid);
+	info.num_partitions = GTX_NUM_PARTITIONS;
+	gtx_shared->xid2gtx = ShmemInitHash("xid2gtx", 2*MaxConnections, 2*MaxConnections,
+							&info, HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = GIDSIZE;
+	info.entrysize = sizeof(GlobalTx);
+	info.num_partitions = GTX_NUM_PARTITIONS;
+	/* only explicit 2PC lands here, so it is bounded by prepared xacts */
+	gtx_shared->gid2gtx = ShmemInitHash("gid2gtx",
+							Max(max_prepared_xacts, 1), Max(max_prepared_xacts, 1),
+							&info, HASH_ELEM | HASH_PARTITION);
 
 	LWLockRelease(AddinShmemInitLock);
 }
@@ -203,12 +358,131 @@ GlobalTxEnsureBeforeShmemExitHook(void)
 	}
 }
 
+/*
+ * Lock all partitions, required for walking over the hashes. Always in the
+ * same order, so this doesn't deadlock with another LockAll.
+ */
+void
+GlobalTxLockAll(LWLockMode mode)
+{
+	int			i;
+
+	for (i = 0; i < GTX_NUM_PARTITIONS; i++)
+		LWLockAcquire(&gtx_shared->locks[i].lock, mode);
+}
+
+void
+GlobalTxUnlockAll(void)
+{
+	int			i;
+
+	for (i = GTX_NUM_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&gtx_shared->locks[i].lock);
+}
+
+void
+GlobalTxScanInit(GlobalTxScan *scan)
+{
+	hash_seq_init(&scan->hash_seq, gtx_shared->xid2gtx);
+	scan->explicit_2pc = false;
+}
+
+GlobalTx *
+GlobalTxScanNext(GlobalTxScan *scan)
+{
+	void	   *entry;
+
+	while ((entry = hash_seq_search(&scan->hash_seq)) == NULL)
+	{
+		if (scan->explicit_2pc)
+			return NULL;
+		hash_seq_init(&scan->hash_seq, gtx_shared->gid2gtx);
+		scan->explicit_2pc = true;
+	}
+	if (scan->explicit_2pc)
+		return (GlobalTx *) entry;
+	return &((GlobalTxByXid *) entry)->gtx;
+}
+
+/*
+ * Get xid2gtx key of gid generated by MtmGenerateGid, i.e.
+ * MTM-<coordinator>-<xid>-<gen_num>. Returns false for anything else, such
+ * gids go to gid2gtx.
+ */
+static bool
+GlobalTxKeyFromGid(const char *gid, GlobalTxKey *key)
+{
+	const char *p = gid + 4;
+	char	   *end;
+	long		coordinator;
+	uint64		xid;
+
+	MemSet(key, 0, sizeof(GlobalTxKey));
+	if (IS_EXPLICIT_2PC_GID(gid) || !isdigit((unsigned char) *p))
+		return false;
+	coordinator = strtol(p, &end, 10);
+	if (*end != '-' || coordinator < 1 || coordinator > MTM_MAX_NODES)
+		return false;
+	p = end + 1;
+	if (!isdigit((unsigned char) *p))
+		return false;
+	xid = strtoull(p, &end, 10);
+	if (*end != '-')
+		return false;
+
+	key->coordinator = (int32) coordinator;
+	key->xid = xid;
+	return true;
+}
+
+StaticAssertDecl(offsetof(GlobalTx, gid) == 0,
+				 "gid2gtx key must be at the start of GlobalTx");
+
+/* hash and key to find the gtx with given gid in */
+static HTAB *
+GlobalTxHashOf(const char *gid, GlobalTxKey *key, const void **keyptr)
+{
+	if (GlobalTxKeyFromGid(gid, key))
+	{
+		*keyptr = key;
+		return gtx_shared->xid2gtx;
+	}
+	*keyptr = gid;
+	return gtx_shared->gid2gtx;
+}
+
+static GlobalTx *
+GlobalTxSearch(HTAB *htab, const void *keyptr, uint32 hashcode,
+			   HASHACTION action, bool *found)
+{
+	void	   *entry;
+
+	entry = hash_search_with_hash_value(htab, keyptr, hashcode, action, found);
+	if (entry == NULL || htab == gtx_shared->gid2gtx)
+		return (GlobalTx *) entry;
+	return &((GlobalTxByXid *) entry)->gtx;
+}
+
+/* remove gtx from its hash, its partition must be locked exclusively */
+static void
+GlobalTxRemove(GlobalTx *gtx)
+{
+	bool		found;
+	GlobalTxKey key;
+	const void *keyptr;
+	HTAB	   *htab = GlobalTxHashOf(gtx->gid, &key, &keyptr);
+
+	hash_search_with_hash_value(htab, keyptr, gtx->hashcode,
+								HASH_REMOVE, &found);
+	Assert(found);
+}
+
 /*
  * Obtain a global tx and lock it on calling backend.
  *
  * Several backend can try to access same gtx only during resolving
- * procedure and even then it's quite unlikely event. So just sleep a
- * bit.
+ * procedure and even then it's quite unlikely event. Waiter sleeps on the
+ * partition cv until the holder releases the gtx.
  *
  * Here we allow for a global tx to be created again even when we saw
  * that tx as locked but later it was deleted from hash. That may happen
@@ -230,6 +504,13 @@ GlobalTxAcquire(const char *gid, bool create, bool nowait_own_live, bool *busy,
 {
 	GlobalTx   *gtx = NULL;
 	bool		found;
+	GlobalTxKey key;
+	HTAB	   *htab;
+	const void *keyptr;
+	uint32		hashcode;
+	LWLock	   *partition_lock;
+	ConditionVariable *release_cv;
+	bool		slept = false;
 
 	if (!gtx_exit_registered)
 	{
@@ -237,20 +518,28 @@ GlobalTxAcquire(const char *gid, bool create, bool nowait_own_live, bool *busy,
 		gtx_exit_registered = true;
 	}
 
-	LWLockAcquire(gtx_shared->lock, LW_EXCLUSIVE);
+	htab = GlobalTxHashOf(gid, &key, &keyptr);
+	hashcode = get_hash_value(htab, keyptr);
+	partition_lock = GTX_PARTITION_LOCK(hashcode);
+	release_cv = &gtx_shared->release_cvs[GTX_PARTITION(hashcode)];
+
+	LWLockAcquire(partition_lock, LW_EXCLUSIVE);
 
 	/* Repeat attempts to acquire a global tx */
 	while (true)
 	{
-		gtx = (GlobalTx *) hash_search(gtx_shared->gid2gtx, gid, HASH_FIND, &found);
+		gtx = GlobalTxSearch(htab, keyptr, hashcode, HASH_FIND, &found);
 
 		if (!found)
 		{
 			if (create)
 			{
-				gtx = (GlobalTx *) hash_search(gtx_shared->gid2gtx, gid, HASH_ENTER, &found);
+				gtx = GlobalTxSearch(htab, keyptr, hashcode, HASH_ENTER, &found);
 
+				strlcpy(gtx->gid, gid, GIDSIZE);
+				gtx->hashcode = hashcode;
 				gtx->acquired_by = MyBackendId;
+				gtx->has_waiters = false;
 				gtx->state.status = GTXInvalid;
 				gtx->state.proposal = InitialGTxTerm;
 				gtx->state.accepted = InvalidGTxTerm;
@@ -270,6 +559,11 @@ GlobalTxAcquire(const char *gid, bool create, bool nowait_own_live, bool *busy,
 			break;
 		}
 
+		/* only possible with weird explicit gid mimicking ours */
+		if (strcmp(gtx->gid, gid) != 0)
+			mtm_log(ERROR, "gid %s clashes with gid %s of the same xact",
+					gid, gtx->gid);
+
 		if (gtx->acquired_by == InvalidBackendId)
 		{
 			gtx->acquired_by = MyBackendId;
@@ -282,17 +576,28 @@ GlobalTxAcquire(const char *gid, bool create, bool nowait_own_live, bool *busy,
 			{
 				if (busy)
 					*busy = true;
-				LWLockRelease(gtx_shared->lock);
+				LWLockRelease(partition_lock);
+				if (slept)
+					ConditionVariableCancelSleep();
 				return NULL;
 			}
 		}
 
-		LWLockRelease(gtx_shared->lock);
-		MtmSleep(USECS_PER_SEC / 10);
-		LWLockAcquire(gtx_shared->lock, LW_EXCLUSIVE);
+		/*
+		 * Register on the cv before releasing the partition lock, so the
+		 * release can't slip in between and we don't miss the wakeup.
+		 */
+		gtx->has_waiters = true;
+		ConditionVariablePrepareToSleep(release_cv);
+		LWLockRelease(partition_lock);
+		ConditionVariableSleep(release_cv, PG_WAIT_EXTENSION);
+		slept = true;
+		LWLockAcquire(partition_lock, LW_EXCLUSIVE);
 	}
 
-	LWLockRelease(gtx_shared->lock);
+	LWLockRelease(partition_lock);
+	if (slept)
+		ConditionVariableCancelSleep();
 	my_locked_gtx = gtx;
 	/* not prepared and finalized gtxes are purged immediately on release */
 	if (found)
@@ -313,33 +618,38 @@ GlobalTxAcquire(const char *gid, bool create, bool nowait_own_live, bool *busy,
 void
 GlobalTxRelease(GlobalTx *gtx)
 {
-	bool		found;
+	uint32		hashcode = gtx->hashcode;
+	bool		wakeup;
 
 	Assert(gtx->acquired_by == MyBackendId);
 
-	LWLockAcquire(gtx_shared->lock, LW_EXCLUSIVE);
+	LWLockAcquire(GTX_PARTITION_LOCK(hashcode), LW_EXCLUSIVE);
 	gtx->acquired_by = InvalidBackendId;
+	wakeup = gtx->has_waiters;
+	gtx->has_waiters = false;
 
 	/* status GTXInvalid can be caused by an error during PREPARE */
 	if ((gtx->state.status == GTXCommitted) ||
 		(gtx->state.status == GTXAborted) ||
 		(!gtx->prepared))
 	{
-		hash_search(gtx_shared->gid2gtx, gtx->gid, HASH_REMOVE, &found);
+		GlobalTxRemove(gtx);
 	}
 	else if (gtx->orphaned)
 	{
 		mtm_log(ResolverTasks, "transaction %s is orphaned", gtx->gid);
 	}
 
-	LWLockRelease(gtx_shared->lock);
+	LWLockRelease(GTX_PARTITION_LOCK(hashcode));
+	if (wakeup)
+		ConditionVariableBroadcast(&gtx_shared->release_cvs[GTX_PARTITION(hashcode)]);
 
 	my_locked_gtx = NULL;
 }
 
 /*
- * Scan and load in gid2gtx hashtable transactions from postgres gxacts and
- * from our private table.
+ * Scan and load in xid2gtx/gid2gtx hashtables transactions from postgres
+ * gxacts and from our private table.
  *
  * Called only upon multimaster startup.
  */
@@ -349,21 +659,18 @@ GlobalTxLoadAll()
 	PreparedTransaction pxacts;
 	int					n_xacts;
 	int					i;
-	HASH_SEQ_STATUS hash_seq;
+	GlobalTxScan scan;
 	GlobalTx   *gtx;
 
-	LWLockAcquire(gtx_shared->lock, LW_EXCLUSIVE);
+	GlobalTxLockAll(LW_EXCLUSIVE);
 
 	/*
 	 * This is called without shmem reset if monitor restarts.
 	 * XXX is there are a better way to rm all elements of hash?
 	 */
-	hash_seq_init(&hash_seq, gtx_shared->gid2gtx);
-	while ((gtx = hash_seq_search(&hash_seq)) != NULL)
-	{
-		gtx = (GlobalTx *) hash_search(gtx_shared->gid2gtx, gtx->gid,
-									   HASH_REMOVE, NULL);
-	}
+	GlobalTxScanInit(&scan);
+	while ((gtx = GlobalTxScanNext(&scan)) != NULL)
+		GlobalTxRemove(gtx);
 
 	/* Walk over postgres gxacts */
 	n_xacts = GetPreparedTransactions(&pxacts);
@@ -371,18 +678,25 @@ GlobalTxLoadAll()
 	{
 		GlobalTx   *gtx;
 		bool		found;
+		GlobalTxKey key;
+		const void *keyptr;
+		HTAB	   *htab = GlobalTxHashOf(pxacts[i].gid, &key, &keyptr);
+		uint32		hashcode = get_hash_value(htab, keyptr);
 
-		gtx = (GlobalTx *) hash_search(gtx_shared->gid2gtx, pxacts[i].gid, HASH_ENTER, &found);
+		gtx = GlobalTxSearch(htab, keyptr, hashcode, HASH_ENTER, &found);
 		Assert(!found);
 
+		strlcpy(gtx->gid, pxacts[i].gid, GIDSIZE);
+		gtx->hashcode = hashcode;
 		gtx->acquired_by = InvalidBackendId;
+		gtx->has_waiters = false;
 		/*
 		 * Allow instance to start even if we have problems parsing xstate...
 		 */
 		if (deserialize_xstate(pxacts[i].state_3pc, &gtx->xinfo, &gtx->state,
 							   WARNING) != 0)
 		{
-			hash_search(gtx_shared->gid2gtx, pxacts[i].gid, HASH_REMOVE, &found);
+			GlobalTxRemove(gtx);
 			continue;
 		}
 		gtx->prepared = true;
@@ -392,7 +706,11 @@ GlobalTxLoadAll()
 		memset(gtx->phase2_acks, 0, sizeof(gtx->phase2_acks));
 	}
 
-	LWLockRelease(gtx_shared->lock);
+	GlobalTxUnlockAll();
+
+	/* whoever waited for entries we've just wiped must look again */
+	for (i = 0; i < GTX_NUM_PARTITIONS; i++)
+		ConditionVariableBroadcast(&gtx_shared->release_cvs[i]);
 }
 
 
@@ -402,18 +720,18 @@ GlobalTxLoadAll()
 GlobalTxTerm
 GlobalTxGetMaxProposal()
 {
-	HASH_SEQ_STATUS hash_seq;
+	GlobalTxScan scan;
 	GlobalTx   *gtx;
 	GlobalTxTerm max_prop = (GlobalTxTerm) {0, 0};
 
-	LWLockAcquire(gtx_shared->lock, LW_SHARED);
-	hash_seq_init(&hash_seq, gtx_shared->gid2gtx);
-	while ((gtx = hash_seq_search(&hash_seq)) != NULL)
+	GlobalTxLockAll(LW_SHARED);
+	GlobalTxScanInit(&scan);
+	while ((gtx = GlobalTxScanNext(&scan)) != NULL)
 	{
 		if (term_cmp(max_prop, gtx->state.proposal) < 0)
 			max_prop = gtx->state.proposal;
 	}
-	LWLockRelease(gtx_shared->lock);
+	GlobalTxUnlockAll();
 
 	return max_prop;
 }
@@ -422,12 +740,12 @@ GlobalTxGetMaxProposal()
 void
 GlobalTxMarkOrphaned(int node_id)
 {
-	HASH_SEQ_STATUS hash_seq;
+	GlobalTxScan scan;
 	GlobalTx   *gtx;
 
-	LWLockAcquire(gtx_shared->lock, LW_EXCLUSIVE);
-	hash_seq_init(&hash_seq, gtx_shared->gid2gtx);
-	while ((gtx = hash_seq_search(&hash_seq)) != NULL)
+	GlobalTxLockAll(LW_EXCLUSIVE);
+	GlobalTxScanInit(&scan);
+	while ((gtx = GlobalTxScanNext(&scan)) != NULL)
 	{
 		if (gtx->xinfo.coordinator == node_id)
 		{
@@ -435,7 +753,7 @@ GlobalTxMarkOrphaned(int node_id)
 			mtm_log(ResolverTasks, "%s is orphaned", gtx->gid);
 		}
 	}
-	LWLockRelease(gtx_shared->lock);
+	GlobalTxUnlockAll();
 }
 
 static char *
@@ -502,3 +820,205 @@ GlobalTxToString(GlobalTx *gtx)
 
 	return si.data;
 }
+
+/*
+ * Acquire gtx with given gid and make sure it is found in the expected hash,
+ * by the alias gid as well (for mm gids, alias is the same xact of another
+ * generation), and is gone after release.
+ */
+static void
+GlobalTxCheckLookup(const char *gid, const char *alias, bool mm_gid)
+{
+	GlobalTx   *gtx;
+	GlobalTx   *found_gtx;
+	GlobalTxKey key;
+	const void *keyptr;
+	HTAB	   *htab;
+	uint32		hashcode;
+	bool		found;
+
+	htab = GlobalTxHashOf(gid, &key, &keyptr);
+	if (htab != (mm_gid ? gtx_shared->xid2gtx : gtx_shared->gid2gtx))
+		elog(ERROR, "gid %s is expected in %s", gid,
+			 mm_gid ? "xid2gtx" : "gid2gtx");
+
+	gtx = GlobalTxAcquire(gid, true, false, NULL, 0);
+
+	htab = GlobalTxHashOf(alias, &key, &keyptr);
+	hashcode = get_hash_value(htab, keyptr);
+	LWLockAcquire(GTX_PARTITION_LOCK(hashcode), LW_SHARED);
+	found_gtx = GlobalTxSearch(htab, keyptr, hashcode, HASH_FIND, &found);
+	LWLockRelease(GTX_PARTITION_LOCK(hashcode));
+	if (found_gtx != gtx || hashcode != gtx->hashcode)
+		elog(ERROR, "gid %s is not found by %s", gid, alias);
+
+	GlobalTxRelease(gtx);
+
+	htab = GlobalTxHashOf(gid, &key, &keyptr);
+	LWLockAcquire(GTX_PARTITION_LOCK(hashcode), LW_SHARED);
+	found_gtx = GlobalTxSearch(htab, keyptr, hashcode, HASH_FIND, &found);
+	LWLockRelease(GTX_PARTITION_LOCK(hashcode));
+	if (found)
+		elog(ERROR, "gid %s is not removed on release", gid);
+}
+
+/*
+ * Check that mm-generated gids are looked up by (coordinator, xid) in
+ * xid2gtx and everything else by gid string in gid2gtx. Test only,
+ * t/012_global_tx.pl declares it.
+ */
+Datum
+mtm_global_tx_lookup_check(PG_FUNCTION_ARGS)
+{
+	char		gid[GIDSIZE];
+	char		alias[GIDSIZE];
+	/* xids which are never assigned to a real xact */
+	TransactionId xids[] = {BootstrapTransactionId, FrozenTransactionId};
+	int			coordinators[] = {1, MTM_MAX_NODES};
+	const char *user_gids[] = {
+		"x",
+		"MTM-",					/* looks like ours, but is not */
+		"MTM-1-2",
+		"MTM-1-x-1",
+		"MTM-0-2-1"
+	};
+	int			i,
+				j;
+
+	for (i = 0; i < lengthof(coordinators); i++)
+	{
+		for (j = 0; j < lengthof(xids); j++)
+		{
+			MtmGenerateGid(gid, coordinators[i], xids[j], 1);
+			MtmGenerateGid(alias, coordinators[i], xids[j], PG_UINT64_MAX);
+			GlobalTxCheckLookup(gid, alias, true);
+		}
+	}
+
+	for (i = 0; i < lengthof(user_gids); i++)
+		GlobalTxCheckLookup(user_gids[i], user_gids[i], false);
+
+	PG_RETURN_VOID();
+}
+
+static void
+xstate_check_decoded(const char *state, XactInfo *xinfo, GTxState *gtx_state)
+{
+	XactInfo	xinfo2;
+	GTxState	gtx_state2;
+
+	if (deserialize_xstate(state, &xinfo2, &gtx_state2, WARNING) != 0)
+		elog(ERROR, "failed to decode state_3pc %s", state);
+
+	if (xinfo2.coordinator != xinfo->coordinator ||
+		xinfo2.xid != xinfo->xid ||
+		xinfo2.gen_num != xinfo->gen_num ||
+		xinfo2.configured != xinfo->configured ||
+		gtx_state2.status != gtx_state->status ||
+		term_cmp(gtx_state2.proposal, gtx_state->proposal) != 0 ||
+		term_cmp(gtx_state2.accepted, gtx_state->accepted) != 0)
+		elog(ERROR, "state_3pc %s decoded as coordinator=%d xid=" XID_FMT
+			 " gen_num=" UINT64_FORMAT " configured=" UINT64_FORMAT
+			 " status=%s proposal=%d:%d accepted=%d:%d",
+			 state, xinfo2.coordinator, xinfo2.xid,
+			 xinfo2.gen_num, xinfo2.configured,
+			 GlobalTxStatusMnem[gtx_state2.status],
+			 gtx_state2.proposal.ballot, gtx_state2.proposal.node_id,
+			 gtx_state2.accepted.ballot, gtx_state2.accepted.node_id);
+}
+
+/*
+ * Check that state_3pc of every status and ballot survives encoding and
+ * decoding, that version 1 text written before upgrade is still understood
+ * and that garbage is rejected. Test only, t/012_global_tx.pl declares it.
+ */
+Datum
+mtm_xstate_check(PG_FUNCTION_ARGS)
+{
+	static const char *const v1_status_abbr[] = {"in", "pc", "pa", "cm", "ab"};
+	static const struct
+	{
+		const char *state;
+		XactInfo	xinfo;
+		GTxState	gtx_state;
+	}			v1_states[] = {
+		/* as written by previous versions */
+		{"1-2-1234-1F-7-pc-3:1-2:1",
+		 {2, 1234, 0x1F, 7}, {{3, 1}, {2, 1}, GTXPreCommitted}},
+		{"1-1-4294967295-FFFFFFFFFFFFFFFF-1-ab-1:0-0:0",
+		 {1, PG_UINT32_MAX, PG_UINT64_MAX, 1}, {{1, 0}, {0, 0}, GTXAborted}},
+	};
+	static const char *const bad_states[] = {"#", "#AAAA", "1-2-3", ""};
+	int32		ballots[] = {0, 1, 2, 255, 256, PG_INT32_MAX};
+	int			node_ids[] = {0, 1, MTM_MAX_NODES};
+	XactInfo	xinfo;
+	GTxState	gtx_state;
+	int			n_ballots = lengthof(ballots);
+	int			n_node_ids = lengthof(node_ids);
+	char	   *state;
+	int			i;
+
+	/* every status x proposal ballot x accepted ballot x node ids */
+	for (i = 0; i < (GTXAborted + 1) * n_ballots * n_ballots * n_node_ids; i++)
+	{
+		int			node = i % n_node_ids;
+		int			acc = i / n_node_ids % n_ballots;
+		int			prop = i / n_node_ids / n_ballots % n_ballots;
+		int			status = i / n_node_ids / n_ballots / n_ballots;
+
+		xinfo.coordinator = node_ids[node];
+		xinfo.xid = node == 0 ? FirstNormalTransactionId : PG_UINT32_MAX;
+		xinfo.gen_num = (uint64) ballots[prop] << 32 | (uint32) ballots[acc];
+		xinfo.configured = node == 0 ? 0 : PG_UINT64_MAX >> node;
+		gtx_state.status = (GlobalTxStatus) status;
+		gtx_state.proposal.ballot = ballots[prop];
+		gtx_state.proposal.node_id = node_ids[node];
+		gtx_state.accepted.ballot = ballots[acc];
+		gtx_state.accepted.node_id = node_ids[n_node_ids - 1 - node];
+
+		/* current format */
+		state = serialize_xstate(&xinfo, &gtx_state);
+		if (state[0] != XSTATE_BINARY_MARK ||
+			strlen(state) != XSTATE_ENCODED_LEN)
+			elog(ERROR, "unexpected state_3pc %s", state);
+		xstate_check_decoded(state, &xinfo, &gtx_state);
+		pfree(state);
+
+		/* version 1 */
+		state = psprintf("1-%d-" XID_FMT "-%" INT64_MODIFIER "X-%" INT64_MODIFIER "X-%s-%d:%d-%d:%d",
+						 xinfo.coordinator, xinfo.xid,
+						 xinfo.gen_num, xinfo.configured,
+						 v1_status_abbr[status],
+						 gtx_state.proposal.ballot, gtx_state.proposal.node_id,
+						 gtx_state.accepted.ballot, gtx_state.accepted.node_id);
+		xstate_check_decoded(state, &xinfo, &gtx_state);
+		pfree(state);
+	}
+
+	for (i = 0; i < lengthof(v1_states); i++)
+	{
+		xinfo = v1_states[i].xinfo;
+		gtx_state = v1_states[i].gtx_state;
+		xstate_check_decoded(v1_states[i].state, &xinfo, &gtx_state);
+	}
+
+	for (i = 0; i < lengthof(bad_states); i++)
+	{
+		if (deserialize_xstate(bad_states[i], &xinfo, &gtx_state, DEBUG1) == 0)
+			elog(ERROR, "malformed state_3pc %s is accepted", bad_states[i]);
+	}
+
+	/* char out of alphabet and unknown version in otherwise valid record */
+	state = serialize_xstate(&xinfo, &gtx_state);
+	state[XSTATE_ENCODED_LEN - 1] = '!';
+	if (deserialize_xstate(state, &xinfo, &gtx_state, DEBUG1) == 0)
+		elog(ERROR, "malformed state_3pc %s is accepted", state);
+	pfree(state);
+	state = serialize_xstate(&xinfo, &gtx_state);
+	state[1] = 'B';
+	if (deserialize_xstate(state, &xinfo, &gtx_state, DEBUG1) == 0)
+		elog(ERROR, "state_3pc %s of unknown version is accepted", state);
+	pfree(state);
+
+	PG_RETURN_VOID();
+}
@@ -79,6 +79,7 @@ typedef struct BgwPool
 
 extern void BgwPoolStart(int sender_node_id, char *poolName, Oid db_id, Oid user_id);
 extern void BgwPoolExecute(BgwPool *pool, void *work, int size, MtmReceiverWorkerContext *rwctx);
+extern bool BgwPoolTryExecute(BgwPool *pool, void *work, int size, MtmReceiverWorkerContext *rwctx);
 extern void BgwPoolShutdown(BgwPool *poolDesc);
 extern void BgwPoolCancel(BgwPool *pool);
 
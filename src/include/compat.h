@@ -23,4 +23,13 @@
 #define on_commits_compat() (on_commits)
 #endif
 
+/*
+ * Decoding of in-progress xacts (stream_* output plugin callbacks) is
+ * available since 14; on older cores the walsender always decodes xact as a
+ * whole and these callbacks are not registered.
+ */
+#if PG_VERSION_NUM >= 140000
+#define MTM_STREAMING_SUPPORTED
+#endif
+
 #endif							/* MTMCOMPAT_H */
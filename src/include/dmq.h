@@ -10,7 +10,49 @@ typedef int8 DmqDestinationId;
 /* mm currently uses xact gid as stream name, so this should be >= GIDSIZE */
 #define DMQ_STREAM_NAME_MAXLEN 200
 
-extern void dmq_init(int send_timeout, int connect_timeout);
+/*
+ * Streams can also be identified by (node_id, xid) pair instead of a name;
+ * such streams are cheaper to route as there is no need to hash and compare
+ * long strings. Use dmq_stream_id() to construct one: the id is compared
+ * bytewise, so padding must be zeroed.
+ */
+typedef struct DmqStreamId
+{
+	uint64		xid;
+	int32		node_id;
+	int32		pad;
+} DmqStreamId;
+
+static inline DmqStreamId
+dmq_stream_id(int node_id, uint64 xid)
+{
+	DmqStreamId id;
+
+	id.xid = xid;
+	id.node_id = node_id;
+	id.pad = 0;
+	return id;
+}
+
+/*
+ * Each destination is served by two connections: requests go through their
+ * own lane, so responses (and heartbeats) never queue behind them and a loop
+ * of nodes stuffing each other with requests can't deadlock. Subscriber
+ * listens to one lane: requests for dmq_stream_subscribe_requests streams,
+ * responses for all the rest.
+ */
+typedef enum
+{
+	DMQ_LANE_RESPONSE = 0,
+	DMQ_LANE_REQUEST = 1
+} DmqLane;
+
+#define DMQ_N_LANES 2
+
+/* max number of sender workers destinations are sharded among */
+#define DMQ_MAX_SENDERS 8
+
+extern void dmq_init(int send_timeout, int connect_timeout, int n_senders);
 
 #define DMQ_N_MASK_POS 16 /* ought to be >= MTM_MAX_NODES */
 extern DmqDestinationId dmq_destination_add(char *connstr, char *sender_name,
@@ -26,15 +68,19 @@ extern void dmq_terminate_receiver(char *name);
 
 extern void dmq_reattach_receivers(void);
 extern void dmq_stream_subscribe(char *stream_name);
+extern void dmq_stream_subscribe_requests(char *stream_name);
+extern void dmq_stream_subscribe_id(DmqStreamId stream_id);
 extern void dmq_stream_unsubscribe(void);
 
-extern void dmq_get_sendconn_cnt(uint64 participants, int *sconn_cnt);
 extern bool dmq_pop(int8 *sender_mask_pos, StringInfo msg, uint64 mask);
 extern bool dmq_pop_nb(int8 *sender_mask_pos, StringInfo msg, uint64 mask, bool *wait);
-extern uint64 dmq_purge_failed_participants(uint64 participants, int *sconn_cnt);
+extern void dmq_wake_subscribers(void);
 
 extern void dmq_push(DmqDestinationId dest_id, char *stream_name, char *msg);
 extern void dmq_push_buffer(DmqDestinationId dest_id, char *stream_name, const void *buffer, size_t len);
+extern void dmq_push_buffer_id(DmqDestinationId dest_id, DmqStreamId stream_id, const void *buffer, size_t len);
+extern void dmq_push_request(DmqDestinationId dest_id, char *stream_name, const void *buffer, size_t len);
+extern void dmq_request_answered(int8 mask_pos);
 
 typedef void (*dmq_hook_type) (char *);
 extern void *(*dmq_receiver_start_hook)(char *sender_name);
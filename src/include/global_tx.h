@@ -11,6 +11,9 @@
 #ifndef GLOBAL_TX_H
 #define GLOBAL_TX_H
 
+#include "storage/condition_variable.h"
+#include "utils/hsearch.h"
+
 #include "multimaster.h"
 
 typedef struct
@@ -73,12 +76,26 @@ typedef struct
 							*/
 } XactInfo;
 
+/*
+ * Key of mm-generated gids (MtmGenerateGid) in xid2gtx. Explicit 2PC gids
+ * are kept in gid2gtx keyed by the gid string.
+ */
+typedef struct
+{
+	uint64		xid;
+	int32		coordinator;
+	int32		pad;			/* keep zeroed, the key is hashed as blob */
+} GlobalTxKey;
+
 typedef struct GlobalTx
 {
-	char		gid[GIDSIZE];
+	char		gid[GIDSIZE];	/* gid2gtx key */
+	uint32		hashcode;	/* hash of the key, determines the partition */
 	XactInfo	xinfo;
 	XLogRecPtr	coordinator_end_lsn;
 	BackendId	acquired_by;
+	/* somebody sleeps on the partition cv waiting for release */
+	bool		has_waiters;
 	/* paxos voting state for this xact */
 	GTxState	state;
 	/* transient thing used to rm shmem entry on error */
@@ -98,12 +115,42 @@ typedef struct GlobalTx
 	GlobalTxResolvingStage resolver_stage;
 } GlobalTx;
 
+/* xid2gtx entry */
+typedef struct
+{
+	GlobalTxKey key;
+	GlobalTx	gtx;
+} GlobalTxByXid;
+
+/*
+ * xid2gtx and gid2gtx are partitioned by key hash, similar to the
+ * heavyweight lock manager: acquire/release of a gtx lock only its
+ * partition, and walking over the hashes requires all of them
+ * (GlobalTxLockAll, GlobalTxScanNext). Both hashes share partition locks.
+ * Backends waiting for busy gtx sleep on the partition cv: gtxes are removed
+ * from the hash on release, so they can't carry the cv themselves.
+ */
+#define GTX_NUM_PARTITIONS 16
+
 typedef struct
 {
-	LWLock	   *lock;
-	HTAB	   *gid2gtx;
+	LWLockPadded *locks;		/* GTX_NUM_PARTITIONS of them */
+	ConditionVariable release_cvs[GTX_NUM_PARTITIONS];
+	HTAB	   *xid2gtx;		/* mm-generated gids */
+	HTAB	   *gid2gtx;		/* explicit 2PC */
 } gtx_shared_data;
 
+/* walk over all gtxes, all partitions must be locked */
+typedef struct
+{
+	HASH_SEQ_STATUS hash_seq;
+	bool		explicit_2pc;	/* already switched to gid2gtx */
+} GlobalTxScan;
+
+#define GTX_PARTITION(hashcode) ((hashcode) % GTX_NUM_PARTITIONS)
+#define GTX_PARTITION_LOCK(hashcode) \
+	(&gtx_shared->locks[GTX_PARTITION(hashcode)].lock)
+
 extern gtx_shared_data *gtx_shared;
 
 void MtmGlobalTxInit(void);
@@ -113,6 +160,10 @@ GlobalTx *GlobalTxAcquire(const char *gid, bool create, bool nowait_own_live,
 						  bool *busy, int coordinator);
 void GlobalTxRelease(GlobalTx *gtx);
 void GlobalTxAtExit(int code, Datum arg);
+void GlobalTxLockAll(LWLockMode mode);
+void GlobalTxUnlockAll(void);
+void GlobalTxScanInit(GlobalTxScan *scan);
+GlobalTx *GlobalTxScanNext(GlobalTxScan *scan);
 void GlobalTxLoadAll(void);
 char *serialize_xstate(XactInfo *xinfo, GTxState *gtx_state);
 int term_cmp(GlobalTxTerm t1, GlobalTxTerm t2);
@@ -152,6 +152,30 @@ typedef struct
 extern MtmConfig *receiver_mtm_cfg;
 extern bool receiver_mtm_cfg_valid;
 
+/* steps of MtmTwoPhaseCommit timed in mtm.stat_commit_phases */
+typedef enum
+{
+	MTM_PHASE_PREPARE,			/* local PREPARE */
+	MTM_PHASE_PREPARE_ACKS,		/* collecting PREPARE acks */
+	MTM_PHASE_PRECOMMIT,		/* local precommit, i.e. state_3pc update */
+	MTM_PHASE_PRECOMMIT_ACKS,	/* collecting paxos 2b acks */
+	MTM_PHASE_COMMIT,			/* local COMMIT PREPARED */
+	MTM_PHASE_COMMIT_ACKS,		/* collecting COMMIT PREPARED acks */
+	MTM_N_COMMIT_PHASES
+} MtmCommitPhase;
+
+/*
+ * Bucket 0 counts latencies below 1us, bucket i counts [2^(i-1), 2^i) us,
+ * the last one everything longer.
+ */
+#define MTM_PHASE_HIST_BUCKETS 26
+
+typedef struct
+{
+	pg_atomic_uint64 total_us;
+	pg_atomic_uint64 hist[MTM_PHASE_HIST_BUCKETS];
+} MtmPhaseStat;
+
 typedef struct
 {
 	LWLock	   *lock;
@@ -186,6 +210,9 @@ typedef struct
 
 	pid_t		resolver_pid;
 
+	/* sum of peers[].receiver_buffered, see receivers_memory_limit */
+	pg_atomic_uint64 receivers_buffered;
+
 	struct
 	{
 		/*
@@ -201,6 +228,13 @@ typedef struct
 		 * which LSN we should ack to this node? caches get_recovery_horizon
 		 */
 		pg_atomic_uint64 horizon;
+		/* bytes of not yet applied changes receiver keeps in memory */
+		pg_atomic_uint64 receiver_buffered;
+		/*
+		 * origin_lsn of the latest syncpoint of this node whose recovery
+		 * filter checkpoint is yet to be done by monitor, 0 if none
+		 */
+		pg_atomic_uint64 filter_checkpoint_lsn;
 	}			peers[MTM_MAX_NODES];
 	BgwPool		pools[MTM_MAX_NODES];	/* [Mtm->nAllNodes]: per-node data */
 
@@ -208,6 +242,12 @@ typedef struct
 	nodemask_t	walsenders_mask;
 	nodemask_t	walreceivers_mask;
 
+	/*
+	 * Commit latency breakdown, [phase][node_id - 1]. Local phases are
+	 * accounted to my_node_id, collecting acks -- to the node which sent it.
+	 */
+	MtmPhaseStat commit_phases[MTM_N_COMMIT_PHASES][MTM_MAX_NODES];
+
 	bool	monitor_loaded;
 	bool	replier_loaded;
 } MtmShared;
@@ -227,8 +267,10 @@ extern bool MtmIsMonitorWorker;
 
 /* GUCs */
 extern int	MtmTransSpillThreshold;
+extern int	MtmReceiversMemoryLimit;
 extern int	MtmHeartbeatSendTimeout;
 extern int	MtmHeartbeatRecvTimeout;
+extern int	MtmDmqSenders;
 extern char *MtmRefereeConnStr;
 #define IS_REFEREE_ENABLED() (MtmRefereeConnStr && *MtmRefereeConnStr)
 extern int	MtmMaxWorkers;
@@ -236,6 +278,7 @@ extern bool MtmBreakConnection;
 extern bool MtmWaitPeerCommits;
 extern bool MtmNo3PC;
 extern bool MtmBinaryBasetypes;
+extern bool MtmStreamInProgress;
 
 extern void MtmSleep(int64 interval);
 extern TimestampTz MtmGetIncreasingTimestamp(void);
@@ -266,10 +309,17 @@ extern char *maskToString(nodemask_t mask);
 
 struct MtmMessage; /* forward declaration for gather prototype */
 typedef bool (*gather_hook_t)(struct MtmMessage *anymsg, Datum arg);
+typedef bool (*gather_done_hook_t)(struct MtmMessage **messages, int msg_count,
+								   Datum arg);
 extern bool gather(nodemask_t participants,
 				   struct MtmMessage **messages, int *senders, int *msg_count,
 				   gather_hook_t msg_ok, Datum msg_ok_arg,
-				   int *sendconn_cnt, uint64 gen_num);
+				   uint64 gen_num);
+extern bool gather_until(nodemask_t participants,
+						 struct MtmMessage **messages, int *senders, int *msg_count,
+						 gather_hook_t msg_ok, Datum msg_ok_arg,
+						 gather_done_hook_t done, Datum done_arg,
+						 uint64 gen_num);
 
 /* boilerplate for config updates in bgws */
 extern bool mtm_config_valid;
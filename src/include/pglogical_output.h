@@ -47,7 +47,11 @@ typedef struct MtmDecoderPrivate
 {
 	int			receiver_node_id;
 	bool		is_recovery;
+	/* receiver is able to spool streamed in-progress xacts */
+	bool		streaming;
 	MtmConfig  *cfg;
+	/* receiver's recovery filter, NULL if it didn't send one */
+	struct SenderFilter *filter;
 } MtmDecoderPrivate;
 
 typedef struct PGLogicalOutputData
@@ -102,6 +106,9 @@ typedef struct PGLogicalOutputData
 
 	/* DefElem<String> list populated by startup hook */
 	List	   *extra_startup_params;
+
+	/* current xact was rejected by txn filter hook, don't send it */
+	bool		txn_filtered;
 } PGLogicalOutputData;
 
 typedef struct PGLogicalTupleData
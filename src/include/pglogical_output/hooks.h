@@ -32,6 +32,11 @@ struct PGLogicalTxnFilterArgs
 {
 	void	   *private_data;
 	RepOriginId origin_id;
+	/*
+	 * Assembled xact with its lsns known, or NULL when filtering only by
+	 * origin before the xact is decoded.
+	 */
+	ReorderBufferTXN *txn;
 };
 
 typedef bool (*pglogical_txn_filter_hook_fn) (struct PGLogicalTxnFilterArgs *args);
@@ -87,4 +87,21 @@ extern void pglogical_write_abort_prepared(StringInfo out,
 							   struct PGLogicalOutputData *data,
 							   ReorderBufferTXN *txn, XLogRecPtr lsn);
 
+/* streaming of in-progress xacts */
+extern void pglogical_write_stream_start(StringInfo out,
+							 struct PGLogicalOutputData *data,
+							 ReorderBufferTXN *txn, bool first_segment);
+extern void pglogical_write_stream_stop(StringInfo out,
+							struct PGLogicalOutputData *data,
+							ReorderBufferTXN *txn);
+extern void pglogical_write_stream_subxact(StringInfo out,
+							   struct PGLogicalOutputData *data,
+							   TransactionId subxid);
+extern void pglogical_write_stream_abort(StringInfo out,
+							 struct PGLogicalOutputData *data,
+							 TransactionId xid, TransactionId subxid);
+extern void pglogical_write_stream_finish(StringInfo out,
+							  struct PGLogicalOutputData *data,
+							  ReorderBufferTXN *txn);
+
 #endif							/* PG_LOGICAL_PROTO_H */
@@ -1,11 +1,43 @@
 #ifndef __SPILL_H__
 #define __SPILL_H__
 
-void		MtmSpillToFile(int fd, char const *data, size_t size);
+/*
+ * Spill file of a large transaction. Receiver appends chunks to it through
+ * a write buffer, apply reads them back one by one, directly from the mapped
+ * file if it is large enough.
+ */
+typedef struct MtmSpillFile
+{
+	int			fd;
+	/* size of file including not yet written part of buffer */
+	off_t		size;
+	/* write buffer, BLCKSZ aligned part of buf_alloc */
+	char	   *buf;
+	char	   *buf_alloc;
+	size_t		buf_used;
+	/* chunk as read by MtmReadSpillFile and compressed data buffers */
+	char	   *chunk;
+	size_t		chunk_size;
+	char	   *cbuf;
+	size_t		cbuf_size;
+	/* whole file mapped for replay, NULL if read() is used */
+	char	   *map;
+	size_t		map_size;
+	/* map pages before this offset are given back to the kernel */
+	off_t		map_released;
+	bool		reading;
+} MtmSpillFile;
+
+extern bool MtmSpillCompression;
+
+void		MtmSpillToFile(MtmSpillFile *sf, char const *data, size_t size);
 void		MtmCreateSpillDirectory(int node_id);
-int			MtmCreateSpillFile(int node_id, int *file_id);
-int			MtmOpenSpillFile(int node_id, int file_id);
-void		MtmReadSpillFile(int fd, char *data, size_t size);
-void		MtmCloseSpillFile(int fd);
+MtmSpillFile *MtmCreateSpillFile(int node_id, int *file_id);
+MtmSpillFile *MtmOpenSpillFile(int node_id, int file_id);
+char	   *MtmReadSpillFile(MtmSpillFile *sf, size_t size);
+off_t		MtmSpillFileSize(MtmSpillFile *sf);
+void		MtmTruncateSpillFile(MtmSpillFile *sf, off_t size);
+void		MtmDeleteSpillFile(int node_id, int file_id);
+void		MtmCloseSpillFile(MtmSpillFile *sf);
 
 #endif
@@ -22,19 +22,42 @@ typedef struct
 } Syncpoint;
 
 /*
- * Used as a hashkey in recovery filter.
- *
- * NB: make sure to memset this structure to zeroes before using as hashkey
- * because it contains 4-byte padding hole in the middle.
+ * Recovery filter: origin lsns of xacts applied after the syncpoint, kept
+ * per origin as sorted array. Xacts of an origin arrive mostly in lsn order,
+ * so lookups walk forward from the position of the previous one.
  */
-typedef struct
+typedef struct RecoveryFilter
 {
-	int			node_id;
-	XLogRecPtr	origin_lsn;
-} FilterEntry;
+	XLogRecPtr *lsns[MTM_MAX_NODES];
+	int			n_lsns[MTM_MAX_NODES];
+	int			size[MTM_MAX_NODES];
+	/* lsns are appended unsorted until RecoveryFilterSort */
+	bool		sorted[MTM_MAX_NODES];
+	/* index of the first lsn > previously looked up one */
+	int			cursor[MTM_MAX_NODES];
+} RecoveryFilter;
+
+/*
+ * Compact copy of receiver's recovery filter shipped to the sender at
+ * replication start, so that already applied xacts are not even sent.
+ * Sender skips an xact only if receiver would have certainly skipped it
+ * in MtmFilterTransaction anyway.
+ */
+typedef struct SenderFilter
+{
+	/* receiver has filter slot for this origin */
+	bool		known[MTM_MAX_NODES];
+	/* syncpoint origin_lsn: everything up to it is applied */
+	XLogRecPtr	sp_origin_lsn[MTM_MAX_NODES];
+	/* xacts applied after the syncpoint */
+	RecoveryFilter applied;
+} SenderFilter;
 
+/* upper bound on number of lsns in encoded SenderFilter */
+#define SENDER_FILTER_MAX_LSNS 65536
 
 extern int MtmSyncpointInterval;
+extern int MtmRecoveryFilterScanWorkers;
 
 
 extern void MaybeLogSyncpoint(void);
@@ -44,7 +67,17 @@ extern Syncpoint SyncpointGetLatest(int origin_node_id);
 extern Syncpoint *SyncpointGetAllLatest(int sender_node_id);
 extern XLogRecPtr GetRecoveryHorizon(int sender_node_id);
 extern void UpdateRecoveryHorizons(void);
-extern HTAB *RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg);
+extern RecoveryFilter *RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg);
+extern void RecoveryFilterAdd(RecoveryFilter *filter, int node_id, XLogRecPtr origin_lsn);
+extern void RecoveryFilterSort(RecoveryFilter *filter);
+extern bool RecoveryFilterContains(RecoveryFilter *filter, int node_id, XLogRecPtr origin_lsn);
+extern void RecoveryFilterFree(RecoveryFilter *filter);
+extern void RecoveryFilterRequestCheckpoint(int node_id, XLogRecPtr origin_lsn);
+extern void RecoveryFilterCheckpointPending(MtmConfig *mtm_cfg);
+extern void RecoveryFilterDrop(int node_id);
+extern char *SenderFilterEncode(RecoveryFilter *filter, Syncpoint *spvector);
+extern SenderFilter *SenderFilterDecode(const char *str);
+extern bool SenderFilterMatch(SenderFilter *sf, int origin_node, XLogRecPtr tx_lsn);
 
 extern char* pg_lsn_out_c(XLogRecPtr lsn);
 
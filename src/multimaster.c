@@ -19,7 +19,9 @@
 #include "replication/slot.h"
 #include "replication/logical.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/proc.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "commands/publicationcmds.h"
 #include "commands/subscriptioncmds.h"
@@ -48,6 +50,7 @@
 #include "commit.h"
 #include "messaging.h"
 #include "syncpoint.h"
+#include "spill.h"
 
 #include "compat.h"
 
@@ -76,6 +79,9 @@ PG_FUNCTION_INFO_V1(mtm_after_node_drop);
 PG_FUNCTION_INFO_V1(mtm_join_node);
 PG_FUNCTION_INFO_V1(mtm_init_cluster);
 PG_FUNCTION_INFO_V1(mtm_get_bgwpool_stat);
+PG_FUNCTION_INFO_V1(mtm_get_receivers_memory);
+PG_FUNCTION_INFO_V1(mtm_get_commit_phases);
+PG_FUNCTION_INFO_V1(mtm_reset_commit_phases);
 PG_FUNCTION_INFO_V1(mtm_ping);
 PG_FUNCTION_INFO_V1(mtm_hold_backends);
 PG_FUNCTION_INFO_V1(mtm_release_backends);
@@ -207,14 +213,23 @@ bool		MtmBackgroundWorker;
  */
 int			MtmTransSpillThreshold;
 
+/*
+ * Total size of changes all receivers may keep in memory; once it is
+ * exceeded, receivers start spilling large xacts before they reach
+ * MtmTransSpillThreshold. 0 means no limit.
+ */
+int			MtmReceiversMemoryLimit;
+
 int			MtmConnectTimeout;
 int			MtmHeartbeatSendTimeout;
 int			MtmHeartbeatRecvTimeout;
+int			MtmDmqSenders;
 char	   *MtmRefereeConnStr;
 bool		MtmBreakConnection;
 bool		MtmWaitPeerCommits;
 bool		MtmNo3PC;
 bool		MtmBinaryBasetypes;
+bool		MtmStreamInProgress;
 
 bool mtm_config_valid;
 
@@ -423,6 +438,7 @@ MtmSharedShmemStartup()
 		ConditionVariableInit(&Mtm->receiver_barrier_cv);
 
 		Mtm->resolver_pid = InvalidPid;
+		pg_atomic_init_u64(&Mtm->receivers_buffered, 0);
 
 		for (i = 0; i < MTM_MAX_NODES; i++)
 		{
@@ -430,6 +446,8 @@ MtmSharedShmemStartup()
 			Mtm->peers[i].dmq_dest_id = -1;
 			Mtm->peers[i].dmq_receiver_pid = InvalidPid;
 			pg_atomic_init_u64(&Mtm->peers[i].horizon, InvalidXLogRecPtr);
+			pg_atomic_init_u64(&Mtm->peers[i].receiver_buffered, 0);
+			pg_atomic_init_u64(&Mtm->peers[i].filter_checkpoint_lsn, 0);
 
 			/*
 			 * XXX Assume that MaxBackends is the same at each node of
@@ -441,6 +459,21 @@ MtmSharedShmemStartup()
 
 		Mtm->walreceivers_mask = 0;
 		Mtm->walsenders_mask = 0;
+
+		for (i = 0; i < MTM_N_COMMIT_PHASES; i++)
+		{
+			int			j;
+
+			for (j = 0; j < MTM_MAX_NODES; j++)
+			{
+				MtmPhaseStat *stat = &Mtm->commit_phases[i][j];
+				int			k;
+
+				pg_atomic_init_u64(&stat->total_us, 0);
+				for (k = 0; k < MTM_PHASE_HIST_BUCKETS; k++)
+					pg_atomic_init_u64(&stat->hist[k], 0);
+			}
+		}
 	}
 
 	RegisterXactCallback(MtmXactCallback, NULL);
@@ -536,6 +569,34 @@ _PG_init(void)
 							NULL
 		);
 
+	DefineCustomIntVariable(
+							"multimaster.receivers_memory_limit",
+							"Total size of transactions all receivers may keep in memory before writing them to the disk",
+							"Zero disables the limit; multimaster.trans_spill_threshold is always obeyed.",
+							&MtmReceiversMemoryLimit,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL
+		);
+
+	DefineCustomBoolVariable(
+		"multimaster.spill_compression",
+		"Compress transactions written to the disk with LZ4",
+		"Has no effect if multimaster is built without LZ4 support",
+		&MtmSpillCompression,
+		false,
+		PGC_SIGHUP,
+		0,
+		NULL,
+		NULL,
+		NULL
+		);
+
 	DefineCustomBoolVariable(
 							 "multimaster.monotonic_sequences",
 							 "Enforce monotonic behaviour of sequence values obtained from different nodes",
@@ -589,6 +650,21 @@ _PG_init(void)
 							 NULL
 		);
 
+	DefineCustomIntVariable(
+							"multimaster.dmq_senders",
+							"Number of workers sending messages to other nodes",
+							"Connections to other nodes are distributed among them",
+							&MtmDmqSenders,
+							1,
+							1,
+							DMQ_MAX_SENDERS,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL
+		);
+
 	DefineCustomIntVariable(
 							"multimaster.max_workers",
 							"Maximal number of multimaster dynamic executor workers",
@@ -675,6 +751,21 @@ NULL);
 							NULL
 		);
 
+	DefineCustomIntVariable(
+							"multimaster.recovery_filter_scan_workers",
+							"Number of background workers scanning WAL for recovery filter at receiver start",
+							"WAL is split at segment boundaries between the workers; 0 or 1 means the receiver scans it alone",
+							&MtmRecoveryFilterScanWorkers,
+							4,
+							0,
+							64,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL
+		);
+
 	DefineCustomBoolVariable(
 		"multimaster.binary_basetypes",
 		"Send native PG types in binary format",
@@ -688,6 +779,19 @@ NULL);
 		NULL
 		);
 
+	DefineCustomBoolVariable(
+		"multimaster.stream_in_progress",
+		"Ask senders to stream large transactions before they are prepared",
+		"Changes are sent as soon as sender's logical_decoding_work_mem is exceeded and spooled to disk by receiver; takes effect only on cores supporting streaming of in-progress transactions",
+		&MtmStreamInProgress,
+		true,
+		PGC_SIGHUP,
+		0,
+		NULL,
+		NULL,
+		NULL
+		);
+
 	for (i = 0; mtm_log_gucs[i].name; i++)
 	{
 		MtmLogGuc *guc = &mtm_log_gucs[i];
@@ -721,7 +825,7 @@ NULL);
 	RequestAddinShmemSpace(MTM_SHMEM_SIZE + sizeof(MtmTime));
 	RequestNamedLWLockTranche(MULTIMASTER_NAME, 2);
 
-	dmq_init(MtmHeartbeatSendTimeout, MtmConnectTimeout);
+	dmq_init(MtmHeartbeatSendTimeout, MtmConnectTimeout, MtmDmqSenders);
 	dmq_receiver_start_hook = MtmOnDmqReceiverConnect;
 	dmq_receiver_heartbeat_hook = MtmOnDmqReceiverHeartbeat;
 	dmq_receiver_stop_hook = MtmOnDmqReceiverDisconnect;
@@ -1963,6 +2067,179 @@ mtm_get_bgwpool_stat(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
+#define RECEIVERS_MEMORY_COLS	(2)
+Datum
+mtm_get_receivers_memory(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	Datum		values[RECEIVERS_MEMORY_COLS];
+	bool		nulls[RECEIVERS_MEMORY_COLS];
+	int			i;
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < MTM_MAX_NODES; i++)
+	{
+		if (!BIT_CHECK(Mtm->walreceivers_mask, i))
+			continue;
+
+		MemSet(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(i + 1);
+		values[1] = Int64GetDatum((int64)
+								  pg_atomic_read_u64(&Mtm->peers[i].receiver_buffered));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+static const char *const MtmCommitPhaseMnem[] =
+{
+	"prepare",
+	"prepare_acks",
+	"precommit",
+	"precommit_acks",
+	"commit",
+	"commit_acks"
+};
+
+StaticAssertDecl(lengthof(MtmCommitPhaseMnem) == MTM_N_COMMIT_PHASES,
+				 "commit phase names must match MtmCommitPhase");
+
+/* upper bound of the histogram bucket holding q-th quantile, in ms */
+static double
+commit_phase_quantile(uint64 *hist, uint64 calls, double q)
+{
+	uint64		seen = 0;
+	int			i;
+
+	for (i = 0; i < MTM_PHASE_HIST_BUCKETS; i++)
+	{
+		seen += hist[i];
+		if (seen >= q * calls)
+			break;
+	}
+	/* last bucket has no upper bound, report its lower one */
+	i = Min(i, MTM_PHASE_HIST_BUCKETS - 2);
+	return (double) (UINT64CONST(1) << i) / 1000.0;
+}
+
+#define COMMIT_PHASES_COLS	(7)
+Datum
+mtm_get_commit_phases(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	Datum		values[COMMIT_PHASES_COLS];
+	bool		nulls[COMMIT_PHASES_COLS];
+	int			phase;
+	int			i;
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	for (phase = 0; phase < MTM_N_COMMIT_PHASES; phase++)
+	{
+		for (i = 0; i < MTM_MAX_NODES; i++)
+		{
+			MtmPhaseStat *stat = &Mtm->commit_phases[phase][i];
+			uint64		hist[MTM_PHASE_HIST_BUCKETS];
+			Datum		hist_datums[MTM_PHASE_HIST_BUCKETS];
+			uint64		calls = 0;
+			int			k;
+
+			/* number of calls is the sum of buckets */
+			for (k = 0; k < MTM_PHASE_HIST_BUCKETS; k++)
+			{
+				hist[k] = pg_atomic_read_u64(&stat->hist[k]);
+				hist_datums[k] = Int64GetDatum((int64) hist[k]);
+				calls += hist[k];
+			}
+			if (calls == 0)
+				continue;
+
+			MemSet(nulls, 0, sizeof(nulls));
+			values[0] = CStringGetTextDatum(MtmCommitPhaseMnem[phase]);
+			values[1] = Int32GetDatum(i + 1);
+			values[2] = Int64GetDatum((int64) calls);
+			values[3] = Float8GetDatum(pg_atomic_read_u64(&stat->total_us) / 1000.0);
+			values[4] = Float8GetDatum(commit_phase_quantile(hist, calls, 0.5));
+			values[5] = Float8GetDatum(commit_phase_quantile(hist, calls, 0.99));
+			values[6] = PointerGetDatum(construct_array(hist_datums,
+														MTM_PHASE_HIST_BUCKETS,
+														INT8OID, sizeof(int64),
+														FLOAT8PASSBYVAL, 'd'));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+Datum
+mtm_reset_commit_phases(PG_FUNCTION_ARGS)
+{
+	int			phase;
+	int			i;
+	int			k;
+
+	for (phase = 0; phase < MTM_N_COMMIT_PHASES; phase++)
+	{
+		for (i = 0; i < MTM_MAX_NODES; i++)
+		{
+			MtmPhaseStat *stat = &Mtm->commit_phases[phase][i];
+
+			pg_atomic_write_u64(&stat->total_us, 0);
+			for (k = 0; k < MTM_PHASE_HIST_BUCKETS; k++)
+				pg_atomic_write_u64(&stat->hist[k], 0);
+		}
+	}
+	PG_RETURN_VOID();
+}
+
+/*
+ * gather() is woken up by dmq on message arrival, connection loss and
+ * generation switch, so the timeout is only a safety net against missed
+ * wakeups.
+ */
+#define GATHER_SAFETY_TIMEOUT_MS 1000
+
 /*
  * For each counterparty in participants, either receive and put to messages a
  * msg from it (optionally saving node id of sender in senders) or wait until
@@ -1976,12 +2253,10 @@ mtm_get_bgwpool_stat(PG_FUNCTION_ARGS)
  * lost and restored before msg sent, so we'd abandoned waiting and might
  * unexpectedly receive it now.
  *
- * If sendconn_cnt is not NULL, it must contain sender conn counters from
- * dmq_get_sendconn_cnt. In this case, we stop waiting for counterparty when
- * sender connection reset was spotted.
- * sendconn_cnt must be passed whenever you've sent request via dmq and
- * expect reply to it, otherwise you risk hanging here infinitely if request
- * was lost.
+ * If request was sent with dmq_push_request, we stop waiting for
+ * counterparty once its request lane reconnected, as the request might have
+ * been lost; dmq_pop_nb reports that as failure. The request is considered
+ * answered once msg_ok accepted the reply.
  *
  * If gen_num is not MtmInvalidGenNum, function exits once generation switch
  * occured without waiting for all participants messages, returning false.
@@ -1991,14 +2266,43 @@ bool
 gather(nodemask_t participants,
 	   MtmMessage **messages, int *senders, int *msg_count,
 	   gather_hook_t msg_ok, Datum msg_ok_arg,
-	   int *sendconn_cnt, uint64 gen_num)
+	   uint64 gen_num)
 {
+	return gather_until(participants, messages, senders, msg_count,
+						msg_ok, msg_ok_arg, NULL, (Datum) 0, gen_num);
+}
+
+/*
+ * Same as gather(), but additionally stops (returning true) as soon as done
+ * hook says collected messages are enough, e.g. quorum of acks is reached.
+ * Replies of the rest participants are left unread; they must be filtered
+ * out by msg_ok of subsequent gathers on this stream.
+ */
+bool
+gather_until(nodemask_t participants,
+			 MtmMessage **messages, int *senders, int *msg_count,
+			 gather_hook_t msg_ok, Datum msg_ok_arg,
+			 gather_done_hook_t done, Datum done_arg,
+			 uint64 gen_num)
+{
+	static WaitEventSet *gather_wait_set = NULL;
+
+	if (gather_wait_set == NULL)
+	{
+		gather_wait_set = CreateWaitEventSet(TopMemoryContext, 2);
+		AddWaitEventToSet(gather_wait_set, WL_LATCH_SET, PGINVALID_SOCKET,
+						  MyLatch, NULL);
+		AddWaitEventToSet(gather_wait_set, WL_EXIT_ON_PM_DEATH,
+						  PGINVALID_SOCKET, NULL, NULL);
+	}
+
 	*msg_count = 0;
 	while (participants != 0)
 	{
 		bool		ret;
 		int8 sender_mask_pos;
 		StringInfoData msg;
+		WaitEvent	event;
 		int			rc;
 		bool		wait;
 
@@ -2013,6 +2317,7 @@ gather(nodemask_t participants,
 				continue;
 			}
 
+			dmq_request_answered(sender_mask_pos);
 			messages[*msg_count] = mtm_msg;
 			if (senders != NULL)
 				senders[*msg_count] = sender_mask_pos + 1;
@@ -2021,6 +2326,9 @@ gather(nodemask_t participants,
 
 			mtm_log(MtmCoordinatorTrace, /* that's not accurate */
 					"gather: got message from node%d", sender_mask_pos + 1);
+
+			if (done && done(messages, *msg_count, done_arg))
+				break;
 		}
 		else if (sender_mask_pos != -1)
 		{
@@ -2029,27 +2337,17 @@ gather(nodemask_t participants,
 		}
 		else /* WOULDBLOCK */
 		{
-			/* XXX cache that */
-			rc = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
-						   100.0,
-						   PG_WAIT_EXTENSION);
+			rc = WaitEventSetWait(gather_wait_set, GATHER_SAFETY_TIMEOUT_MS,
+								  &event, 1, PG_WAIT_EXTENSION);
 
 			/* XXX tell the caller about latch reset */
-			if (rc & WL_LATCH_SET)
+			if (rc > 0 && (event.events & WL_LATCH_SET))
 				ResetLatch(MyLatch);
 
-			/* waited a bit fruitlessly -- probably sender conn died? */
-			if (rc & WL_TIMEOUT)
-			{
-				if (sendconn_cnt != NULL)
-					participants = dmq_purge_failed_participants(participants,
-																 sendconn_cnt);
-
-				if (gen_num != MtmInvalidGenNum &&
-					gen_num != MtmGetCurrentGenNum())
-					return false;
-			}
+			/* generation switch sets our latch, so check on every wakeup */
+			if (gen_num != MtmInvalidGenNum &&
+				gen_num != MtmGetCurrentGenNum())
+				return false;
 
 			CHECK_FOR_INTERRUPTS();
 		}
@@ -314,6 +314,9 @@ process_syncpoint(MtmReceiverWorkerContext *rwctx, const char *msg, XLogRecPtr r
 		 */
 		MtmWakeupReceivers();
 	}
+
+	/* xacts before the syncpoint won't be needed in the filter anymore */
+	RecoveryFilterRequestCheckpoint(origin_node, origin_lsn);
 }
 
 /* TODO: make messaging layer for logical messages like existing dmq one */
@@ -665,8 +668,8 @@ mtm_send_prepare_reply(TransactionId xid, int dst_node_id,
 	msg.xid = xid;
 	packed_msg = MtmMessagePack((MtmMessage *) &msg);
 
-	dmq_push_buffer(dest_id, psprintf("xid" XID_FMT, xid),
-					packed_msg->data, packed_msg->len);
+	dmq_push_buffer_id(dest_id, dmq_stream_id(dst_node_id, xid),
+					   packed_msg->data, packed_msg->len);
 
 	mtm_log(MtmApplyTrace,
 			"MtmFollowerSendReply: " XID_FMT " to node%d (dest %d), prepared=%d",
@@ -705,8 +708,8 @@ mtm_send_2a_reply(char *gid, TransactionId xid, GlobalTxStatus status,
 	msg.gid = gid;
 	packed_msg = MtmMessagePack((MtmMessage *) &msg);
 
-	dmq_push_buffer(dest_id, psprintf("xid" XID_FMT, xid),
-					packed_msg->data, packed_msg->len);
+	dmq_push_buffer_id(dest_id, dmq_stream_id(dst_node_id, xid),
+					   packed_msg->data, packed_msg->len);
 	mtm_log(MtmApplyTrace,
 			"MtmFollowerSendReply: 2b for %s to node%d (dest %d), status %d",
 			gid, dst_node_id, dest_id, status);
@@ -958,6 +961,15 @@ process_remote_commit(StringInfo in,
 				QueryCancelPending = false;
 				query_cancel_allowed = false;
 
+				/*
+				 * Reply right away. Handing it off to some acker waiting for
+				 * WAL flush wouldn't let us proceed to the next xact earlier:
+				 * PREPARE record is unconditionally flushed (and grouped with
+				 * concurrent flushes by WAL group commit) inside PREPARE
+				 * itself. Replies of all workers are grouped as well, by dmq
+				 * sender which packs everything queued for the destination
+				 * during its loop iteration into a single frame.
+				 */
 				if (rwctx->mode == REPLMODE_NORMAL)
 				{
 					mtm_send_prepare_reply(rwctx->origin_xid,
@@ -1470,7 +1482,7 @@ MtmExecutor(void *work, size_t size, MtmReceiverWorkerContext *rwctx)
 {
 	StringInfoData s;
 	Relation	rel = NULL;
-	int			spill_file = -1;
+	MtmSpillFile *volatile spill_file = NULL;
 	int			save_cursor = 0;
 	int			save_len = 0;
 	MemoryContext old_context = CurrentMemoryContext;
@@ -1536,10 +1548,10 @@ MtmExecutor(void *work, size_t size, MtmReceiverWorkerContext *rwctx)
 					/* COMMIT */
 				case 'C':
 					close_rel(rel);
-					if (spill_file >= 0)
+					if (spill_file != NULL)
 					{
-						CloseTransientFile(spill_file);
-						spill_file = -1;
+						MtmCloseSpillFile(spill_file);
+						spill_file = NULL;
 					}
 					process_remote_commit(&s, rwctx);
 					inside_transaction = false;
@@ -1568,7 +1580,7 @@ MtmExecutor(void *work, size_t size, MtmReceiverWorkerContext *rwctx)
 						int			node_id = pq_getmsgint(&s, 4);
 						int			file_id = pq_getmsgint(&s, 4);
 
-						Assert(spill_file < 0);
+						Assert(spill_file == NULL);
 						spill_file = MtmOpenSpillFile(node_id, file_id);
 						break;
 					}
@@ -1576,16 +1588,14 @@ MtmExecutor(void *work, size_t size, MtmReceiverWorkerContext *rwctx)
 					{
 						size_t		size = pq_getmsgint(&s, 4);
 
-						s.data = MemoryContextAlloc(TopMemoryContext, size);
 						save_cursor = s.cursor;
 						save_len = s.len;
+						s.data = MtmReadSpillFile(spill_file, size);
 						s.cursor = 0;
 						s.len = size;
-						MtmReadSpillFile(spill_file, s.data, size);
 						break;
 					}
 				case ')': /* end of chunk in spill file */
-					pfree(s.data);
 					s.data = work;
 					s.cursor = save_cursor;
 					s.len = save_len;
@@ -1719,6 +1729,13 @@ MtmExecutor(void *work, size_t size, MtmReceiverWorkerContext *rwctx)
 
 		/* cleanup */
 
+		/* before abort, which would close the file under us */
+		if (spill_file != NULL)
+		{
+			MtmCloseSpillFile(spill_file);
+			spill_file = NULL;
+		}
+
 		ReleasePB();
 
 		if (rwctx->gtx != NULL)
@@ -1755,7 +1772,6 @@ MtmExecutor(void *work, size_t size, MtmReceiverWorkerContext *rwctx)
 	txl_remove(&BGW_POOL_BY_NODE_ID(rwctx->sender_node_id)->txlist,
 			   rwctx->txlist_pos);
 	rwctx->txlist_pos = -1;
-	if (s.data != work)
-		pfree(s.data);
+	/* chunks of spill file belong to it and were freed with it */
 	MemoryContextSwitchTo(old_context);
 }
@@ -223,7 +223,8 @@ call_row_filter_hook(PGLogicalOutputData *data, ReorderBufferTXN *txn,
 }
 
 bool
-call_txn_filter_hook(PGLogicalOutputData *data, RepOriginId txn_origin)
+call_txn_filter_hook(PGLogicalOutputData *data, RepOriginId txn_origin,
+					 ReorderBufferTXN *txn)
 {
 	struct PGLogicalTxnFilterArgs hook_args;
 	bool		ret = true;
@@ -233,6 +234,7 @@ call_txn_filter_hook(PGLogicalOutputData *data, RepOriginId txn_origin)
 	{
 		hook_args.private_data = data->hooks.hooks_private_data;
 		hook_args.origin_id = txn_origin;
+		hook_args.txn = txn;
 
 		elog(DEBUG3, "calling pglogical txn filter hook");
 
@@ -57,6 +57,7 @@
 #include "multimaster.h"
 #include "logger.h"
 #include "state.h"
+#include "compat.h"
 
 extern void _PG_output_plugin_init(OutputPluginCallbacks *cb);
 
@@ -95,8 +96,28 @@ static void pg_decode_message(LogicalDecodingContext *ctx,
 				  Size sz, const char *message);
 static void pg_decode_caughtup(LogicalDecodingContext *ctx);
 
+#ifdef MTM_STREAMING_SUPPORTED
+static void pg_decode_stream_start(LogicalDecodingContext *ctx,
+					   ReorderBufferTXN *txn);
+static void pg_decode_stream_stop(LogicalDecodingContext *ctx,
+					  ReorderBufferTXN *txn);
+static void pg_decode_stream_change(LogicalDecodingContext *ctx,
+						ReorderBufferTXN *txn, Relation rel,
+						ReorderBufferChange *change);
+static void pg_decode_stream_abort(LogicalDecodingContext *ctx,
+					   ReorderBufferTXN *txn, XLogRecPtr abort_lsn);
+static void pg_decode_stream_prepare(LogicalDecodingContext *ctx,
+						 ReorderBufferTXN *txn, XLogRecPtr prepare_lsn);
+static void pg_decode_stream_commit(LogicalDecodingContext *ctx,
+						ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
+
+/* (sub)xact whose changes are currently being streamed */
+static TransactionId stream_subxid = InvalidTransactionId;
+#endif
+
 static void send_startup_message(LogicalDecodingContext *ctx,
 					 PGLogicalOutputData *data, bool last_message);
+static void send_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn);
 
 static bool startup_message_sent = false;
 
@@ -143,6 +164,16 @@ _PG_output_plugin_init(OutputPluginCallbacks *cb)
 	cb->shutdown_cb = pg_decode_shutdown;
 	cb->message_cb = pg_decode_message;
 	cb->caughtup_cb = pg_decode_caughtup;
+
+#ifdef MTM_STREAMING_SUPPORTED
+	cb->stream_start_cb = pg_decode_stream_start;
+	cb->stream_stop_cb = pg_decode_stream_stop;
+	cb->stream_change_cb = pg_decode_stream_change;
+	cb->stream_message_cb = pg_decode_message;
+	cb->stream_abort_cb = pg_decode_stream_abort;
+	cb->stream_prepare_cb = pg_decode_stream_prepare;
+	cb->stream_commit_cb = pg_decode_stream_commit;
+#endif
 }
 
 #if 0
@@ -400,6 +431,18 @@ pg_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
 			load_hooks(data);
 			call_startup_hook(data, ctx->output_plugin_options);
 		}
+
+#ifdef MTM_STREAMING_SUPPORTED
+		/*
+		 * Core enables streaming whenever stream callbacks are present;
+		 * stream in-progress xacts only if receiver asked for it.
+		 */
+		{
+			MtmDecoderPrivate *hooks_data = (MtmDecoderPrivate *) data->hooks.hooks_private_data;
+
+			ctx->streaming &= hooks_data != NULL && hooks_data->streaming;
+		}
+#endif
 	}
 }
 
@@ -408,6 +451,22 @@ pg_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
  */
 void
 pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+
+	/*
+	 * Now, unlike in pg_decode_origin_filter, lsns of the xact are known
+	 * and we can check whether the receiver already has it.
+	 */
+	data->txn_filtered = !call_txn_filter_hook(data, txn->origin_id, txn);
+	if (data->txn_filtered)
+		return;
+
+	send_begin(ctx, txn);
+}
+
+static void
+send_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 	bool		send_replication_origin = data->forward_changeset_origins;
@@ -474,6 +533,9 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 
+	if (data->txn_filtered)
+		return;
+
 	if (data->api)
 	{
 		MtmOutputPluginPrepareWrite(ctx, true, true);
@@ -488,6 +550,9 @@ pg_decode_prepare_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 
+	if (!call_txn_filter_hook(data, txn->origin_id, txn))
+		return;
+
 	MtmOutputPluginPrepareWrite(ctx, true, true);
 	pglogical_write_prepare(ctx->out, data, txn, lsn);
 	MtmOutputPluginWrite(ctx, true, true);
@@ -499,6 +564,9 @@ pg_decode_commit_prepared_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 
+	if (!call_txn_filter_hook(data, txn->origin_id, txn))
+		return;
+
 	MtmOutputPluginPrepareWrite(ctx, true, true);
 	pglogical_write_commit_prepared(ctx->out, data, txn, lsn);
 	MtmOutputPluginWrite(ctx, true, true);
@@ -510,6 +578,9 @@ pg_decode_abort_prepared_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 
+	if (!call_txn_filter_hook(data, txn->origin_id, txn))
+		return;
+
 	MtmOutputPluginPrepareWrite(ctx, true, true);
 	pglogical_write_abort_prepared(ctx->out, data, txn, lsn);
 	MtmOutputPluginWrite(ctx, true, true);
@@ -522,6 +593,9 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	PGLogicalOutputData *data = ctx->output_plugin_private;
 	MemoryContext old;
 
+	if (data->txn_filtered)
+		return;
+
 	/* First check the table filter */
 	if (!call_row_filter_hook(data, txn, relation, change) || data->api == NULL)
 		return;
@@ -586,7 +660,7 @@ pg_decode_origin_filter(LogicalDecodingContext *ctx,
 {
 	PGLogicalOutputData *data = ctx->output_plugin_private;
 
-	if (!call_txn_filter_hook(data, origin_id))
+	if (!call_txn_filter_hook(data, origin_id, NULL))
 	{
 		return true;
 	}
@@ -606,6 +680,9 @@ pg_decode_message(LogicalDecodingContext *ctx,
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 
+	if (transactional && data->txn_filtered)
+		return;
+
 	MtmOutputPluginPrepareWrite(ctx, true, !transactional);
 	data->api->write_message(ctx->out, ctx, lsn, prefix, sz, message);
 	MtmOutputPluginWrite(ctx, true, !transactional);
@@ -677,7 +754,141 @@ pg_decode_abort_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 {
 	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
 
+	if (data->txn_filtered)
+		return;
+
 	MtmOutputPluginPrepareWrite(ctx, true, true);
 	pglogical_write_abort(ctx->out, data, txn, abort_lsn);
 	MtmOutputPluginWrite(ctx, true, true);
 }
+
+#ifdef MTM_STREAMING_SUPPORTED
+/*
+ * Streaming of large in-progress xacts. Instead of spilling xact to disk
+ * in reorder buffer and sending it only when decoding reaches PREPARE, send
+ * changes in blocks as soon as logical_decoding_work_mem is exceeded.
+ * Receiver spools the blocks into spill file and applies the xact once the
+ * finishing PREPARE arrives, so nothing changes in terms of 3PC, but
+ * transfer of the xact body overlaps with its execution at origin.
+ *
+ * Each block is enclosed in STREAM START/STOP messages which, as well as
+ * subxact switch announcements, are always sent as separate messages:
+ * receiver routes data by the first byte of message.
+ */
+static void
+pg_decode_stream_start(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+	bool		first_segment = !rbtxn_is_streamed(txn);
+
+	if (!startup_message_sent)
+		send_startup_message(ctx, data, false /* can't be last message */ );
+
+	MtmOutputPluginPrepareWrite(ctx, true, true);
+	pglogical_write_stream_start(ctx->out, data, txn, first_segment);
+	MtmOutputPluginWrite(ctx, true, true);
+	stream_subxid = txn->xid;
+
+	/*
+	 * lsns of streamed xact are not known yet, so it is filtered only once
+	 * it is finished, see pg_decode_stream_filtered.
+	 */
+	data->txn_filtered = false;
+
+	/* the very first block carries BEGIN as usual */
+	if (first_segment)
+		send_begin(ctx, txn);
+}
+
+static void
+pg_decode_stream_stop(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+
+	MtmOutputPluginPrepareWrite(ctx, true, true);
+	pglogical_write_stream_stop(ctx->out, data, txn);
+	MtmOutputPluginWrite(ctx, true, true);
+	stream_subxid = InvalidTransactionId;
+}
+
+static void
+pg_decode_stream_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						Relation relation, ReorderBufferChange *change)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+
+	/* txn is toplevel here, change->txn might be subxact */
+	if (change->txn->xid != stream_subxid)
+	{
+		MtmOutputPluginPrepareWrite(ctx, true, true);
+		pglogical_write_stream_subxact(ctx->out, data, change->txn->xid);
+		MtmOutputPluginWrite(ctx, true, true);
+		stream_subxid = change->txn->xid;
+	}
+
+	pg_decode_change(ctx, txn, relation, change);
+}
+
+static void
+pg_decode_stream_abort(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					   XLogRecPtr abort_lsn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+	ReorderBufferTXN *toptxn = txn->toptxn ? txn->toptxn : txn;
+
+	MtmOutputPluginPrepareWrite(ctx, true, true);
+	pglogical_write_stream_abort(ctx->out, data, toptxn->xid, txn->xid);
+	MtmOutputPluginWrite(ctx, true, true);
+}
+
+/*
+ * Finished streamed xact goes through the same filter as the regular ones;
+ * if the receiver doesn't need it, tell it to drop the spooled body.
+ */
+static bool
+pg_decode_stream_filtered(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+
+	if (call_txn_filter_hook(data, txn->origin_id, txn))
+		return false;
+
+	MtmOutputPluginPrepareWrite(ctx, true, true);
+	pglogical_write_stream_abort(ctx->out, data, txn->xid, txn->xid);
+	MtmOutputPluginWrite(ctx, true, true);
+	return true;
+}
+
+static void
+pg_decode_stream_prepare(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						 XLogRecPtr prepare_lsn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+
+	/* state_3pc changes carry no data and thus are never streamed */
+	Assert(!txn->state_3pc_change);
+
+	if (pg_decode_stream_filtered(ctx, txn))
+		return;
+
+	MtmOutputPluginPrepareWrite(ctx, true, true);
+	pglogical_write_stream_finish(ctx->out, data, txn);
+	pglogical_write_prepare(ctx->out, data, txn, prepare_lsn);
+	MtmOutputPluginWrite(ctx, true, true);
+}
+
+static void
+pg_decode_stream_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						XLogRecPtr commit_lsn)
+{
+	PGLogicalOutputData *data = (PGLogicalOutputData *) ctx->output_plugin_private;
+
+	if (pg_decode_stream_filtered(ctx, txn))
+		return;
+
+	MtmOutputPluginPrepareWrite(ctx, true, true);
+	pglogical_write_stream_finish(ctx->out, data, txn);
+	data->api->write_commit(ctx->out, data, txn, commit_lsn);
+	MtmOutputPluginWrite(ctx, true, true);
+}
+#endif
@@ -62,6 +62,7 @@
 #include "state.h"
 #include "ddl.h"
 #include "logger.h"
+#include "syncpoint.h"
 
 char *walsender_name;
 
@@ -72,6 +73,15 @@ static Oid	MtmSenderTID;		/* transaction identifier for WAL sender */
 static Oid	MtmLastRelId;		/* last relation ID sent to the receiver in
 								 * this transaction */
 
+/*
+ * Streamed xacts interleave with each other and with normally decoded ones,
+ * so per-xact sender state must survive between stream blocks. The only
+ * such state worth keeping is DDLInProgress; remember xids of streamed
+ * xacts whose block was stopped in the middle of DDL. (TransactionId is
+ * stored as Oid, they are of the same width.)
+ */
+static List *MtmStreamedDDLXids = NIL;
+
 static void pglogical_write_rel(StringInfo out, PGLogicalOutputData *data, Relation rel);
 
 static void pglogical_write_begin(StringInfo out, PGLogicalOutputData *data,
@@ -394,37 +404,42 @@ write_startup_message(StringInfo out, List *msg)
 {
 }
 
-static void
-send_node_id(StringInfo out, ReorderBufferTXN *txn, MtmDecoderPrivate *private)
+/*
+ * Map xact origin to node id; MtmInvalidNodeId if origin is unknown.
+ */
+static int
+origin_node_id(ReorderBufferTXN *txn, MtmDecoderPrivate *private)
 {
-	if (txn->origin_id != InvalidRepOriginId)
-	{
-		int			i;
+	int			i;
 
-		for (i = 0; i < private->cfg->n_nodes; i++)
-		{
-			if (private->cfg->nodes[i].node_id == private->cfg->my_node_id)
-				continue;
+	if (txn->origin_id == InvalidRepOriginId)
+		return private->cfg->my_node_id;
 
-			if (private->cfg->nodes[i].origin_id == txn->origin_id)
-			{
-				pq_sendbyte(out, private->cfg->nodes[i].node_id);
-				return;
-			}
-		}
-		/*
-		 * Could happen if node was dropped. Might lead to skipping dropped
-		 * node xacts on some lagged node, but who ever said we support
-		 * membership changes under load? Such records will be dropped by
-		 * filter on receiver side.
-		 */
-		mtm_log(WARNING, "failed to map origin %d", txn->origin_id);
-		pq_sendbyte(out, MtmInvalidNodeId);
-	}
-	else
+	for (i = 0; i < private->cfg->n_nodes; i++)
 	{
-		pq_sendbyte(out, private->cfg->my_node_id);
+		if (private->cfg->nodes[i].node_id == private->cfg->my_node_id)
+			continue;
+
+		if (private->cfg->nodes[i].origin_id == txn->origin_id)
+			return private->cfg->nodes[i].node_id;
 	}
+	return MtmInvalidNodeId;
+}
+
+static void
+send_node_id(StringInfo out, ReorderBufferTXN *txn, MtmDecoderPrivate *private)
+{
+	int			node_id = origin_node_id(txn, private);
+
+	/*
+	 * Could happen if node was dropped. Might lead to skipping dropped
+	 * node xacts on some lagged node, but who ever said we support
+	 * membership changes under load? Such records will be dropped by
+	 * filter on receiver side.
+	 */
+	if (node_id == MtmInvalidNodeId)
+		mtm_log(WARNING, "failed to map origin %d", txn->origin_id);
+	pq_sendbyte(out, node_id);
 }
 
 
@@ -590,6 +605,117 @@ pglogical_write_abort(StringInfo out, PGLogicalOutputData *data,
 }
 
 
+/*
+ * Write STREAM START to the output stream.
+ *
+ * Everything sent until STREAM STOP belongs to the xact txn; receiver spools
+ * it to disk and applies the xact only when its PREPARE (or COMMIT) arrives,
+ * see pglogical_write_stream_finish.
+ */
+void
+pglogical_write_stream_start(StringInfo out, PGLogicalOutputData *data,
+							 ReorderBufferTXN *txn, bool first_segment)
+{
+	/*
+	 * Other xacts could have been sent since the previous block of this one,
+	 * and relation names might have been sent there only. Start new sender
+	 * tid so that relations are described again.
+	 */
+	if (++MtmSenderTID == InvalidOid)
+	{
+		pglogical_relid_map_reset();
+		MtmSenderTID += 1;		/* skip InvalidOid */
+	}
+	MtmLastRelId = InvalidOid;
+	MtmCurrentXid = txn->xid;
+
+	/* restore DDL state saved at previous STREAM STOP */
+	DDLInProgress = list_member_oid(MtmStreamedDDLXids, txn->xid);
+	if (DDLInProgress)
+		MtmStreamedDDLXids = list_delete_oid(MtmStreamedDDLXids, txn->xid);
+
+	pq_sendbyte(out, 'S');		/* STREAM START */
+	pq_sendint64(out, txn->xid);
+	pq_sendbyte(out, first_segment);
+
+	mtm_log(ProtoTraceSender, "pglogical_write_stream_start xid=" XID_FMT " first_segment=%d",
+			txn->xid, first_segment);
+}
+
+/*
+ * Write STREAM STOP to the output stream.
+ */
+void
+pglogical_write_stream_stop(StringInfo out, PGLogicalOutputData *data,
+							ReorderBufferTXN *txn)
+{
+	if (DDLInProgress)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		MtmStreamedDDLXids = lappend_oid(MtmStreamedDDLXids, MtmCurrentXid);
+		MemoryContextSwitchTo(oldcontext);
+		DDLInProgress = false;
+	}
+	MtmLastRelId = InvalidOid;
+
+	pq_sendbyte(out, 'E');		/* STREAM STOP */
+
+	mtm_log(ProtoTraceSender, "pglogical_write_stream_stop xid=" XID_FMT,
+			MtmCurrentXid);
+}
+
+/*
+ * Announce that the following streamed changes belong to subxact subxid.
+ * Receiver remembers where changes of each subxact start to be able to
+ * discard them on STREAM ABORT of the subxact.
+ */
+void
+pglogical_write_stream_subxact(StringInfo out, PGLogicalOutputData *data,
+							   TransactionId subxid)
+{
+	pq_sendbyte(out, 'X');
+	pq_sendint64(out, subxid);
+}
+
+/*
+ * Write STREAM ABORT to the output stream. subxid equals xid if the whole
+ * streamed xact is aborted.
+ */
+void
+pglogical_write_stream_abort(StringInfo out, PGLogicalOutputData *data,
+							 TransactionId xid, TransactionId subxid)
+{
+	if (xid == subxid)
+		MtmStreamedDDLXids = list_delete_oid(MtmStreamedDDLXids, xid);
+
+	pq_sendbyte(out, 'A');		/* STREAM ABORT */
+	pq_sendint64(out, xid);
+	pq_sendint64(out, subxid);
+
+	mtm_log(ProtoTraceSender, "pglogical_write_stream_abort xid=" XID_FMT " subxid=" XID_FMT,
+			xid, subxid);
+}
+
+/*
+ * Write header of streamed xact finish. It is immediately followed (in the
+ * same message) by usual PREPARE or COMMIT event written by
+ * pglogical_write_prepare or pglogical_write_commit.
+ */
+void
+pglogical_write_stream_finish(StringInfo out, PGLogicalOutputData *data,
+							  ReorderBufferTXN *txn)
+{
+	Assert(!list_member_oid(MtmStreamedDDLXids, txn->xid));
+	Assert(!DDLInProgress);
+
+	pq_sendbyte(out, 'P');		/* STREAM FINISH */
+	pq_sendint64(out, txn->xid);
+
+	mtm_log(ProtoTraceSender, "pglogical_write_stream_finish xid=" XID_FMT " gid=%s",
+			txn->xid, txn->gid);
+}
+
 /*
  * Write a tuple to the outputstream, in the most efficient format possible.
  */
@@ -825,12 +951,23 @@ MtmReplicationStartupHook(struct PGLogicalStartupHookArgs *args)
 				mtm_log(ERROR, "Replication mode is not specified");
 			}
 		}
+		else if (strcmp("mtm_filter", elem->defname) == 0)
+		{
+			if (elem->arg != NULL && strVal(elem->arg) != NULL)
+				hooks_data->filter = SenderFilterDecode(strVal(elem->arg));
+		}
+		else if (strcmp("mtm_streaming", elem->defname) == 0)
+		{
+			if (elem->arg != NULL && strVal(elem->arg) != NULL)
+				hooks_data->streaming = strcmp(strVal(elem->arg), "1") == 0;
+		}
 	}
 
 	mtm_log(ProtoTraceState,
-			"walsender to node %d starts in %s mode",
+			"walsender to node %d starts in %s mode%s",
 			hooks_data->receiver_node_id,
-			hooks_data->is_recovery ? "recovery" : "normal");
+			hooks_data->is_recovery ? "recovery" : "normal",
+			hooks_data->streaming ? ", streaming enabled" : "");
 }
 
 static void
@@ -860,6 +997,38 @@ MtmReplicationTxnFilterHook(struct PGLogicalTxnFilterArgs *args)
 	bool		res = (args->origin_id == InvalidRepOriginId ||
 					   hooks_data->is_recovery);
 
+	/*
+	 * Once xact is decoded, also check whether the receiver already has it
+	 * according to the filter it has sent us. This is exactly the check
+	 * MtmFilterTransaction does, but here it saves the traffic, which is
+	 * huge when recovering after long outage.
+	 */
+	if (res && args->txn != NULL && hooks_data->filter != NULL)
+	{
+		ReorderBufferTXN *txn = args->txn;
+		int			origin_node = origin_node_id(txn, hooks_data);
+		XLogRecPtr	tx_lsn;
+
+		/* receiver skips unknown origins and own xacts */
+		if (origin_node == MtmInvalidNodeId ||
+			origin_node == hooks_data->receiver_node_id)
+		{
+			mtm_log(ProtoTraceFilter, "skipping xact gid=%s of origin %d",
+					txn->gid, origin_node);
+			return false;
+		}
+
+		tx_lsn = origin_node == hooks_data->cfg->my_node_id ?
+			txn->end_lsn : txn->origin_lsn;
+		if (tx_lsn != InvalidXLogRecPtr &&
+			SenderFilterMatch(hooks_data->filter, origin_node, tx_lsn))
+		{
+			mtm_log(ProtoTraceFilter, "skipping xact gid=%s origin_node=%d tx_lsn=" LSN_FMT " as receiver already has it",
+					txn->gid, origin_node, tx_lsn);
+			return false;
+		}
+	}
+
 	return res;
 }
 
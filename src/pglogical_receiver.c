@@ -18,6 +18,7 @@
 #include "miscadmin.h"
 #include "pqexpbuffer.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "access/clog.h"
 #include "access/transam.h"
 #include "lib/stringinfo.h"
@@ -61,12 +62,55 @@
 
 bool		MtmIsReceiver;
 
+/*
+ * Streamed in-progress xact which is being spooled to disk until its
+ * PREPARE arrives, see pg_decode_stream_start.
+ */
+typedef struct
+{
+	TransactionId xid;			/* hash key, xid at sender */
+	int			file_id;
+	MtmSpillFile *file;
+	StringInfoData spill_info;	/* 'F' and '(' records telling apply how to
+								 * read the file */
+	List	   *subxacts;		/* MtmStreamedSubxact in order of appearance */
+} MtmStreamedXact;
+
+/* Where changes of subxact of streamed xact start in its spill file */
+typedef struct
+{
+	TransactionId subxid;
+	off_t		offset;
+	int			info_len;
+} MtmStreamedSubxact;
+
 typedef struct
 {
 	MtmReceiverWorkerContext w;
 	XLogRecPtr last_reported_flush;
 	TimestampTz last_send_time;
 	WalReceiverConn *wrconn;
+	/*
+	 * Connection used to advance our slot at sender while we can't stream
+	 * from it, kept open to avoid paying for session startup each time.
+	 */
+	WalReceiverConn *ctl_conn;
+	TimestampTz last_advance_time;
+	/* streamed xacts; xid -> MtmStreamedXact */
+	HTAB	   *streams;
+	/* xact of the current stream block, if any */
+	MtmStreamedXact *cur_stream;
+	/* not yet spilled changes of cur_stream */
+	ByteBuffer	stream_buf;
+	/*
+	 * Works which didn't fit into the pool queue: instead of blocking until
+	 * workers catch up we keep reading the socket and queue them here, see
+	 * MtmDispatch. Each is int size followed by the work itself.
+	 */
+	ByteBuffer	backlog;
+	int			backlog_head;
+	/* our share of Mtm->receivers_buffered */
+	uint64		buffered;
 } MtmReceiverContext;
 
 MtmReplicationMode curr_replication_mode = REPLMODE_DISABLED;
@@ -162,17 +206,59 @@ sendFeedback(MtmReceiverContext *rctx, bool force)
 	rctx->last_reported_flush = flush_pos;
 }
 
+/* pg_lsn text as returned by the sender, invalid if can't parse */
+static XLogRecPtr
+parse_lsn(char const *str)
+{
+	uint32		hi;
+	uint32		lo;
+
+	if (sscanf(str, "%X/%X", &hi, &lo) != 2)
+		return InvalidXLogRecPtr;
+	return ((uint64) hi << 32) | lo;
+}
+
+static void
+MtmCloseControlConnection(MtmReceiverContext *rctx)
+{
+	if (rctx->ctl_conn == NULL)
+		return;
+	walrcv_disconnect(rctx->ctl_conn);
+	rctx->ctl_conn = NULL;
+}
+
+static PGresult *
+MtmControlExec(MtmReceiverContext *rctx, char const *sql)
+{
+	PGresult   *res;
+
+	res = PQexec(((MyWalReceiverConn *) rctx->ctl_conn)->streamConn, sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		char	   *msg = pstrdup(PQresultErrorMessage(res));
+
+		PQclear(res);
+		/* don't know what state it is in, reconnect next time */
+		MtmCloseControlConnection(rctx);
+		mtm_log(ERROR, "%s at node %d failed: %s",
+				sql, rctx->w.sender_node_id, msg);
+	}
+	return res;
+}
+
 /*
- * pg_replication_slot_advance sender slot if we can do that further last
- * advancement. Note that decoding session startup is quite heavy operation as
- * we must read all unacked WAL + earlier chunk up to suitable snapshot
- * serialization point (which is created mostly each
- * LOG_SNAPSHOT_INTERVAL_MS).
+ * Advance our slot at sender up to the recovery horizon while we can't stream
+ * from it, to let it trim WAL. Decoding session startup is heavy, so rather
+ * than doing this each time the horizon moves, we advance once it has moved
+ * by a WAL segment or wal_receiver_status_interval passed, through the same
+ * control connection kept open while we wait.
  */
 static void
 MtmMaybeAdvanceSlot(MtmReceiverContext *rctx, char *conninfo)
 {
 	XLogRecPtr upto = GetRecoveryHorizon(rctx->w.sender_node_id);
+	XLogRecPtr	advanced;
+	TimestampTz now = GetCurrentTimestamp();
 	char *upto_text;
 	char *sql;
 	PGresult   *res;
@@ -182,34 +268,57 @@ MtmMaybeAdvanceSlot(MtmReceiverContext *rctx, char *conninfo)
 	if (upto <= rctx->last_reported_flush)
 		return;
 
+	if (rctx->last_reported_flush != InvalidXLogRecPtr &&
+		upto - rctx->last_reported_flush < wal_segment_size &&
+		!TimestampDifferenceExceeds(rctx->last_advance_time, now,
+									wal_receiver_status_interval * 1000))
+		return;
+
 	/*
 	 * it would be nice for libpqwalreceiver to expose interruptable
 	 * libpqrcv_PQexec and use it here
 	 */
-	rctx->wrconn = walrcv_connect(conninfo, true, MyBgworkerEntry->bgw_name,
-								  &err);
-	if (rctx->wrconn == NULL)
-		ereport(ERROR,
-				(errmsg("could not connect to the sender: %s", err)));
-
-	upto_text = pg_lsn_out_c(upto);
-	sql = psprintf("select pg_replication_slot_advance('" MULTIMASTER_SLOT_PATTERN	"', '%s');",
-				   Mtm->my_node_id,
-				   upto_text);
-
-	res = PQexec(((MyWalReceiverConn *) rctx->wrconn)->streamConn, sql);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	if (rctx->ctl_conn == NULL)
 	{
-		mtm_log(ERROR, "%s at node %d failed: %s",
-				sql, rctx->w.sender_node_id, PQresultErrorMessage(res));
+		rctx->ctl_conn = walrcv_connect(conninfo, true,
+										MyBgworkerEntry->bgw_name, &err);
+		if (rctx->ctl_conn == NULL)
+			ereport(ERROR,
+					(errmsg("could not connect to the sender: %s", err)));
+
+		/* learn where the slot is to tell how much each advance releases */
+		sql = psprintf("select confirmed_flush_lsn from pg_replication_slots where slot_name = '" MULTIMASTER_SLOT_PATTERN "';",
+					   Mtm->my_node_id);
+		res = MtmControlExec(rctx, sql);
+		if (PQntuples(res) == 1 && !PQgetisnull(res, 0, 0))
+			rctx->last_reported_flush = parse_lsn(PQgetvalue(res, 0, 0));
+		PQclear(res);
+		pfree(sql);
 	}
-	rctx->last_reported_flush = upto;
-	mtm_log(MtmReceiverFeedback, "advanced slot to %s", upto_text);
 
-	pfree(upto_text);
-	pfree(sql);
-	walrcv_disconnect(rctx->wrconn);
-	rctx->wrconn = NULL;
+	/* slot_advance refuses to move backwards */
+	if (upto > rctx->last_reported_flush)
+	{
+		upto_text = pg_lsn_out_c(upto);
+		sql = psprintf("select end_lsn from pg_replication_slot_advance('" MULTIMASTER_SLOT_PATTERN	"', '%s');",
+					   Mtm->my_node_id,
+					   upto_text);
+
+		res = MtmControlExec(rctx, sql);
+		advanced = parse_lsn(PQgetvalue(res, 0, 0));
+		PQclear(res);
+
+		if (advanced > rctx->last_reported_flush)
+			mtm_log(MtmReceiverFeedback, "advanced slot to %X/%X, released " UINT64_FORMAT " bytes of WAL",
+					(uint32) (advanced >> 32), (uint32) advanced,
+					rctx->last_reported_flush != InvalidXLogRecPtr ?
+					advanced - rctx->last_reported_flush : 0);
+		rctx->last_reported_flush = Max(upto, advanced);
+
+		pfree(upto_text);
+		pfree(sql);
+	}
+	rctx->last_advance_time = now;
 
 	/*
 	 * libpqwalreceiver calls above have WaitLatch/ResetLatch inside so we
@@ -241,15 +350,110 @@ fe_recvint64(char *buf)
 	return result;
 }
 
+#define BACKLOG_PENDING(rctx) ((rctx)->backlog.used - (rctx)->backlog_head)
+
+/*
+ * Wait until pool workers make room in the queue. Sender might be waiting for
+ * our feedback meanwhile, so keep sending it.
+ */
 static void
-MtmExecute(void *work, int size, MtmReceiverWorkerContext *rwctx, bool no_pool)
+MtmWaitPool(MtmReceiverContext *rctx)
 {
-	if (rwctx->mode == REPLMODE_RECOVERY || no_pool)
-		MtmExecutor(work, size, rwctx);
-	else
-		BgwPoolExecute(BGW_POOL_BY_NODE_ID(rwctx->sender_node_id), work,
-					   size, rwctx);
+	int			rc;
+
+	sendFeedback(rctx, false);
+	rc = WaitLatch(MyLatch,
+				   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+				   wal_receiver_status_interval > 0 ?
+				   wal_receiver_status_interval * 1000L : 1000L,
+				   PG_WAIT_EXTENSION);
+	ConditionVariableCancelSleep();
+	if (rc & WL_LATCH_SET)
+		ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * Push into the pool as much of backlog as it accepts without waiting.
+ * Returns true if backlog is empty now.
+ */
+static bool
+MtmDispatchBacklog(MtmReceiverContext *rctx)
+{
+	BgwPool    *pool = BGW_POOL_BY_NODE_ID(rctx->w.sender_node_id);
+
+	while (BACKLOG_PENDING(rctx) > 0)
+	{
+		char	   *work = rctx->backlog.data + rctx->backlog_head;
+		int			size;
+
+		memcpy(&size, work, sizeof(int));
+		if (!BgwPoolTryExecute(pool, work + sizeof(int), size, &rctx->w))
+			return false;
+		rctx->backlog_head += sizeof(int) + size;
+	}
+	ByteBufferReset(&rctx->backlog);
+	rctx->backlog_head = 0;
+	return true;
+}
 
+static void
+MtmDrainBacklog(MtmReceiverContext *rctx)
+{
+	while (!MtmDispatchBacklog(rctx))
+		MtmWaitPool(rctx);
+}
+
+/*
+ * Pass work to the pool. If the queue is full, stash it into the backlog and
+ * return to reading the socket; we stop doing that only when the backlog
+ * itself exceeds trans_spill_threshold.
+ */
+static void
+MtmDispatch(MtmReceiverContext *rctx, void *work, int size)
+{
+	BgwPool    *pool = BGW_POOL_BY_NODE_ID(rctx->w.sender_node_id);
+	long		limit = MtmTransSpillThreshold * 1024L;
+
+	if (MtmDispatchBacklog(rctx) &&
+		BgwPoolTryExecute(pool, work, size, &rctx->w))
+		return;
+
+	if ((long) (BACKLOG_PENDING(rctx) + sizeof(int) + size) > limit)
+	{
+		mtm_log(MtmApplyTrace, "dispatch backlog is full, waiting for pool workers");
+		MtmDrainBacklog(rctx);
+		if ((long) (sizeof(int) + size) > limit)
+		{
+			while (!BgwPoolTryExecute(pool, work, size, &rctx->w))
+				MtmWaitPool(rctx);
+			return;
+		}
+	}
+
+	/* reclaim space of already dispatched works */
+	if (rctx->backlog_head > rctx->backlog.used / 2)
+	{
+		memmove(rctx->backlog.data, rctx->backlog.data + rctx->backlog_head,
+				BACKLOG_PENDING(rctx));
+		rctx->backlog.used -= rctx->backlog_head;
+		rctx->backlog_head = 0;
+	}
+	ByteBufferAppendInt32(&rctx->backlog, size);
+	ByteBufferAppend(&rctx->backlog, work, size);
+}
+
+static void
+MtmExecute(void *work, int size, MtmReceiverContext *rctx, bool no_pool)
+{
+	if (rctx->w.mode == REPLMODE_RECOVERY || no_pool)
+	{
+		/* must not overtake what was queued before */
+		MtmDrainBacklog(rctx);
+		MtmExecutor(work, size, &rctx->w);
+	}
+	else
+		MtmDispatch(rctx, work, size);
 }
 
 /*
@@ -259,10 +463,12 @@ MtmExecute(void *work, int size, MtmReceiverWorkerContext *rwctx, bool no_pool)
  * It is more efficient to filter records at senders size (done by MtmReplicationTxnFilterHook) to avoid sending useless data through network.
  * But asynchronous nature of logical replications makes it not possible to guarantee (at least I failed to do it)
  * that replica do not receive deteriorated data.
+ * So we pass our filter to the sender at startup (see SenderFilterEncode), but
+ * still check everything here.
  */
 static bool
 MtmFilterTransaction(char *record, int size, Syncpoint *spvector,
-					 HTAB *filter_map, MtmReceiverContext *rctx)
+					 RecoveryFilter *filter_map, MtmReceiverContext *rctx)
 {
 	StringInfoData s;
 	XLogRecPtr	origin_lsn;
@@ -409,14 +615,9 @@ MtmFilterTransaction(char *record, int size, Syncpoint *spvector,
 	}
 	else
 	{
-		FilterEntry entry;
 		bool		found;
 
-		memset(&entry, '\0', sizeof(FilterEntry));
-		entry.node_id = origin_node;
-		entry.origin_lsn = tx_lsn;
-
-		hash_search(filter_map, &entry, HASH_FIND, &found);
+		found = RecoveryFilterContains(filter_map, origin_node, tx_lsn);
 
 		mtm_log(MtmReceiverFilter,
 				"filter (map) transaction gid=%s event=%x origin_node=%d origin_lsn=%X/%X sp.origin_lsn=%X/%X: found=%d",
@@ -430,6 +631,278 @@ MtmFilterTransaction(char *record, int size, Syncpoint *spvector,
 	}
 }
 
+/*
+ * Don't spill chunks smaller than that because of memory pressure from other
+ * receivers: small xacts would be spilled then on a busy node for nothing.
+ */
+#define MIN_PRESSURE_SPILL_SIZE (1024 * 1024)
+
+/*
+ * Publish how much changes we currently keep in memory (given size of xact
+ * buffers plus dispatch backlog), both in this receiver's slot and in the
+ * node-wide sum checked against multimaster.receivers_memory_limit.
+ */
+static void
+MtmReceiverAccountBuffered(MtmReceiverContext *rctx, uint64 used)
+{
+	used += BACKLOG_PENDING(rctx);
+	if (used == rctx->buffered)
+		return;
+
+	if (used > rctx->buffered)
+		pg_atomic_fetch_add_u64(&Mtm->receivers_buffered, used - rctx->buffered);
+	else
+		pg_atomic_fetch_sub_u64(&Mtm->receivers_buffered, rctx->buffered - used);
+	pg_atomic_write_u64(&Mtm->peers[rctx->w.sender_node_id - 1].receiver_buffered,
+						used);
+	rctx->buffered = used;
+}
+
+/*
+ * Should the xact buffer of given size be spilled to disk before appending
+ * msg_len more bytes to it? trans_spill_threshold is always a hard cap as
+ * apply workers queue is sized after it, but when the node-wide
+ * receivers_memory_limit is exhausted we spill earlier.
+ */
+static bool
+MtmReceiverShouldSpill(size_t used, int msg_len)
+{
+	if (used + msg_len + 1 >= MtmTransSpillThreshold * 1024L)
+		return true;
+
+	return MtmReceiversMemoryLimit > 0 &&
+		used >= MIN_PRESSURE_SPILL_SIZE &&
+		pg_atomic_read_u64(&Mtm->receivers_buffered) + msg_len >=
+		(uint64) MtmReceiversMemoryLimit * 1024;
+}
+
+/*
+ * Write out accumulated changes of streamed xact as a chunk of its spill file.
+ */
+static void
+MtmStreamFlush(MtmStreamedXact *sx, ByteBuffer *sbuf)
+{
+	if (sbuf->used == 0)
+		return;
+
+	ByteBufferAppend(sbuf, ")", 1);
+	pq_sendbyte(&sx->spill_info, '(');
+	pq_sendint(&sx->spill_info, sbuf->used, 4);
+	MtmSpillToFile(sx->file, sbuf->data, sbuf->used);
+	ByteBufferReset(sbuf);
+}
+
+/* Drop streamed xact, removing its spill file unless it was handed to apply */
+static void
+MtmStreamForget(MtmReceiverContext *rctx, MtmStreamedXact *sx)
+{
+	TransactionId xid = sx->xid;
+
+	if (sx->file != NULL)
+	{
+		MtmCloseSpillFile(sx->file);
+		MtmDeleteSpillFile(rctx->w.sender_node_id, sx->file_id);
+	}
+	pfree(sx->spill_info.data);
+	list_free_deep(sx->subxacts);
+	hash_search(rctx->streams, &xid, HASH_REMOVE, NULL);
+}
+
+/*
+ * Handle message related to streaming of in-progress xacts: either stream
+ * control message or change belonging to the current stream block.
+ *
+ * Streamed xact is spooled into spill file in exactly the same format as
+ * large non-streamed one, so on PREPARE apply gets usual 'F' and '('
+ * records and reads the xact body from disk.
+ */
+static void
+MtmHandleStreamed(MtmReceiverContext *rctx, char *stmt, int msg_len,
+				  Syncpoint *spvector, RecoveryFilter *filter_map)
+{
+	MtmStreamedXact *sx = rctx->cur_stream;
+	StringInfoData s;
+	TransactionId xid;
+	bool		found;
+
+	s.data = stmt;
+	s.len = msg_len;
+	s.maxlen = -1;
+	s.cursor = 1;
+
+	switch (stmt[0])
+	{
+		case 'S':				/* STREAM START */
+			{
+				bool		first_segment;
+				MemoryContext oldcontext;
+
+				xid = pq_getmsgint64(&s);
+				first_segment = pq_getmsgbyte(&s);
+				if (sx != NULL)
+					ereport(ERROR,
+							(MTM_ERRMSG("%s: stream of xid " XID_FMT " started inside stream of xid " XID_FMT,
+										MyBgworkerEntry->bgw_name, xid, sx->xid)));
+
+				sx = hash_search(rctx->streams, &xid, HASH_ENTER, &found);
+				if (first_segment)
+				{
+					if (found)
+						ereport(ERROR,
+								(MTM_ERRMSG("%s: streamed xact " XID_FMT " started twice",
+											MyBgworkerEntry->bgw_name, xid)));
+
+					oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+					initStringInfo(&sx->spill_info);
+					MemoryContextSwitchTo(oldcontext);
+					sx->subxacts = NIL;
+					sx->file = MtmCreateSpillFile(rctx->w.sender_node_id,
+												  &sx->file_id);
+					pq_sendbyte(&sx->spill_info, 'F');
+					pq_sendint(&sx->spill_info, rctx->w.sender_node_id, 4);
+					pq_sendint(&sx->spill_info, sx->file_id, 4);
+				}
+				else if (!found)
+				{
+					hash_search(rctx->streams, &xid, HASH_REMOVE, NULL);
+					ereport(ERROR,
+							(MTM_ERRMSG("%s: continuation of unknown streamed xact " XID_FMT,
+										MyBgworkerEntry->bgw_name, xid)));
+				}
+				mtm_log(MtmApplyTrace, "stream start xid=" XID_FMT " first_segment=%d",
+						xid, first_segment);
+				rctx->cur_stream = sx;
+				Assert(rctx->stream_buf.used == 0);
+				break;
+			}
+
+		case 'E':				/* STREAM STOP */
+			Assert(sx != NULL);
+			MtmStreamFlush(sx, &rctx->stream_buf);
+			rctx->cur_stream = NULL;
+			break;
+
+		case 'X':				/* subxact switch inside stream block */
+			{
+				TransactionId subxid = pq_getmsgint64(&s);
+				MtmStreamedSubxact *sub;
+				MemoryContext oldcontext;
+				ListCell   *lc;
+
+				Assert(sx != NULL);
+				if (subxid == sx->xid)
+					break;
+				foreach(lc, sx->subxacts)
+				{
+					if (((MtmStreamedSubxact *) lfirst(lc))->subxid == subxid)
+						return;
+				}
+
+				/* subxact starts at chunk boundary */
+				MtmStreamFlush(sx, &rctx->stream_buf);
+				oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+				sub = palloc(sizeof(MtmStreamedSubxact));
+				sub->subxid = subxid;
+				sub->offset = MtmSpillFileSize(sx->file);
+				sub->info_len = sx->spill_info.len;
+				sx->subxacts = lappend(sx->subxacts, sub);
+				MemoryContextSwitchTo(oldcontext);
+				break;
+			}
+
+		case 'A':				/* STREAM ABORT */
+			{
+				TransactionId subxid;
+
+				Assert(sx == NULL);
+				xid = pq_getmsgint64(&s);
+				subxid = pq_getmsgint64(&s);
+				sx = hash_search(rctx->streams, &xid, HASH_FIND, &found);
+				if (!found)
+				{
+					mtm_log(MtmApplyTrace, "stream abort of unknown xid=" XID_FMT, xid);
+					break;
+				}
+
+				if (subxid == xid)
+				{
+					mtm_log(MtmApplyTrace, "stream abort xid=" XID_FMT, xid);
+					MtmStreamForget(rctx, sx);
+				}
+				else
+				{
+					ListCell   *lc;
+					int			i = 0;
+					int			cut = -1;
+
+					/* throw away subxact changes and everything after them */
+					foreach(lc, sx->subxacts)
+					{
+						MtmStreamedSubxact *sub = (MtmStreamedSubxact *) lfirst(lc);
+
+						if (sub->subxid == subxid)
+						{
+							cut = i;
+							MtmTruncateSpillFile(sx->file, sub->offset);
+							sx->spill_info.len = sub->info_len;
+							sx->spill_info.data[sub->info_len] = '\0';
+						}
+						if (cut >= 0)
+							pfree(sub);
+						i++;
+					}
+					if (cut >= 0)
+						sx->subxacts = list_truncate(sx->subxacts, cut);
+					mtm_log(MtmApplyTrace, "stream abort xid=" XID_FMT " subxid=" XID_FMT " found=%d",
+							xid, subxid, cut >= 0);
+				}
+				break;
+			}
+
+		case 'P':				/* STREAM FINISH followed by PREPARE|COMMIT */
+			{
+				char	   *record;
+				int			record_len;
+
+				Assert(sx == NULL);
+				xid = pq_getmsgint64(&s);
+				record = stmt + s.cursor;
+				record_len = msg_len - s.cursor;
+				Assert(record[0] == 'C');
+
+				sx = hash_search(rctx->streams, &xid, HASH_FIND, &found);
+				if (!found)
+					ereport(ERROR,
+							(MTM_ERRMSG("%s: finish of unknown streamed xact " XID_FMT,
+										MyBgworkerEntry->bgw_name, xid)));
+
+				if (record[1] != PGLOGICAL_ABORT &&
+					!MtmFilterTransaction(record, record_len, spvector,
+										  filter_map, rctx))
+				{
+					Assert(rctx->stream_buf.used == 0);
+					ByteBufferAppend(&rctx->stream_buf, record, record_len);
+					MtmStreamFlush(sx, &rctx->stream_buf);
+					MtmCloseSpillFile(sx->file);
+					sx->file = NULL;	/* file is now owned by apply */
+					MtmExecute(sx->spill_info.data, sx->spill_info.len,
+							   rctx, record[1] == PGLOGICAL_COMMIT);
+				}
+				mtm_log(MtmApplyTrace, "stream finish xid=" XID_FMT " applied=%d",
+						xid, sx->file == NULL);
+				MtmStreamForget(rctx, sx);
+				break;
+			}
+
+		default:				/* change inside stream block */
+			Assert(sx != NULL);
+			if (MtmReceiverShouldSpill(rctx->stream_buf.used, msg_len))
+				MtmStreamFlush(sx, &rctx->stream_buf);
+			ByteBufferAppend(&rctx->stream_buf, stmt, msg_len);
+			break;
+	}
+}
+
 /*
  * Setup replication session origin to include origin location in WAL and
  * update slot position.
@@ -525,8 +998,14 @@ pglogical_receiver_at_exit(int status, Datum arg)
 	 */
 	BgwPoolCancel(&Mtm->pools[rctx->w.sender_node_id - 1]);
 
+	/* whatever we buffered is gone */
+	ByteBufferReset(&rctx->backlog);
+	rctx->backlog_head = 0;
+	MtmReceiverAccountBuffered(rctx, 0);
+
 	if (rctx->wrconn)
 		walrcv_disconnect(rctx->wrconn);
+	MtmCloseControlConnection(rctx);
 	if (MyReplicationSlot != NULL)
 		ReplicationSlotRelease();
 
@@ -561,7 +1040,7 @@ pglogical_receiver_main(Datum main_arg)
 
 	ByteBuffer	buf;
 
-	int			spill_file = -1;
+	MtmSpillFile *spill_file = NULL;
 	StringInfoData spill_info;
 	static PortalData fakePortal;
 
@@ -591,6 +1070,18 @@ pglogical_receiver_main(Datum main_arg)
 
 	initStringInfo(&spill_info);
 
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(TransactionId);
+		ctl.entrysize = sizeof(MtmStreamedXact);
+		rctx->streams = hash_create("MtmStreamedXacts", 16, &ctl,
+									HASH_ELEM | HASH_BLOBS);
+		ByteBufferAlloc(&rctx->stream_buf);
+		ByteBufferAlloc(&rctx->backlog);
+	}
+
 	/* Register functions for SIGTERM/SIGHUP management */
 	pqsignal(SIGHUP, SignalHandlerForConfigReload);
 	pqsignal(SIGTERM, die);
@@ -632,7 +1123,7 @@ pglogical_receiver_main(Datum main_arg)
 	{
 		XLogRecPtr	remote_start;
 		Syncpoint  *spvector = NULL;
-		HTAB	   *filter_map = NULL;
+		RecoveryFilter *filter_map = NULL;
 		nodemask_t	connected_mask;
 		char	   *err;
 		PGconn	   *conn;
@@ -678,13 +1169,18 @@ pglogical_receiver_main(Datum main_arg)
 			 */
 			MtmMaybeAdvanceSlot(rctx, conninfo);
 
+			/* wake up periodically as horizon moves without notice */
 			rc = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_EXIT_ON_PM_DEATH,
-						   0, PG_WAIT_EXTENSION);
+						   WL_LATCH_SET | WL_EXIT_ON_PM_DEATH |
+						   (wal_receiver_status_interval > 0 ? WL_TIMEOUT : 0),
+						   wal_receiver_status_interval * 1000L,
+						   PG_WAIT_EXTENSION);
 
 			if (rc & WL_LATCH_SET)
 				ResetLatch(MyLatch);
 		}
+		/* we'll advance the slot through streaming feedback from now on */
+		MtmCloseControlConnection(rctx);
 		mtm_log(MtmReceiverState, "registered as running in %s mode",
 				MtmReplicationModeMnem[rctx->w.mode]);
 
@@ -831,12 +1327,20 @@ pglogical_receiver_main(Datum main_arg)
 						  "\"min_proto_version\" '1',"
 						  "\"forward_changesets\" '1',"
 						  "\"binary.want_binary_basetypes\" '%d',"
-						  "\"mtm_replication_mode\" '%s')",
+						  "\"mtm_replication_mode\" '%s',"
+						  "\"mtm_streaming\" '%d',"
+						  "\"mtm_filter\" '%s')",
 						  psprintf(MULTIMASTER_SLOT_PATTERN, receiver_mtm_cfg->my_node_id),
 						  (uint32) (remote_start >> 32),
 						  (uint32) remote_start,
 						  MtmBinaryBasetypes,
-						  MtmReplicationModeMnem[rctx->w.mode]
+						  MtmReplicationModeMnem[rctx->w.mode],
+						  MtmStreamInProgress,
+						  /*
+						   * let sender skip xacts we already have, we'd
+						   * throw them away in MtmFilterTransaction anyway
+						   */
+						  SenderFilterEncode(filter_map, spvector)
 			);
 		conn = ((MyWalReceiverConn *) rctx->wrconn)->streamConn;
 		res = PQexec(conn, query->data);
@@ -859,6 +1363,14 @@ pglogical_receiver_main(Datum main_arg)
 
 			sendFeedback(rctx, false);
 
+			/* give pool workers whatever they could take by now */
+			if (BACKLOG_PENDING(rctx) > 0)
+			{
+				MtmDispatchBacklog(rctx);
+				MtmReceiverAccountBuffered(rctx,
+										   buf.used + rctx->stream_buf.used);
+			}
+
 			if (ConfigReloadPending)
 			{
 				ConfigReloadPending = false;
@@ -993,7 +1505,7 @@ pglogical_receiver_main(Datum main_arg)
 							 * non-tx DDL should be executed by parallel
 							 * workers
 							 */
-							MtmExecute(stmt, msg_len, &rctx->w, false);
+							MtmExecute(stmt, msg_len, rctx, false);
 						}
 						else
 						{
@@ -1001,14 +1513,28 @@ pglogical_receiver_main(Datum main_arg)
 							 * all other messages should be processed by
 							 * receiver itself
 							 */
-							MtmExecute(stmt, msg_len, &rctx->w, true);
+							MtmExecute(stmt, msg_len, rctx, true);
 						}
 						continue;
 					}
 
-					if (buf.used + msg_len + 1 >= MtmTransSpillThreshold * 1024L)
+					/*
+					 * Streamed in-progress xacts are spooled separately, see
+					 * MtmHandleStreamed.
+					 */
+					if (rctx->cur_stream != NULL || stmt[0] == 'S' ||
+						stmt[0] == 'A' || stmt[0] == 'P')
+					{
+						MtmHandleStreamed(rctx, stmt, msg_len,
+										  spvector, filter_map);
+						MtmReceiverAccountBuffered(rctx,
+												   buf.used + rctx->stream_buf.used);
+						continue;
+					}
+
+					if (MtmReceiverShouldSpill(buf.used, msg_len))
 					{
-						if (spill_file < 0)
+						if (spill_file == NULL)
 						{
 							int			file_id;
 
@@ -1037,7 +1563,7 @@ pglogical_receiver_main(Datum main_arg)
 							 !MtmFilterTransaction(stmt, msg_len, spvector,
 												   filter_map, rctx)))
 						{
-							if (spill_file >= 0)
+							if (spill_file != NULL)
 							{
 								ByteBufferAppend(&buf, ")", 1);
 								pq_sendbyte(&spill_info, '(');
@@ -1045,12 +1571,12 @@ pglogical_receiver_main(Datum main_arg)
 								MtmSpillToFile(spill_file, buf.data, buf.used);
 								MtmCloseSpillFile(spill_file);
 								MtmExecute(spill_info.data, spill_info.len,
-										   &rctx->w, false);
-								spill_file = -1;
+										   rctx, false);
+								spill_file = NULL;
 								resetStringInfo(&spill_info);
 							}
 							else
-								MtmExecute(buf.data, buf.used, &rctx->w,
+								MtmExecute(buf.data, buf.used, rctx,
 										   /*
 											* Force bdr-like transactions
 											* ending with plain commit to
@@ -1059,14 +1585,16 @@ pglogical_receiver_main(Datum main_arg)
 											*/
 										   stmt[1] == PGLOGICAL_COMMIT);
 						}
-						else if (spill_file >= 0)
+						else if (spill_file != NULL)
 						{
 							MtmCloseSpillFile(spill_file);
 							resetStringInfo(&spill_info);
-							spill_file = -1;
+							spill_file = NULL;
 						}
 						ByteBufferReset(&buf);
 					}
+					MtmReceiverAccountBuffered(rctx,
+											   buf.used + rctx->stream_buf.used);
 				}
 			}
 
@@ -1082,6 +1610,8 @@ pglogical_receiver_main(Datum main_arg)
 								   WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
 								   fd,
 								   wait_time, PG_WAIT_EXTENSION);
+			/* pool overflow wakeup, see BgwPoolTryExecute */
+			ConditionVariableCancelSleep();
 
 			if (rc & WL_LATCH_SET)
 			{
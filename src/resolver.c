@@ -83,7 +83,7 @@ static void
 ResolveForRefereeWinner(void)
 {
 	MtmGeneration curr_gen;
-	HASH_SEQ_STATUS hash_seq;
+	GlobalTxScan scan;
 	GlobalTx   *gtx;
 	/*
 	 * Calling FinishPreparedTransaction under lwlock is probably not a good
@@ -116,9 +116,9 @@ ResolveForRefereeWinner(void)
 	mtm_log(ResolverState, "resolving as referee winner");
 	gids = palloc(sizeof(pgid_t) * max_prepared_xacts);
 
-	LWLockAcquire(gtx_shared->lock, LW_SHARED);
-	hash_seq_init(&hash_seq, gtx_shared->gid2gtx);
-	while ((gtx = hash_seq_search(&hash_seq)) != NULL)
+	GlobalTxLockAll(LW_SHARED);
+	GlobalTxScanInit(&scan);
+	while ((gtx = GlobalTxScanNext(&scan)) != NULL)
 	{
 		/* skip not orphaned xacts, will pick them up next time */
 		if (!gtx->orphaned)
@@ -128,7 +128,7 @@ ResolveForRefereeWinner(void)
 		strcpy(gids[n_gids], gtx->gid);
 		n_gids++;
 	}
-	LWLockRelease(gtx_shared->lock);
+	GlobalTxUnlockAll();
 
 	for (i = 0; i < n_gids; i++)
 	{
@@ -172,7 +172,7 @@ static bool
 finish_ready(void)
 {
 	bool job_pending = false;
-	HASH_SEQ_STATUS hash_seq;
+	GlobalTxScan scan;
 	GlobalTx   *gtx;
 	/*
 	 * Calling FinishPreparedTransaction under lwlock is probably not a good
@@ -183,9 +183,9 @@ finish_ready(void)
 	int n_agids = 0;
 	int i;
 
-	LWLockAcquire(gtx_shared->lock, LW_SHARED);
-	hash_seq_init(&hash_seq, gtx_shared->gid2gtx);
-	while ((gtx = hash_seq_search(&hash_seq)) != NULL)
+	GlobalTxLockAll(LW_SHARED);
+	GlobalTxScanInit(&scan);
+	while ((gtx = GlobalTxScanNext(&scan)) != NULL)
 	{
 		/*
 		 * don't intervene if backend is still working on xact or it is not
@@ -221,7 +221,7 @@ finish_ready(void)
 		/* so we have orphaned xact needing resolution */
 		job_pending = true;
 	}
-	LWLockRelease(gtx_shared->lock);
+	GlobalTxUnlockAll();
 
 	/* finish ready xacts */
 	for (i = 0; i < n_agids; i++)
@@ -265,7 +265,7 @@ scatter(MtmConfig *mtm_cfg, nodemask_t cmask, char *stream_name, StringInfo msg)
 		 */
 		Assert(dest_id >= 0);
 
-		dmq_push_buffer(dest_id, stream_name, msg->data, msg->len);
+		dmq_push_request(dest_id, stream_name, msg->data, msg->len);
 	}
 }
 
@@ -276,7 +276,7 @@ scatter(MtmConfig *mtm_cfg, nodemask_t cmask, char *stream_name, StringInfo msg)
 static void
 scatter_status_requests(MtmConfig *mtm_cfg)
 {
-	HASH_SEQ_STATUS hash_seq;
+	GlobalTxScan scan;
 	GlobalTx   *gtx;
 	GlobalTxTerm new_term;
 
@@ -312,9 +312,9 @@ scatter_status_requests(MtmConfig *mtm_cfg)
 	 * Stamp all orphaned transactions with the new proposal and send status
 	 * requests.
 	 */
-	LWLockAcquire(gtx_shared->lock, LW_EXCLUSIVE);
-	hash_seq_init(&hash_seq, gtx_shared->gid2gtx);
-	while ((gtx = hash_seq_search(&hash_seq)) != NULL)
+	GlobalTxLockAll(LW_EXCLUSIVE);
+	GlobalTxScanInit(&scan);
+	while ((gtx = GlobalTxScanNext(&scan)) != NULL)
 	{
 		/* skip acquired until next round */
 		if (gtx->orphaned && gtx->acquired_by == InvalidBackendId &&
@@ -372,7 +372,7 @@ scatter_status_requests(MtmConfig *mtm_cfg)
 					MtmMessagePack((MtmMessage *) &status_msg));
 		}
 	}
-	LWLockRelease(gtx_shared->lock);
+	GlobalTxUnlockAll();
 }
 
 static void
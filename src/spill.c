@@ -1,6 +1,13 @@
 /*-----------------------------------------------------------------------------
  * spill.c
  *
+ * Spill files of large transactions. File is a sequence of chunks, each
+ * prefixed with MtmSpillChunkHeader and optionally LZ4 compressed. Writes go
+ * through a large buffer so that small chunks of streamed xacts don't cost a
+ * syscall each; on replay the kernel is asked to read ahead the next chunk
+ * while the current one is being applied. Large files are mmap'ed for replay,
+ * so uncompressed chunks are parsed right from the page cache without copying.
+ *
  * Copyright (c) 2017-2020, Postgres Professional
  *
  *-----------------------------------------------------------------------------
@@ -8,25 +15,49 @@
 #include "postgres.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 #include "storage/fd.h"
+#include "utils/memutils.h"
 #include "spill.h"
 #include "pgstat.h"
 
 #include "multimaster.h"
 #include "logger.h"
 
-void
-MtmSpillToFile(int fd, char const *data, size_t size)
+typedef struct MtmSpillChunkHeader
+{
+	uint32		raw_size;
+	uint32		disk_size;		/* < raw_size if compressed */
+} MtmSpillChunkHeader;
+
+#define MTM_SPILL_BUFFER_SIZE (1024 * 1024)
+
+/* don't bother compressing tiny chunks */
+#define MTM_SPILL_COMPRESS_MIN 1024
+
+/* replay files of at least this size through mmap */
+#define MTM_SPILL_MMAP_MIN (16 * MTM_SPILL_BUFFER_SIZE)
+
+bool		MtmSpillCompression;
+
+static void spill_map(MtmSpillFile *sf);
+
+static void
+spill_write_all(MtmSpillFile *sf, char const *data, size_t size)
 {
-	Assert(fd >= 0);
+	Assert(sf->fd >= 0);
 	while (size != 0)
 	{
-		int			written = write(fd, data, size);
+		int			written = write(sf->fd, data, size);
 
 		if (written <= 0)
 		{
-			close(fd);
+			close(sf->fd);
 			ereport(ERROR,
 					(errcode_for_file_access(),
 					 MTM_ERRMSG("pglogical_recevier failed to spill transaction to file: %m")));
@@ -36,6 +67,79 @@ MtmSpillToFile(int fd, char const *data, size_t size)
 	}
 }
 
+static void
+spill_flush(MtmSpillFile *sf)
+{
+	if (sf->buf_used == 0)
+		return;
+	spill_write_all(sf, sf->buf, sf->buf_used);
+	sf->buf_used = 0;
+}
+
+static void
+spill_write(MtmSpillFile *sf, char const *data, size_t size)
+{
+	sf->size += size;
+	if (sf->buf_used + size > MTM_SPILL_BUFFER_SIZE)
+	{
+		spill_flush(sf);
+		/* large chunks go directly, no point in copying them */
+		if (size >= MTM_SPILL_BUFFER_SIZE)
+		{
+			spill_write_all(sf, data, size);
+			return;
+		}
+	}
+	memcpy(sf->buf + sf->buf_used, data, size);
+	sf->buf_used += size;
+}
+
+static char *
+spill_buffer(char **buf, size_t *buf_size, size_t size)
+{
+	if (*buf_size < size)
+	{
+		if (*buf != NULL)
+			pfree(*buf);
+		*buf = MemoryContextAllocHuge(TopMemoryContext, size);
+		*buf_size = size;
+	}
+	return *buf;
+}
+
+/*
+ * Append chunk to the spill file. Apply will get it back with
+ * MtmReadSpillFile of the same size.
+ */
+void
+MtmSpillToFile(MtmSpillFile *sf, char const *data, size_t size)
+{
+	MtmSpillChunkHeader hdr;
+
+	Assert(!sf->reading && size <= PG_UINT32_MAX);
+	hdr.raw_size = size;
+	hdr.disk_size = size;
+
+#ifdef USE_LZ4
+	if (MtmSpillCompression && size >= MTM_SPILL_COMPRESS_MIN)
+	{
+		int			bound = LZ4_compressBound(size);
+		int			compressed;
+
+		spill_buffer(&sf->cbuf, &sf->cbuf_size, bound);
+		compressed = LZ4_compress_default(data, sf->cbuf, size, bound);
+		if (compressed > 0 && (size_t) compressed < size)
+		{
+			hdr.disk_size = compressed;
+			data = sf->cbuf;
+		}
+	}
+#endif
+
+	spill_write(sf, (char *) &hdr, sizeof(hdr));
+	spill_write(sf, data, hdr.disk_size);
+}
+
 void
 MtmCreateSpillDirectory(int node_id)
 {
@@ -73,11 +177,12 @@ MtmCreateSpillDirectory(int node_id)
 }
 
 
-int
+MtmSpillFile *
 MtmCreateSpillFile(int node_id, int *file_id)
 {
 	static int	spill_file_id;
 	char		path[MAXPGPATH];
+	MtmSpillFile *sf;
 	int			fd;
 
 	sprintf(path, "pg_mtm/%d/txn-%d.snap",
@@ -92,13 +197,20 @@ MtmCreateSpillFile(int node_id, int *file_id)
 							path)));
 	}
 	*file_id = spill_file_id;
-	return fd;
+
+	sf = MemoryContextAllocZero(TopMemoryContext, sizeof(MtmSpillFile));
+	sf->fd = fd;
+	sf->buf_alloc = MemoryContextAlloc(TopMemoryContext,
+									   MTM_SPILL_BUFFER_SIZE + BLCKSZ);
+	sf->buf = (char *) TYPEALIGN(BLCKSZ, sf->buf_alloc);
+	return sf;
 }
 
-int
+MtmSpillFile *
 MtmOpenSpillFile(int node_id, int file_id)
 {
 	static char path[MAXPGPATH];
+	MtmSpillFile *sf;
 	int			fd;
 
 	sprintf(path, "pg_mtm/%d/txn-%d.snap",
@@ -118,20 +230,107 @@ MtmOpenSpillFile(int node_id, int file_id)
 				(errcode_for_file_access(),
 				 MTM_ERRMSG("pglogical_apply failed to unlink spill file: %m")));
 	}
-	return fd;
+#ifdef USE_POSIX_FADVISE
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	sf = MemoryContextAllocZero(TopMemoryContext, sizeof(MtmSpillFile));
+	sf->fd = fd;
+	sf->reading = true;
+	spill_map(sf);
+	return sf;
 }
 
-void
-MtmReadSpillFile(int fd, char *data, size_t size)
+/*
+ * Try to map the whole file being replayed. The file is already unlinked and
+ * nobody else has it open, so it can't be truncated under us (and SIGBUS us).
+ * If mapping fails, e.g. we are short of address space, just fall back to
+ * read().
+ */
+static void
+spill_map(MtmSpillFile *sf)
+{
+	struct stat st;
+	void	   *map;
+
+	if (fstat(sf->fd, &st) < 0 || st.st_size < MTM_SPILL_MMAP_MIN ||
+		(uint64) st.st_size > (uint64) SIZE_MAX)
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sf->fd, 0);
+	if (map == MAP_FAILED)
+	{
+		mtm_log(LOG, "failed to mmap spill file of size " INT64_FORMAT ", falling back to read: %m",
+				(int64) st.st_size);
+		return;
+	}
+	(void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+	sf->map = map;
+	sf->map_size = st.st_size;
+}
+
+/*
+ * Release the file before erroring out on it; MtmCloseSpillFile called later
+ * on the error path then just frees the buffers.
+ */
+static void
+spill_close_on_error(MtmSpillFile *sf)
+{
+	if (sf->map != NULL)
+		(void) munmap(sf->map, sf->map_size);
+	sf->map = NULL;
+	if (sf->fd >= 0)
+		CloseTransientFile(sf->fd);
+	sf->fd = -1;
+}
+
+/*
+ * Get data of given size at the current position of the mapped file.
+ */
+static char *
+spill_map_read(MtmSpillFile *sf, size_t size)
 {
-	Assert(fd >= 0);
+	char	   *data;
+
+	if ((size_t) sf->size + size > sf->map_size)
+	{
+		spill_close_on_error(sf);
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 MTM_ERRMSG("pglogical_apply got chunk crossing the end of spill file")));
+	}
+	data = sf->map + sf->size;
+	sf->size += size;
+	return data;
+}
+
+/*
+ * Previous chunk is fully applied; let the kernel reclaim its pages right
+ * away instead of letting mapping of multi-gigabyte xact pile up in our RSS
+ * and push out more useful pages.
+ */
+static void
+spill_map_release(MtmSpillFile *sf, off_t upto)
+{
+	off_t		start = TYPEALIGN(BLCKSZ, sf->map_released);
+	off_t		end = TYPEALIGN_DOWN(BLCKSZ, upto);
+
+	if (end > start)
+		(void) madvise(sf->map + start, end - start, MADV_DONTNEED);
+	sf->map_released = upto;
+}
+
+static void
+spill_read_all(MtmSpillFile *sf, char *data, size_t size)
+{
+	Assert(sf->fd >= 0);
 	while (size != 0)
 	{
-		int			rc = read(fd, data, size);
+		int			rc = read(sf->fd, data, size);
 
 		if (rc <= 0)
 		{
-			CloseTransientFile(fd);
+			spill_close_on_error(sf);
 			ereport(ERROR,
 					(errcode_for_file_access(),
 					 MTM_ERRMSG("pglogical_apply failed to read spill file: %m")));
@@ -141,11 +340,196 @@ MtmReadSpillFile(int fd, char *data, size_t size)
 	}
 }
 
-void
-MtmCloseSpillFile(int fd)
+/*
+ * MtmReadSpillFile for the mapped file: uncompressed chunk is returned as is,
+ * compressed one is decompressed straight from the mapping.
+ */
+static char *
+spill_map_chunk(MtmSpillFile *sf, size_t size)
+{
+	MtmSpillChunkHeader hdr;
+	char	   *data;
+
+	spill_map_release(sf, sf->size);
+
+	memcpy(&hdr, spill_map_read(sf, sizeof(hdr)), sizeof(hdr));
+	if (hdr.raw_size != size || hdr.disk_size > hdr.raw_size)
+	{
+		spill_close_on_error(sf);
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 MTM_ERRMSG("pglogical_apply got unexpected chunk of size %u (%u on disk) in spill file, expected %zu",
+							hdr.raw_size, hdr.disk_size, size)));
+	}
+	data = spill_map_read(sf, hdr.disk_size);
+	if (hdr.disk_size == hdr.raw_size)
+		return data;
+
+#ifdef USE_LZ4
+	{
+		char	   *chunk = spill_buffer(&sf->chunk, &sf->chunk_size, size);
+
+		if (LZ4_decompress_safe(data, chunk, hdr.disk_size, size) != (int) size)
+		{
+			spill_close_on_error(sf);
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 MTM_ERRMSG("pglogical_apply failed to decompress spill file chunk")));
+		}
+		return chunk;
+	}
+#else
+	spill_close_on_error(sf);
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 MTM_ERRMSG("spill file is LZ4 compressed, but multimaster is built without LZ4 support")));
+	return NULL;				/* keep compiler quiet */
+#endif
+}
+
+/*
+ * Read next chunk of given size. Returned buffer is valid until the next
+ * call or MtmCloseSpillFile.
+ */
+char *
+MtmReadSpillFile(MtmSpillFile *sf, size_t size)
 {
-	if (close(fd) < 0)
+	MtmSpillChunkHeader hdr;
+	char	   *chunk;
+
+	Assert(sf->reading);
+	if (sf->map != NULL)
+		return spill_map_chunk(sf, size);
+
+	spill_read_all(sf, (char *) &hdr, sizeof(hdr));
+	if (hdr.raw_size != size || hdr.disk_size > hdr.raw_size)
+	{
+		spill_close_on_error(sf);
 		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 MTM_ERRMSG("pglogical_apply got unexpected chunk of size %u (%u on disk) in spill file, expected %zu",
+							hdr.raw_size, hdr.disk_size, size)));
+	}
+	sf->size += sizeof(hdr) + hdr.disk_size;
+
+	chunk = spill_buffer(&sf->chunk, &sf->chunk_size, size);
+	if (hdr.disk_size == hdr.raw_size)
+		spill_read_all(sf, chunk, size);
+	else
+	{
+#ifdef USE_LZ4
+		char	   *cbuf = spill_buffer(&sf->cbuf, &sf->cbuf_size, hdr.disk_size);
+
+		spill_read_all(sf, cbuf, hdr.disk_size);
+		if (LZ4_decompress_safe(cbuf, chunk, hdr.disk_size, size) != (int) size)
+		{
+			spill_close_on_error(sf);
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 MTM_ERRMSG("pglogical_apply failed to decompress spill file chunk")));
+		}
+#else
+		spill_close_on_error(sf);
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 MTM_ERRMSG("spill file is LZ4 compressed, but multimaster is built without LZ4 support")));
+#endif
+	}
+
+	/*
+	 * Chunks are mostly of the same size, ask kernel to fetch the next one
+	 * while we are applying this.
+	 */
+#ifdef USE_POSIX_FADVISE
+	(void) posix_fadvise(sf->fd, sf->size, sizeof(hdr) + hdr.disk_size,
+						 POSIX_FADV_WILLNEED);
+#endif
+
+	return chunk;
+}
+
+/* Size of the file including not yet flushed part */
+off_t
+MtmSpillFileSize(MtmSpillFile *sf)
+{
+	return sf->size;
+}
+
+/*
+ * Cut spill file being written to the given size. Used to discard changes of
+ * aborted subxact of streamed xact.
+ */
+void
+MtmTruncateSpillFile(MtmSpillFile *sf, off_t size)
+{
+	off_t		flushed = sf->size - sf->buf_used;
+
+	Assert(!sf->reading && size <= sf->size);
+	if (size >= flushed)
+		sf->buf_used = size - flushed;
+	else
+	{
+		sf->buf_used = 0;
+		if (ftruncate(sf->fd, size) < 0)
+		{
+			close(sf->fd);
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 MTM_ERRMSG("pglogical_receiver failed to truncate spill file: %m")));
+		}
+	}
+	sf->size = size;
+}
+
+/*
+ * Remove spill file which won't be applied, e.g. of aborted streamed xact.
+ */
+void
+MtmDeleteSpillFile(int node_id, int file_id)
+{
+	char		path[MAXPGPATH];
+
+	sprintf(path, "pg_mtm/%d/txn-%d.snap",
+			node_id, file_id);
+	if (unlink(path) < 0)
+		ereport(LOG,
 				(errcode_for_file_access(),
-				 MTM_ERRMSG("pglogical_recevier failed to close spill file: %m")));
+				 MTM_ERRMSG("pglogical_receiver failed to unlink spill file \"%s\": %m",
+							path)));
+}
+
+/*
+ * Close spill file, writing out what's left in the buffer.
+ */
+void
+MtmCloseSpillFile(MtmSpillFile *sf)
+{
+	/* fd is already closed if spill_close_on_error was here */
+	if (sf->reading)
+	{
+		if (sf->map != NULL && munmap(sf->map, sf->map_size) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 MTM_ERRMSG("pglogical_apply failed to unmap spill file: %m")));
+		if (sf->fd >= 0 && CloseTransientFile(sf->fd) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 MTM_ERRMSG("pglogical_apply failed to close spill file: %m")));
+	}
+	else if (sf->fd >= 0)
+	{
+		spill_flush(sf);
+		if (close(sf->fd) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 MTM_ERRMSG("pglogical_recevier failed to close spill file: %m")));
+	}
+
+	if (sf->buf_alloc != NULL)
+		pfree(sf->buf_alloc);
+	if (sf->chunk != NULL)
+		pfree(sf->chunk);
+	if (sf->cbuf != NULL)
+		pfree(sf->cbuf);
+	pfree(sf);
 }
@@ -520,9 +520,10 @@ MtmConsiderGenSwitch(MtmGeneration gen, nodemask_t donors)
 	mtm_state->donors = donors;
 
 	/*
-	 * xxx SetLatch of all backends here? Waiting for acks after gen switch
-	 * might be hopeless. Currently backends check for it after timeout...
+	 * Waiting for acks after gen switch might be hopeless; wake up backends
+	 * in gather() so they notice the switch immediately.
 	 */
+	dmq_wake_subscribers();
 
 	/* Probably we are not member of this generation... */
 	if (!BIT_CHECK(gen.members, Mtm->my_node_id - 1) ||
@@ -923,7 +924,7 @@ scatter(MtmConfig *mtm_cfg, nodemask_t cmask, char *stream_name, StringInfo msg)
 		LWLockRelease(Mtm->lock);
 
 		if (dest_id >= 0 && BIT_CHECK(cmask, node_id - 1))
-			dmq_push_buffer(dest_id, stream_name, msg->data, msg->len);
+			dmq_push_request(dest_id, stream_name, msg->data, msg->len);
 	}
 }
 
@@ -1357,7 +1358,6 @@ static void
 CampaignTour(MtmConfig *mtm_cfg,
 			 MtmGeneration candidate_gen, nodemask_t cohort, uint64 my_last_online_in)
 {
-	int		   sconn_cnt[DMQ_N_MASK_POS];
 	int nvotes;
 	MtmGenVoteRequest request_msg;
 	MtmGenVoteResponse *messages[MTM_MAX_NODES];
@@ -1374,7 +1374,6 @@ CampaignTour(MtmConfig *mtm_cfg,
 	 * now before we send the request
 	 */
 	dmq_reattach_receivers();
-	dmq_get_sendconn_cnt(cohort, sconn_cnt);
 
 	request_msg.tag = T_MtmGenVoteRequest;
 	request_msg.gen = candidate_gen;
@@ -1383,7 +1382,7 @@ CampaignTour(MtmConfig *mtm_cfg,
 
 	gather(cohort, (MtmMessage **) messages, senders, &n_messages,
 		   CampaignerGatherHook, UInt64GetDatum(candidate_gen.num),
-		   sconn_cnt, MtmInvalidGenNum);
+		   MtmInvalidGenNum);
 	nvotes = 1; /* myself already voted */
 	/*
 	 * When node votes for generation n, it promises never become online in
@@ -3463,7 +3462,7 @@ ReplierMain(Datum main_arg)
 								  mtm_pubsub_change_cb,
 								  (Datum) 0);
 
-	dmq_stream_subscribe("reqresp");
+	dmq_stream_subscribe_requests("reqresp");
 	/* now that we are subscribed allow to start dmq receivers */
 	Mtm->replier_loaded = true;
 
@@ -3881,6 +3880,9 @@ stop_node_workers(int node_id, MtmConfig *new_cfg, Datum arg)
 	/* delete replication origin, was acquired by receiver */
 	replorigin_drop(replorigin_by_name(logical_slot, false), true);
 
+	/* its persisted recovery filter is of no use either */
+	RecoveryFilterDrop(node_id);
+
 	/*
 	 * Delete logical slot. It is aquired by walsender, so call with nowait =
 	 * false and wait for walsender exit.
@@ -4202,6 +4204,9 @@ MtmMonitor(Datum arg)
 			}
 		}
 
+		/* catch up persisted recovery filters with registered syncpoints */
+		RecoveryFilterCheckpointPending(mtm_cfg);
+
 		rc = WaitLatch(MyLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
 					   wait_time, PG_WAIT_EXTENSION);
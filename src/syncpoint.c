@@ -24,20 +24,38 @@
  */
 #include "postgres.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "access/twophase.h"
 #include "access/xlog.h"
 #include "access/xlogutils.h"
 #include "access/xlogreader.h"
 #include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "portability/instr_time.h"
 #include "replication/origin.h"
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/pg_crc32c.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "tcop/tcopprot.h"
+#include "utils/resowner.h"
 #include "replication/slot.h"
 #include "replication/message.h"
 #include "access/xlog_internal.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
 
 #include "libpq-fe.h"
 
@@ -46,28 +64,12 @@
 #include "logger.h"
 
 int			MtmSyncpointInterval;  /* in kilobytes */
+int			MtmRecoveryFilterScanWorkers;
 
 PG_FUNCTION_INFO_V1(update_recovery_horizons);
+PG_FUNCTION_INFO_V1(mtm_recovery_filter_bench);
 
-/* XXX: change to some receiver-local structures */
-static int
-origin_id_to_node_id(RepOriginId origin_id, MtmConfig *mtm_cfg)
-{
-	int			i;
-
-	for (i = 0; i < mtm_cfg->n_nodes; i++)
-	{
-		if (mtm_cfg->nodes[i].origin_id == origin_id)
-			return mtm_cfg->nodes[i].node_id;
-	}
-
-	/*
-	 * Could happen if node was dropped. Might lead to skipping dropped node
-	 * xacts on some lagged node, but who ever said we support membership
-	 * changes under load?
-	 */
-	return -1;
-}
+void		RecoveryFilterScanWorkerMain(Datum main_arg);
 
 
 /*
@@ -462,49 +464,274 @@ update_recovery_horizons(PG_FUNCTION_ARGS)
 }
 
 /*
- * Load filter
+ * Recovery filter of one origin persisted in pg_mtm/filter-<node_id>: all
+ * xacts of the origin with origin_lsn > base_origin_lsn whose records start
+ * in local WAL within [start_lsn, end_lsn). Receiver start then needs to scan
+ * only WAL after end_lsn instead of everything since the oldest syncpoint.
+ *
+ * Any complete scan produces a valid file, so we don't bother with locking:
+ * writers use private tmp files and whoever renames last wins.
  */
-HTAB *
-RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
+typedef struct RecoveryFilterOnDisk
 {
-	XLogReaderState *xlogreader;
-	HASHCTL		hash_ctl;
-	HTAB	   *filter_map;
-	int			estimate_size;
-	XLogRecPtr	start_lsn = PG_UINT64_MAX;
-	XLogRecPtr	current_last_lsn;
-	int			i;
+	pg_crc32c	checksum;		/* of everything below and the lsns */
+	uint32		magic;
+	uint32		version;
+	int32		node_id;
+	RepOriginId origin_id;
+	XLogRecPtr	base_origin_lsn;
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	end_lsn;
+	uint64		n_lsns;
+	/* followed by n_lsns sorted origin lsns */
+} RecoveryFilterOnDisk;
+
+#define RecoveryFilterOnDiskNotChecksummedSize \
+	offsetof(RecoveryFilterOnDisk, magic)
+
+/* milliseconds between checkpoints of persisted filters */
+#define RECOVERY_FILTER_CHECKPOINT_INTERVAL 10000
+
+#define RECOVERY_FILTER_MAGIC 0x7E1F4C3B
+#define RECOVERY_FILTER_VERSION 1
 
-	/* ensure we will scan everything written up to this point, just in case */
-	XLogFlush(GetXLogWriteRecPtr());
-	current_last_lsn = GetFlushRecPtr();
+/*
+ * Add to filter persisted xacts of node_id with origin_lsn > base_origin_lsn
+ * if the file covers WAL from start_lsn. Returns the end of file's range,
+ * i.e. position from which WAL still must be scanned, or InvalidXLogRecPtr
+ * if file is absent or unusable. *file_start_lsn is set to the beginning of
+ * file's range.
+ */
+static XLogRecPtr
+RecoveryFilterRestore(RecoveryFilter *filter, int node_id, RepOriginId origin_id,
+					  XLogRecPtr base_origin_lsn, XLogRecPtr start_lsn,
+					  XLogRecPtr *file_start_lsn)
+{
+	RecoveryFilterOnDisk ondisk;
+	char		path[MAXPGPATH];
+	XLogRecPtr *lsns = NULL;
+	Size		lsns_size;
+	pg_crc32c	checksum;
+	int			fd;
+	uint64		i;
+
+	sprintf(path, "pg_mtm/filter-%d", node_id);
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 MTM_ERRMSG("could not open recovery filter file \"%s\": %m",
+								path)));
+		return InvalidXLogRecPtr;
+	}
 
-	Assert(current_last_lsn != InvalidXLogRecPtr);
+	if (read(fd, &ondisk, sizeof(ondisk)) != sizeof(ondisk) ||
+		ondisk.magic != RECOVERY_FILTER_MAGIC ||
+		ondisk.version != RECOVERY_FILTER_VERSION ||
+		ondisk.n_lsns > MaxAllocHugeSize / sizeof(XLogRecPtr))
+		goto unusable;
 
-	/* start from minimal among all of syncpoints */
-	for (i = 0; i < MTM_MAX_NODES; i++)
+	/*
+	 * Origin was recreated or file came with basebackup of another node,
+	 * range doesn't match the syncpoints we filter from.
+	 */
+	if (ondisk.node_id != node_id || ondisk.origin_id != origin_id ||
+		ondisk.base_origin_lsn > base_origin_lsn ||
+		ondisk.start_lsn > start_lsn ||
+		ondisk.end_lsn > GetFlushRecPtr())
+		goto unusable;
+
+	lsns_size = ondisk.n_lsns * sizeof(XLogRecPtr);
+	lsns = palloc_extended(lsns_size, MCXT_ALLOC_HUGE);
+	if (read(fd, lsns, lsns_size) != (ssize_t) lsns_size)
+		goto unusable;
+
+	INIT_CRC32C(checksum);
+	COMP_CRC32C(checksum,
+				((char *) &ondisk) + RecoveryFilterOnDiskNotChecksummedSize,
+				sizeof(ondisk) - RecoveryFilterOnDiskNotChecksummedSize);
+	COMP_CRC32C(checksum, lsns, lsns_size);
+	FIN_CRC32C(checksum);
+	if (!EQ_CRC32C(checksum, ondisk.checksum))
+		goto unusable;
+
+	CloseTransientFile(fd);
+
+	for (i = 0; i < ondisk.n_lsns; i++)
 	{
-		if (start_lsn > spvector[i].local_lsn &&
-			spvector[i].local_lsn != InvalidXLogRecPtr)
-			start_lsn = spvector[i].local_lsn;
+		if (lsns[i] > base_origin_lsn)
+			RecoveryFilterAdd(filter, node_id, lsns[i]);
 	}
+	pfree(lsns);
 
-	/* create hash */
-	estimate_size = (GetFlushRecPtr() - start_lsn) / 100;
-	estimate_size = Min(Max(estimate_size, 1000), 100000);
-	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = hash_ctl.entrysize = sizeof(FilterEntry);
+	mtm_log(MtmReceiverState,
+			"restored recovery filter of node %d: " UINT64_FORMAT " xacts, range " LSN_FMT "-" LSN_FMT,
+			node_id, ondisk.n_lsns, ondisk.start_lsn, ondisk.end_lsn);
 
-	filter_map = hash_create("filter", estimate_size, &hash_ctl,
-							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	*file_start_lsn = ondisk.start_lsn;
+	return ondisk.end_lsn;
 
+unusable:
+	CloseTransientFile(fd);
+	if (lsns != NULL)
+		pfree(lsns);
 	mtm_log(MtmReceiverState,
-			"load_filter_map from " LSN_FMT " node_id=%d current_last_lsn=" LSN_FMT,
-			start_lsn, filter_node_id, current_last_lsn);
+			"recovery filter file \"%s\" is not usable, ignoring it", path);
+	return InvalidXLogRecPtr;
+}
 
-	Assert(start_lsn != InvalidXLogRecPtr);
-	if (start_lsn == PG_UINT64_MAX)
-		return filter_map;
+/*
+ * Persist filter of node_id, see RecoveryFilterOnDisk. This is just a cache,
+ * so failure is not a reason to stop the receiver.
+ */
+static void
+RecoveryFilterPersist(RecoveryFilter *filter, int node_id, RepOriginId origin_id,
+					  XLogRecPtr base_origin_lsn, XLogRecPtr start_lsn,
+					  XLogRecPtr end_lsn)
+{
+	RecoveryFilterOnDisk ondisk;
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	XLogRecPtr *lsns = filter->lsns[node_id - 1];
+	Size		lsns_size;
+	int			fd;
+
+	Assert(filter->sorted[node_id - 1] || filter->n_lsns[node_id - 1] == 0);
+
+	MemSet(&ondisk, '\0', sizeof(ondisk));
+	ondisk.magic = RECOVERY_FILTER_MAGIC;
+	ondisk.version = RECOVERY_FILTER_VERSION;
+	ondisk.node_id = node_id;
+	ondisk.origin_id = origin_id;
+	ondisk.base_origin_lsn = base_origin_lsn;
+	ondisk.start_lsn = start_lsn;
+	ondisk.end_lsn = end_lsn;
+	ondisk.n_lsns = filter->n_lsns[node_id - 1];
+	lsns_size = ondisk.n_lsns * sizeof(XLogRecPtr);
+
+	INIT_CRC32C(ondisk.checksum);
+	COMP_CRC32C(ondisk.checksum,
+				((char *) &ondisk) + RecoveryFilterOnDiskNotChecksummedSize,
+				sizeof(ondisk) - RecoveryFilterOnDiskNotChecksummedSize);
+	if (lsns_size > 0)
+		COMP_CRC32C(ondisk.checksum, lsns, lsns_size);
+	FIN_CRC32C(ondisk.checksum);
+
+	sprintf(path, "pg_mtm/filter-%d", node_id);
+	sprintf(tmppath, "pg_mtm/filter-%d.tmp.%d", node_id, MyProcPid);
+
+	mkdir("pg_mtm", S_IRWXU);
+	fd = OpenTransientFile(tmppath, O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	if (fd < 0)
+		goto failed;
+
+	errno = 0;
+	if (write(fd, &ondisk, sizeof(ondisk)) != sizeof(ondisk) ||
+		(lsns_size > 0 && write(fd, lsns, lsns_size) != (ssize_t) lsns_size))
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		goto failed;
+	}
+
+	if (pg_fsync(fd) != 0)
+		goto failed;
+	if (CloseTransientFile(fd) != 0)
+	{
+		fd = -1;
+		goto failed;
+	}
+	fd = -1;
+
+	if (rename(tmppath, path) != 0)
+		goto failed;
+	fsync_fname("pg_mtm", true);
+
+	mtm_log(MtmReceiverState,
+			"persisted recovery filter of node %d: " UINT64_FORMAT " xacts, range " LSN_FMT "-" LSN_FMT,
+			node_id, ondisk.n_lsns, start_lsn, end_lsn);
+	return;
+
+failed:
+	{
+		int			save_errno = errno;
+
+		if (fd >= 0)
+			CloseTransientFile(fd);
+		unlink(tmppath);
+		errno = save_errno;
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 MTM_ERRMSG("could not write recovery filter file \"%s\": %m",
+							tmppath)));
+	}
+}
+
+/*
+ * Forget persisted filter of dropped node.
+ */
+void
+RecoveryFilterDrop(int node_id)
+{
+	char		path[MAXPGPATH];
+
+	sprintf(path, "pg_mtm/filter-%d", node_id);
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 MTM_ERRMSG("could not remove recovery filter file \"%s\": %m",
+							path)));
+}
+
+/*
+ * What to collect while scanning WAL for the filter. Lives in DSM when the
+ * scan is parallel.
+ */
+typedef struct RecoveryFilterScanArgs
+{
+	nodemask_t	node_mask;
+	/* origin of node n is origin_ids[n - 1] */
+	RepOriginId origin_ids[MTM_MAX_NODES];
+	/* xact of node n is taken if its origin_lsn > base_origin_lsn[n - 1] */
+	XLogRecPtr	base_origin_lsn[MTM_MAX_NODES];
+	/* ... and its record starts at or after scan_from[n - 1] */
+	XLogRecPtr	scan_from[MTM_MAX_NODES];
+} RecoveryFilterScanArgs;
+
+/* part of WAL [from, to) scanned by one parallel worker */
+typedef struct RecoveryFilterScanChunk
+{
+	XLogRecPtr	from;
+	XLogRecPtr	to;
+} RecoveryFilterScanChunk;
+
+/* worker sends found xacts in batches of these */
+typedef struct RecoveryFilterScanItem
+{
+	XLogRecPtr	origin_lsn;
+	int			node_id;
+} RecoveryFilterScanItem;
+
+typedef void (*RecoveryFilterEmitFn) (int node_id, XLogRecPtr origin_lsn,
+									  void *arg);
+
+#define RECOVERY_FILTER_SCAN_MAGIC 0x5C4A11E5
+#define RECOVERY_FILTER_SCAN_MQ_SIZE (1024 * 1024)
+#define RECOVERY_FILTER_SCAN_BATCH 4096
+
+static void
+recovery_filter_add_emit(int node_id, XLogRecPtr origin_lsn, void *arg)
+{
+	RecoveryFilterAdd((RecoveryFilter *) arg, node_id, origin_lsn);
+}
+
+static XLogReaderState *
+recovery_filter_reader_allocate(void)
+{
+	XLogReaderState *xlogreader;
 
 	xlogreader = XLogReaderAllocate(wal_segment_size,
 									NULL,
@@ -517,23 +744,94 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 				(errcode(ERRCODE_OUT_OF_MEMORY),
 				 errmsg("out of memory"),
 				 errdetail("Failed while allocating a WAL reading processor.")));
+	return xlogreader;
+}
+
+/*
+ * Find the first record starting at or after page aligned pageptr, i.e.
+ * skip the tail of record continued from the previous page(s). Returns
+ * limit if there is no such record before it.
+ */
+static XLogRecPtr
+first_record_from(XLogReaderState *xlogreader, XLogRecPtr pageptr,
+				  XLogRecPtr limit)
+{
+	char	   *page = palloc(XLOG_BLCKSZ);
+	XLogRecPtr	result = limit;
+
+	Assert(pageptr % XLOG_BLCKSZ == 0);
+
+	for (; pageptr < limit; pageptr += XLOG_BLCKSZ)
+	{
+		XLogPageHeader hdr = (XLogPageHeader) page;
+		uint32		hdr_size;
+
+		if (read_local_xlog_page(xlogreader, pageptr, SizeOfXLogLongPHD,
+								 pageptr, page) < (int) SizeOfXLogLongPHD)
+			mtm_log(ERROR, "load_filter_map: could not read WAL page at " LSN_FMT,
+					pageptr);
+		hdr_size = XLogPageHeaderSize(hdr);
+
+		if (!(hdr->xlp_info & XLP_FIRST_IS_CONTRECORD))
+		{
+			result = pageptr + hdr_size;
+			break;
+		}
+		if (hdr_size + MAXALIGN(hdr->xlp_rem_len) < XLOG_BLCKSZ)
+		{
+			result = pageptr + hdr_size + MAXALIGN(hdr->xlp_rem_len);
+			break;
+		}
+	}
+
+	pfree(page);
+	return Min(result, limit);
+}
+
+/*
+ * Pass to emit xacts described by args whose records start in local WAL
+ * within [from, to). If exact_from is false, from is a segment boundary
+ * rather than a record start. Returns the end of the last read record; if
+ * none was read, from itself when it is exact and InvalidXLogRecPtr
+ * otherwise, as a segment boundary might be in the middle of a record.
+ */
+static XLogRecPtr
+recovery_filter_scan_range(RecoveryFilterScanArgs *args,
+						   XLogRecPtr from, XLogRecPtr to, bool exact_from,
+						   RecoveryFilterEmitFn emit, void *emit_arg)
+{
+	XLogReaderState *xlogreader;
+	XLogRecPtr	scanned_upto = exact_from ? from : InvalidXLogRecPtr;
+
+	if (from >= to)
+		return scanned_upto;
+
+	xlogreader = recovery_filter_reader_allocate();
 
+	if (!exact_from)
+		from = first_record_from(xlogreader, from, to);
 	/*
 	 * The given start_lsn pointer points to the end of the syncpoint record,
 	 * which is not necessarily the beginning of the next record, if the
 	 * previous record happens to end at a page boundary. Skip over the page
 	 * header in that case to find the next record.
 	 */
-	if (start_lsn % XLOG_BLCKSZ == 0)
+	else if (from % XLOG_BLCKSZ == 0)
 	{
-		if (XLogSegmentOffset(start_lsn, wal_segment_size) == 0)
-			start_lsn += SizeOfXLogLongPHD;
+		if (XLogSegmentOffset(from, wal_segment_size) == 0)
+			from += SizeOfXLogLongPHD;
 		else
-			start_lsn += SizeOfXLogShortPHD;
+			from += SizeOfXLogShortPHD;
+	}
+
+	if (from >= to)
+	{
+		XLogReaderFree(xlogreader);
+		return scanned_upto;
 	}
 
 	/* fill our filter */
-	XLogBeginRead(xlogreader, start_lsn);
+	XLogBeginRead(xlogreader, from);
 	do
 	{
 		XLogRecord *record;
@@ -553,6 +851,10 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 						"load_filter_map: got NULL from XLogReadRecord, breaking");
 			break;
 		}
+		/* belongs to the next chunk */
+		if (xlogreader->ReadRecPtr >= to)
+			break;
+		scanned_upto = xlogreader->EndRecPtr;
 
 		/* skip local records */
 		origin_id = XLogRecGetOrigin(xlogreader);
@@ -560,20 +862,29 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 		if (origin_id == InvalidRepOriginId)
 			continue;
 
+		/*
+		 * skip records from non-mm origins. Could happen if node was
+		 * dropped. Might lead to skipping dropped node xacts on some lagged
+		 * node, but who ever said we support membership changes under load?
+		 */
+		for (node_id = 1; node_id <= MTM_MAX_NODES; node_id++)
+		{
+			if (args->origin_ids[node_id - 1] == origin_id)
+				break;
+		}
+		if (node_id > MTM_MAX_NODES)
+			continue;
+
 		if (XLogRecGetRmid(xlogreader) == RM_XACT_ID)
 		{
 			mtm_log(MtmReceiverFilter,
 					"load_filter_map: process local=%" INT64_MODIFIER "x, origin=%d, node=%d",
-					xlogreader->EndRecPtr, origin_id, origin_id_to_node_id(origin_id, mtm_cfg));
+					xlogreader->EndRecPtr, origin_id, node_id);
 		}
 
-		/* skip records from non-mm origins */
-		node_id = origin_id_to_node_id(origin_id, mtm_cfg);
-		if (node_id < 0)
-			continue;
-
-		/* if asked collect records only for a given node */
-		if (filter_node_id != MtmInvalidNodeId && filter_node_id != node_id)
+		/* collect records only for asked nodes not covered by persisted filter */
+		if (!BIT_CHECK(args->node_mask, node_id - 1) ||
+			xlogreader->ReadRecPtr < args->scan_from[node_id - 1])
 			continue;
 
 		/* XXX: also cover standalone messages */
@@ -581,12 +892,7 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 		if (XLogRecGetRmid(xlogreader) == RM_XACT_ID)
 		{
 			uint32		info = XLogRecGetInfo(xlogreader);
-			FilterEntry entry;
-			bool		found;
-
-			memset(&entry, '\0', sizeof(FilterEntry));
-			entry.node_id = node_id;
-			entry.origin_lsn = InvalidXLogRecPtr;
+			XLogRecPtr	origin_lsn = InvalidXLogRecPtr;
 
 			switch (info & XLOG_XACT_OPMASK)
 			{
@@ -595,7 +901,7 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 						xl_xact_parsed_commit parsed;
 
 						ParseCommitRecord(info, (xl_xact_commit *) XLogRecGetData(xlogreader), &parsed);
-						entry.origin_lsn = parsed.origin_lsn;
+						origin_lsn = parsed.origin_lsn;
 						break;
 					}
 				case XLOG_XACT_PREPARE:
@@ -603,7 +909,7 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 						xl_xact_parsed_prepare parsed;
 
 						ParsePrepareRecord(info, (xl_xact_prepare *) XLogRecGetData(xlogreader), &parsed);
-						entry.origin_lsn = parsed.origin_lsn;
+						origin_lsn = parsed.origin_lsn;
 						gid = parsed.twophase_gid;
 						break;
 					}
@@ -612,7 +918,7 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 						xl_xact_parsed_commit parsed;
 
 						ParseCommitRecord(info, (xl_xact_commit *) XLogRecGetData(xlogreader), &parsed);
-						entry.origin_lsn = parsed.origin_lsn;
+						origin_lsn = parsed.origin_lsn;
 						gid = parsed.twophase_gid;
 						break;
 					}
@@ -621,7 +927,7 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 						xl_xact_parsed_abort parsed;
 
 						ParseAbortRecord(info, (xl_xact_abort *) XLogRecGetData(xlogreader), &parsed);
-						entry.origin_lsn = parsed.origin_lsn;
+						origin_lsn = parsed.origin_lsn;
 						gid = parsed.twophase_gid;
 						break;
 					}
@@ -633,28 +939,931 @@ RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
 			 * Skip record before lsn of filter_vector as we anyway going to
 			 * ignore them later.
 			 */
-			if (entry.origin_lsn <= spvector[node_id - 1].origin_lsn)
+			if (origin_lsn <= args->base_origin_lsn[node_id - 1])
 				continue;
 
-			Assert(entry.origin_lsn != InvalidXLogRecPtr);
+			Assert(origin_lsn != InvalidXLogRecPtr);
 			mtm_log(MtmReceiverFilter, "load_filter_map: add {%d, %" INT64_MODIFIER "x } xact_opmask=%d local_lsn=%" INT64_MODIFIER "x, gid=%s",
-					entry.node_id, entry.origin_lsn, info & XLOG_XACT_OPMASK, xlogreader->EndRecPtr, gid);
-			hash_search(filter_map, &entry, HASH_ENTER, &found);
+					node_id, origin_lsn, info & XLOG_XACT_OPMASK, xlogreader->EndRecPtr, gid);
+			emit(node_id, origin_lsn, emit_arg);
 			/*
-			 * Note: we used to have Assert(!found) here, but tests showed
-			 * that empty (without changes) transaction commit does *not*
-			 * advance GetFlushRecPtr, though physically written if xid was
-			 * issued (and applier always acquired xid). This means such xact
-			 * sometimes doesn't get into filter as we read WAL only up to
-			 * GetFlushRecPtr, so later we get it second time. This is
+			 * Note: we used to assert the lsn is not in the filter yet, but
+			 * tests showed that empty (without changes) transaction commit
+			 * does *not* advance GetFlushRecPtr, though physically written if
+			 * xid was issued (and applier always acquired xid). This means
+			 * such xact sometimes doesn't get into filter as we read WAL only
+			 * up to GetFlushRecPtr, so later we get it second time. This is
 			 * harmless as applying empty xact does nothing to the database,
 			 * but the assertion would be violated. And empty xacts
 			 * replication became quite common since plain commits streaming
 			 * was enabled for syncpoints sake; e.g. vacuum creates one.
+			 * Duplicates are squashed by RecoveryFilterSort.
 			 */
 		}
-	} while (xlogreader->EndRecPtr < current_last_lsn);
+	} while (xlogreader->EndRecPtr < to);
 
 	XLogReaderFree(xlogreader);
-	return filter_map;
+	return scanned_upto;
+}
+
+/*
+ * Scan [start_lsn, end_lsn) split at segment boundaries in n_chunks pieces
+ * by background workers, collecting results into filter. Returns false if
+ * workers couldn't be started, nothing is added to filter then.
+ */
+static bool
+recovery_filter_scan_parallel(RecoveryFilter *filter, RecoveryFilterScanArgs *args,
+							  XLogRecPtr start_lsn, XLogRecPtr end_lsn,
+							  int n_chunks, XLogRecPtr *scanned_upto)
+{
+	shm_toc_estimator e;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	RecoveryFilterScanArgs *shared_args;
+	RecoveryFilterScanChunk *chunks;
+	shm_mq_handle **mqhs;
+	BackgroundWorkerHandle **handles;
+	bool	   *done;
+	int			n_done = 0;
+	XLogSegNo	start_segno,
+				end_segno;
+	uint64		n_segs;
+	int			i;
+
+	XLByteToSeg(start_lsn, start_segno, wal_segment_size);
+	XLByteToSeg(end_lsn - 1, end_segno, wal_segment_size);
+	n_segs = end_segno - start_segno + 1;
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, sizeof(RecoveryFilterScanArgs));
+	shm_toc_estimate_chunk(&e, n_chunks * sizeof(RecoveryFilterScanChunk));
+	for (i = 0; i < n_chunks; i++)
+		shm_toc_estimate_chunk(&e, RECOVERY_FILTER_SCAN_MQ_SIZE);
+	shm_toc_estimate_keys(&e, 2 + n_chunks);
+
+	seg = dsm_create(shm_toc_estimate(&e), 0);
+	toc = shm_toc_create(RECOVERY_FILTER_SCAN_MAGIC, dsm_segment_address(seg),
+						 shm_toc_estimate(&e));
+
+	shared_args = shm_toc_allocate(toc, sizeof(RecoveryFilterScanArgs));
+	memcpy(shared_args, args, sizeof(RecoveryFilterScanArgs));
+	shm_toc_insert(toc, 0, shared_args);
+
+	chunks = shm_toc_allocate(toc, n_chunks * sizeof(RecoveryFilterScanChunk));
+	for (i = 0; i < n_chunks; i++)
+	{
+		if (i == 0)
+			chunks[i].from = start_lsn;
+		else
+			XLogSegNoOffsetToRecPtr(start_segno + n_segs * i / n_chunks, 0,
+									wal_segment_size, chunks[i].from);
+		if (i > 0)
+			chunks[i - 1].to = chunks[i].from;
+	}
+	chunks[n_chunks - 1].to = end_lsn;
+	shm_toc_insert(toc, 1, chunks);
+
+	mqhs = palloc0(n_chunks * sizeof(shm_mq_handle *));
+	handles = palloc0(n_chunks * sizeof(BackgroundWorkerHandle *));
+	done = palloc0(n_chunks * sizeof(bool));
+
+	for (i = 0; i < n_chunks; i++)
+	{
+		BackgroundWorker worker;
+		shm_mq	   *mq;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, RECOVERY_FILTER_SCAN_MQ_SIZE),
+						   RECOVERY_FILTER_SCAN_MQ_SIZE);
+		shm_toc_insert(toc, 2 + i, mq);
+		shm_mq_set_receiver(mq, MyProc);
+		mqhs[i] = shm_mq_attach(mq, seg, NULL);
+
+		MemSet(&worker, 0, sizeof(BackgroundWorker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		worker.bgw_notify_pid = MyProcPid;
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+		sprintf(worker.bgw_library_name, "multimaster");
+		sprintf(worker.bgw_function_name, "RecoveryFilterScanWorkerMain");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "mtm-filter-scan-%d", i + 1);
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+		{
+			int			j;
+
+			ereport(WARNING,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 MTM_ERRMSG("failed to start recovery filter scan worker, scanning WAL serially"),
+					 errhint("You might need to increase max_worker_processes.")));
+			for (j = 0; j < i; j++)
+				TerminateBackgroundWorker(handles[j]);
+			dsm_detach(seg);
+			return false;
+		}
+		shm_mq_set_handle(mqhs[i], handles[i]);
+	}
+
+	mtm_log(MtmReceiverState,
+			"load_filter_map: scanning " UINT64_FORMAT " segments with %d workers",
+			n_segs, n_chunks);
+
+	while (n_done < n_chunks)
+	{
+		bool		got_any = false;
+
+		for (i = 0; i < n_chunks; i++)
+		{
+			shm_mq_result res;
+			Size		len;
+			void	   *data;
+
+			if (done[i])
+				continue;
+
+			res = shm_mq_receive(mqhs[i], &len, &data, true);
+			if (res == SHM_MQ_WOULD_BLOCK)
+				continue;
+			if (res == SHM_MQ_DETACHED)
+				mtm_log(ERROR, "recovery filter scan worker %d exited prematurely",
+						i + 1);
+
+			got_any = true;
+			if (len == sizeof(XLogRecPtr))
+			{
+				XLogRecPtr	chunk_upto;
+
+				/*
+				 * end of work, with the end of last scanned record; chunk
+				 * without records doesn't move it
+				 */
+				memcpy(&chunk_upto, data, sizeof(XLogRecPtr));
+				if (chunk_upto != InvalidXLogRecPtr)
+					*scanned_upto = Max(*scanned_upto, chunk_upto);
+				done[i] = true;
+				n_done++;
+			}
+			else
+			{
+				RecoveryFilterScanItem *items = (RecoveryFilterScanItem *) data;
+				int			j;
+
+				Assert(len % sizeof(RecoveryFilterScanItem) == 0);
+				for (j = 0; j < (int) (len / sizeof(RecoveryFilterScanItem)); j++)
+					RecoveryFilterAdd(filter, items[j].node_id,
+									  items[j].origin_lsn);
+			}
+		}
+
+		if (!got_any && n_done < n_chunks)
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, 0,
+							 PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	dsm_detach(seg);
+	return true;
+}
+
+typedef struct RecoveryFilterScanBatch
+{
+	shm_mq_handle *mqh;
+	int			n_items;
+	RecoveryFilterScanItem items[RECOVERY_FILTER_SCAN_BATCH];
+} RecoveryFilterScanBatch;
+
+static void
+recovery_filter_batch_flush(RecoveryFilterScanBatch *batch)
+{
+	if (batch->n_items == 0)
+		return;
+	if (shm_mq_send(batch->mqh, batch->n_items * sizeof(RecoveryFilterScanItem),
+					batch->items, false) != SHM_MQ_SUCCESS)
+		ereport(FATAL,
+				(MTM_ERRMSG("recovery filter scan leader has gone away")));
+	batch->n_items = 0;
+}
+
+static void
+recovery_filter_batch_emit(int node_id, XLogRecPtr origin_lsn, void *arg)
+{
+	RecoveryFilterScanBatch *batch = (RecoveryFilterScanBatch *) arg;
+
+	batch->items[batch->n_items].node_id = node_id;
+	batch->items[batch->n_items].origin_lsn = origin_lsn;
+	if (++batch->n_items == RECOVERY_FILTER_SCAN_BATCH)
+		recovery_filter_batch_flush(batch);
+}
+
+void
+RecoveryFilterScanWorkerMain(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	RecoveryFilterScanArgs *args;
+	RecoveryFilterScanChunk *chunk;
+	RecoveryFilterScanBatch *batch;
+	shm_mq	   *mq;
+	XLogRecPtr	scanned_upto;
+	int			idx;
+
+	memcpy(&idx, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "mtm filter scan");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 MTM_ERRMSG("could not map recovery filter scan dynamic shared memory segment")));
+	toc = shm_toc_attach(RECOVERY_FILTER_SCAN_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 MTM_ERRMSG("bad magic number in recovery filter scan dynamic shared memory segment")));
+
+	args = shm_toc_lookup(toc, 0, false);
+	chunk = (RecoveryFilterScanChunk *) shm_toc_lookup(toc, 1, false) + idx;
+	mq = shm_toc_lookup(toc, 2 + idx, false);
+	shm_mq_set_sender(mq, MyProc);
+
+	batch = palloc0(sizeof(RecoveryFilterScanBatch));
+	batch->mqh = shm_mq_attach(mq, seg, NULL);
+
+	scanned_upto = recovery_filter_scan_range(args, chunk->from, chunk->to,
+											  idx == 0,
+											  recovery_filter_batch_emit,
+											  batch);
+	recovery_filter_batch_flush(batch);
+	if (shm_mq_send(batch->mqh, sizeof(XLogRecPtr), &scanned_upto, false) !=
+		SHM_MQ_SUCCESS)
+		ereport(FATAL,
+				(MTM_ERRMSG("recovery filter scan leader has gone away")));
+
+	dsm_detach(seg);
+	proc_exit(0);
+}
+
+/*
+ * Add to filter xacts of node_mask origins found in local WAL starting with
+ * start_lsn up to end_lsn. Xact of node n is taken if its origin_lsn is
+ * above base_origin_lsn[n - 1] and its record starts at or after
+ * scan_from[n - 1]. Returns the end of the last read record.
+ *
+ * Long ranges are split at segment boundaries and scanned by
+ * multimaster.recovery_filter_scan_workers background workers.
+ */
+static XLogRecPtr
+RecoveryFilterScan(RecoveryFilter *filter, nodemask_t node_mask,
+				   XLogRecPtr *base_origin_lsn, XLogRecPtr *scan_from,
+				   XLogRecPtr start_lsn, XLogRecPtr end_lsn,
+				   MtmConfig *mtm_cfg)
+{
+	RecoveryFilterScanArgs args;
+	XLogRecPtr	scanned_upto = start_lsn;
+	XLogSegNo	start_segno,
+				end_segno;
+	int			i;
+
+	mtm_log(MtmReceiverState,
+			"load_filter_map from " LSN_FMT " node_mask=%s current_last_lsn=" LSN_FMT,
+			start_lsn, maskToString(node_mask), end_lsn);
+
+	if (start_lsn >= end_lsn)
+		return start_lsn;
+
+	MemSet(&args, 0, sizeof(args));
+	args.node_mask = node_mask;
+	for (i = 0; i < MTM_MAX_NODES; i++)
+		args.origin_ids[i] = InvalidRepOriginId;
+	for (i = 0; i < mtm_cfg->n_nodes; i++)
+		args.origin_ids[mtm_cfg->nodes[i].node_id - 1] = mtm_cfg->nodes[i].origin_id;
+	memcpy(args.base_origin_lsn, base_origin_lsn, sizeof(args.base_origin_lsn));
+	memcpy(args.scan_from, scan_from, sizeof(args.scan_from));
+
+	XLByteToSeg(start_lsn, start_segno, wal_segment_size);
+	XLByteToSeg(end_lsn - 1, end_segno, wal_segment_size);
+	if (MtmRecoveryFilterScanWorkers > 1 && end_segno > start_segno)
+	{
+		int			n_chunks = (int) Min((uint64) MtmRecoveryFilterScanWorkers,
+										 end_segno - start_segno + 1);
+
+		if (recovery_filter_scan_parallel(filter, &args, start_lsn, end_lsn,
+										  n_chunks, &scanned_upto))
+			return scanned_upto;
+	}
+
+	return recovery_filter_scan_range(&args, start_lsn, end_lsn, true,
+									  recovery_filter_add_emit, filter);
+}
+
+/*
+ * Load filter: restore persisted part and scan local WAL written after it.
+ */
+RecoveryFilter *
+RecoveryFilterLoad(int filter_node_id, Syncpoint *spvector, MtmConfig *mtm_cfg)
+{
+	RecoveryFilter *filter = palloc0(sizeof(RecoveryFilter));
+	XLogRecPtr	start_lsn = PG_UINT64_MAX;
+	XLogRecPtr	scan_start_lsn;
+	XLogRecPtr	current_last_lsn;
+	XLogRecPtr	scanned_upto;
+	XLogRecPtr	base_origin_lsn[MTM_MAX_NODES];
+	XLogRecPtr	scan_from[MTM_MAX_NODES];
+	XLogRecPtr	file_start_lsn[MTM_MAX_NODES];
+	nodemask_t	node_mask = 0;
+	int			i;
+
+	/* ensure we will scan everything written up to this point, just in case */
+	XLogFlush(GetXLogWriteRecPtr());
+	current_last_lsn = GetFlushRecPtr();
+
+	Assert(current_last_lsn != InvalidXLogRecPtr);
+
+	/* start from minimal among all of syncpoints */
+	for (i = 0; i < MTM_MAX_NODES; i++)
+	{
+		if (start_lsn > spvector[i].local_lsn &&
+			spvector[i].local_lsn != InvalidXLogRecPtr)
+			start_lsn = spvector[i].local_lsn;
+		base_origin_lsn[i] = spvector[i].origin_lsn;
+	}
+
+	Assert(start_lsn != InvalidXLogRecPtr);
+	if (start_lsn == PG_UINT64_MAX)
+		return filter;
+
+	/*
+	 * Take what we can from persisted filters. Right after basebackup files
+	 * in pg_mtm/ belong to the donor and describe its WAL, so don't trust
+	 * them then.
+	 */
+	scan_start_lsn = current_last_lsn;
+	for (i = 0; i < mtm_cfg->n_nodes; i++)
+	{
+		int			node_id = mtm_cfg->nodes[i].node_id;
+		XLogRecPtr	from = InvalidXLogRecPtr;
+
+		/* if asked collect records only for a given node */
+		if (filter_node_id != MtmInvalidNodeId && filter_node_id != node_id)
+			continue;
+		BIT_SET(node_mask, node_id - 1);
+
+		file_start_lsn[node_id - 1] = start_lsn;
+		if (mtm_cfg->backup_node_id <= 0)
+			from = RecoveryFilterRestore(filter, node_id,
+										 mtm_cfg->nodes[i].origin_id,
+										 base_origin_lsn[node_id - 1],
+										 start_lsn,
+										 &file_start_lsn[node_id - 1]);
+		from = Max(from, start_lsn);
+		scan_from[node_id - 1] = from;
+		scan_start_lsn = Min(scan_start_lsn, from);
+	}
+
+	scanned_upto = RecoveryFilterScan(filter, node_mask, base_origin_lsn,
+									  scan_from, scan_start_lsn,
+									  current_last_lsn, mtm_cfg);
+	RecoveryFilterSort(filter);
+
+	for (i = 0; i < mtm_cfg->n_nodes; i++)
+	{
+		int			node_id = mtm_cfg->nodes[i].node_id;
+
+		if (BIT_CHECK(node_mask, node_id - 1))
+			RecoveryFilterPersist(filter, node_id, mtm_cfg->nodes[i].origin_id,
+								  base_origin_lsn[node_id - 1],
+								  file_start_lsn[node_id - 1],
+								  Max(scanned_upto, scan_from[node_id - 1]));
+	}
+
+	return filter;
+}
+
+/*
+ * Bring persisted filter of node_id up to date by scanning WAL written since
+ * the filter was saved, and drop xacts the syncpoint at origin_lsn covers.
+ * Keeps the tail to scan at receiver start roughly one syncpoint interval
+ * long. Does nothing if there is no usable file, the next RecoveryFilterLoad
+ * will create it.
+ */
+static void
+RecoveryFilterCheckpoint(int node_id, XLogRecPtr origin_lsn, MtmConfig *mtm_cfg)
+{
+	RecoveryFilter *filter;
+	MtmNode    *node = MtmNodeById(mtm_cfg, node_id);
+	XLogRecPtr	base_origin_lsn[MTM_MAX_NODES];
+	XLogRecPtr	scan_from[MTM_MAX_NODES];
+	XLogRecPtr	start_lsn = InvalidXLogRecPtr;
+	XLogRecPtr	current_last_lsn;
+	XLogRecPtr	scanned_upto;
+	nodemask_t	node_mask = 0;
+
+	if (node == NULL || mtm_cfg->backup_node_id > 0)
+		return;
+
+	XLogFlush(GetXLogWriteRecPtr());
+	current_last_lsn = GetFlushRecPtr();
+
+	filter = palloc0(sizeof(RecoveryFilter));
+	MemSet(base_origin_lsn, 0, sizeof(base_origin_lsn));
+	MemSet(scan_from, 0, sizeof(scan_from));
+	base_origin_lsn[node_id - 1] = origin_lsn;
+	BIT_SET(node_mask, node_id - 1);
+
+	/* any start of the range will do */
+	scan_from[node_id - 1] = RecoveryFilterRestore(filter, node_id,
+												   node->origin_id,
+												   origin_lsn, PG_UINT64_MAX,
+												   &start_lsn);
+	if (scan_from[node_id - 1] != InvalidXLogRecPtr)
+	{
+		scanned_upto = RecoveryFilterScan(filter, node_mask, base_origin_lsn,
+										  scan_from, scan_from[node_id - 1],
+										  current_last_lsn, mtm_cfg);
+		RecoveryFilterSort(filter);
+		RecoveryFilterPersist(filter, node_id, node->origin_id, origin_lsn,
+							  start_lsn, scanned_upto);
+	}
+	RecoveryFilterFree(filter);
+}
+
+/*
+ * Called by applier when syncpoint of node_id is registered. The checkpoint
+ * itself scans all WAL since the previous one, so it is done later by the
+ * monitor instead of stalling apply; if several syncpoints arrive meanwhile,
+ * only the latest one matters.
+ */
+void
+RecoveryFilterRequestCheckpoint(int node_id, XLogRecPtr origin_lsn)
+{
+	pg_atomic_uint64 *pending = &Mtm->peers[node_id - 1].filter_checkpoint_lsn;
+	uint64		old = pg_atomic_read_u64(pending);
+
+	while (old < origin_lsn &&
+		   !pg_atomic_compare_exchange_u64(pending, &old, origin_lsn))
+		;
+}
+
+/*
+ * Do checkpoints requested since the last call, at most once in
+ * RECOVERY_FILTER_CHECKPOINT_INTERVAL. Called from monitor's loop.
+ */
+void
+RecoveryFilterCheckpointPending(MtmConfig *mtm_cfg)
+{
+	static TimestampTz last_checkpoint = 0;
+	TimestampTz now = GetCurrentTimestamp();
+	int			i;
+
+	if (!TimestampDifferenceExceeds(last_checkpoint, now,
+									RECOVERY_FILTER_CHECKPOINT_INTERVAL))
+		return;
+	last_checkpoint = now;
+
+	for (i = 0; i < mtm_cfg->n_nodes; i++)
+	{
+		int			node_id = mtm_cfg->nodes[i].node_id;
+		XLogRecPtr	origin_lsn;
+
+		origin_lsn = pg_atomic_exchange_u64(&Mtm->peers[node_id - 1].filter_checkpoint_lsn,
+											0);
+		if (origin_lsn != InvalidXLogRecPtr)
+			RecoveryFilterCheckpoint(node_id, origin_lsn, mtm_cfg);
+	}
+}
+
+static int
+lsn_cmp(const void *a, const void *b)
+{
+	XLogRecPtr	lsn1 = *(const XLogRecPtr *) a;
+	XLogRecPtr	lsn2 = *(const XLogRecPtr *) b;
+
+	if (lsn1 < lsn2)
+		return -1;
+	return lsn1 > lsn2 ? 1 : 0;
+}
+
+void
+RecoveryFilterAdd(RecoveryFilter *filter, int node_id, XLogRecPtr origin_lsn)
+{
+	int			k = node_id - 1;
+	int			n = filter->n_lsns[k];
+
+	Assert(node_id > 0 && node_id <= MTM_MAX_NODES);
+
+	if (n == filter->size[k])
+	{
+		filter->size[k] = n == 0 ? 1024 : n * 2;
+		filter->lsns[k] = n == 0 ?
+			palloc(filter->size[k] * sizeof(XLogRecPtr)) :
+			repalloc_huge(filter->lsns[k], filter->size[k] * sizeof(XLogRecPtr));
+	}
+
+	/*
+	 * Appliers of a single origin commit out of order only slightly (parallel
+	 * workers), so usually we can avoid sorting at all.
+	 */
+	if (n == 0)
+		filter->sorted[k] = true;
+	else if (origin_lsn <= filter->lsns[k][n - 1])
+		filter->sorted[k] = false;
+	filter->lsns[k][n] = origin_lsn;
+	filter->n_lsns[k]++;
+}
+
+/*
+ * Prepare filter for lookups: sort and dedup per origin lsns.
+ */
+void
+RecoveryFilterSort(RecoveryFilter *filter)
+{
+	int			k;
+
+	for (k = 0; k < MTM_MAX_NODES; k++)
+	{
+		XLogRecPtr *lsns = filter->lsns[k];
+		int			i,
+					j;
+
+		filter->cursor[k] = 0;
+		if (filter->sorted[k] || filter->n_lsns[k] == 0)
+			continue;
+
+		qsort(lsns, filter->n_lsns[k], sizeof(XLogRecPtr), lsn_cmp);
+		for (i = 1, j = 0; i < filter->n_lsns[k]; i++)
+		{
+			if (lsns[i] != lsns[j])
+				lsns[++j] = lsns[i];
+		}
+		filter->n_lsns[k] = j + 1;
+		filter->sorted[k] = true;
+	}
+}
+
+/*
+ * Is xact of node_id with given origin_lsn in the filter?
+ *
+ * Xacts are received roughly in origin_lsn order, so start from the cursor
+ * left by the previous lookup and gallop forward; go back to plain binary
+ * search over the passed part if the lsn is behind the cursor.
+ */
+bool
+RecoveryFilterContains(RecoveryFilter *filter, int node_id,
+					   XLogRecPtr origin_lsn)
+{
+	int			k = node_id - 1;
+	XLogRecPtr *lsns = filter->lsns[k];
+	int			n = filter->n_lsns[k];
+	int			lo = filter->cursor[k];
+	int			hi;
+	int			step;
+
+	Assert(node_id > 0 && node_id <= MTM_MAX_NODES);
+	Assert(filter->sorted[k] || n == 0);
+
+	if (n == 0)
+		return false;
+
+	if (lo > 0 && lsns[lo - 1] >= origin_lsn)
+	{
+		/* went backwards */
+		hi = lo;
+		lo = 0;
+	}
+	else
+	{
+		/* find hi such that lsns[hi] >= origin_lsn, doubling the step */
+		for (step = 1, hi = lo; hi < n && lsns[hi] < origin_lsn; step *= 2)
+		{
+			lo = hi + 1;
+			hi = Min(hi + step, n);
+		}
+	}
+
+	/* now first lsn >= origin_lsn is in [lo, hi] */
+	while (lo < hi)
+	{
+		int			mid = lo + (hi - lo) / 2;
+
+		if (lsns[mid] < origin_lsn)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < n && lsns[lo] == origin_lsn)
+	{
+		filter->cursor[k] = lo + 1;
+		return true;
+	}
+	filter->cursor[k] = lo;
+	return false;
+}
+
+void
+RecoveryFilterFree(RecoveryFilter *filter)
+{
+	int			k;
+
+	for (k = 0; k < MTM_MAX_NODES; k++)
+	{
+		if (filter->lsns[k] != NULL)
+			pfree(filter->lsns[k]);
+	}
+	pfree(filter);
+}
+
+/*
+ * Encode recovery filter for passing it to the sender in START_REPLICATION
+ * options. Format is ';'-separated list of per-origin entries
+ *
+ *   node_id:sp_origin_lsn[:lsn,delta,delta...]
+ *
+ * where applied xact lsns are delta-encoded, all numbers are hex.
+ * To keep replication command reasonably sized, at most
+ * SENDER_FILTER_MAX_LSNS lsns are sent; that's safe as receiver filters
+ * everything on its own anyway, and the lowest lsns which will be streamed
+ * first are preferred.
+ */
+char *
+SenderFilterEncode(RecoveryFilter *filter, Syncpoint *spvector)
+{
+	StringInfoData str;
+	int			n_origins = 0;
+	int			per_origin_max;
+	int			i;
+
+	for (i = 0; i < MTM_MAX_NODES; i++)
+	{
+		if (spvector[i].local_lsn != InvalidXLogRecPtr)
+			n_origins++;
+	}
+	per_origin_max = SENDER_FILTER_MAX_LSNS / Max(n_origins, 1);
+
+	initStringInfo(&str);
+	for (i = 0; i < MTM_MAX_NODES; i++)
+	{
+		int			j;
+
+		/* no filter slot, receiver skips all xacts of this origin */
+		if (spvector[i].local_lsn == InvalidXLogRecPtr)
+			continue;
+
+		if (str.len > 0)
+			appendStringInfoChar(&str, ';');
+		appendStringInfo(&str, "%d:%" INT64_MODIFIER "X",
+						 i + 1, spvector[i].origin_lsn);
+
+		for (j = 0; j < Min(filter->n_lsns[i], per_origin_max); j++)
+		{
+			XLogRecPtr *lsns = filter->lsns[i];
+
+			appendStringInfo(&str, "%c%" INT64_MODIFIER "X",
+							 j == 0 ? ':' : ',',
+							 j == 0 ? lsns[j] : lsns[j] - lsns[j - 1]);
+		}
+	}
+
+	return str.data;
+}
+
+/*
+ * Parse string produced by SenderFilterEncode.
+ */
+SenderFilter *
+SenderFilterDecode(const char *str)
+{
+	SenderFilter *sf = palloc0(sizeof(SenderFilter));
+	const char *p = str;
+
+	while (*p != '\0')
+	{
+		char	   *end;
+		long		node_id;
+		int			k;
+
+		node_id = strtol(p, &end, 10);
+		if (end == p || *end != ':' || node_id <= 0 || node_id > MTM_MAX_NODES)
+			goto malformed;
+		k = node_id - 1;
+		p = end + 1;
+
+		sf->known[k] = true;
+		sf->sp_origin_lsn[k] = strtoull(p, &end, 16);
+		if (end == p)
+			goto malformed;
+		p = end;
+
+		if (*p == ':')
+		{
+			XLogRecPtr	lsn = InvalidXLogRecPtr;
+
+			do
+			{
+				p++;
+				lsn += strtoull(p, &end, 16);
+				if (end == p)
+					goto malformed;
+				p = end;
+
+				RecoveryFilterAdd(&sf->applied, node_id, lsn);
+			} while (*p == ',');
+		}
+
+		if (*p == ';')
+			p++;
+		else if (*p != '\0')
+			goto malformed;
+	}
+	RecoveryFilterSort(&sf->applied);
+	return sf;
+
+malformed:
+	mtm_log(ERROR, "malformed recovery filter at position %d: \"%s\"",
+			(int) (p - str), str);
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Does receiver already have xact of origin_node with tx_lsn (see
+ * MtmFilterTransaction for its meaning)?
+ */
+bool
+SenderFilterMatch(SenderFilter *sf, int origin_node, XLogRecPtr tx_lsn)
+{
+	int			k = origin_node - 1;
+
+	Assert(origin_node > 0 && origin_node <= MTM_MAX_NODES);
+
+	if (!sf->known[k])
+		return true;
+	if (tx_lsn <= sf->sp_origin_lsn[k])
+		return true;
+	return RecoveryFilterContains(&sf->applied, origin_node, tx_lsn);
+}
+
+/*
+ * Benchmark of RecoveryFilter against dynahash keyed by {node_id, lsn} we
+ * used to have for that, on synthetic filter with n_xacts per each of
+ * n_origins. Lsns of an origin are mostly ascending with some neighbours
+ * swapped, as parallel appliers produce them. Lookups go in the receiving
+ * order, every xact is looked up along with one missing lsn.
+ *
+ * Test only: it is not declared by the extension, t/010_recovery_filter.pl
+ * creates the SQL function itself.
+ */
+typedef struct
+{
+	int			node_id;
+	XLogRecPtr	origin_lsn;
+} BenchFilterEntry;
+
+Datum
+mtm_recovery_filter_bench(PG_FUNCTION_ARGS)
+{
+	int			n_origins = PG_GETARG_INT32(0);
+	int			n_xacts = PG_GETARG_INT32(1);
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6] = {0};
+	MemoryContext bench_ctx;
+	MemoryContext oldcontext;
+	XLogRecPtr *lsns;
+	RecoveryFilter *filter;
+	HTAB	   *filter_map;
+	HASHCTL		hash_ctl;
+	instr_time	start,
+				duration;
+	uint64		seed = 42;
+	Size		filter_bytes;
+	Size		base_bytes;
+	int			i,
+				k;
+
+	if (n_origins <= 0 || n_origins > MTM_MAX_NODES ||
+		n_xacts <= 0 || n_xacts > 10000000)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 MTM_ERRMSG("n_origins must be in 1..%d and n_xacts in 1..10000000",
+							MTM_MAX_NODES)));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	bench_ctx = AllocSetContextCreate(CurrentMemoryContext,
+									  "RecoveryFilterBench",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(bench_ctx);
+
+	/* lsns[i * n_origins + k] is i-th received xact of origin k */
+	lsns = palloc_extended((Size) n_xacts * n_origins * sizeof(XLogRecPtr),
+						   MCXT_ALLOC_HUGE);
+	for (k = 0; k < n_origins; k++)
+	{
+		XLogRecPtr	lsn = 0x1000000;
+
+		for (i = 0; i < n_xacts; i++)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			/* leave gaps for the misses */
+			lsn += 2 + (seed >> 33) % 512;
+			lsns[(Size) i * n_origins + k] = lsn;
+			if (i > 0 && (seed >> 60) == 0)
+			{
+				Size		cur = (Size) i * n_origins + k;
+				Size		prev = cur - n_origins;
+				XLogRecPtr	tmp = lsns[cur];
+
+				lsns[cur] = lsns[prev];
+				lsns[prev] = tmp;
+			}
+		}
+	}
+
+	/* RecoveryFilter */
+	INSTR_TIME_SET_CURRENT(start);
+	filter = palloc0(sizeof(RecoveryFilter));
+	for (i = 0; i < n_xacts * n_origins; i++)
+		RecoveryFilterAdd(filter, i % n_origins + 1, lsns[i]);
+	RecoveryFilterSort(filter);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	values[1] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(duration));
+
+	filter_bytes = sizeof(RecoveryFilter);
+	for (k = 0; k < n_origins; k++)
+		filter_bytes += filter->size[k] * sizeof(XLogRecPtr);
+	values[0] = Int64GetDatum(filter_bytes);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < n_xacts * n_origins; i++)
+	{
+		if (!RecoveryFilterContains(filter, i % n_origins + 1, lsns[i]) ||
+			RecoveryFilterContains(filter, i % n_origins + 1, lsns[i] + 1))
+			mtm_log(ERROR, "recovery filter lookup of %d/" LSN_FMT " is wrong",
+					i % n_origins + 1, lsns[i]);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	values[2] = Float8GetDatum(INSTR_TIME_GET_MICROSEC(duration) * 1000.0 /
+							   (2.0 * n_xacts * n_origins));
+	RecoveryFilterFree(filter);
+
+	/* dynahash, sized the way RecoveryFilterLoad used to do it */
+	base_bytes = MemoryContextMemAllocated(bench_ctx, true);
+	INSTR_TIME_SET_CURRENT(start);
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = hash_ctl.entrysize = sizeof(BenchFilterEntry);
+	hash_ctl.hcxt = bench_ctx;
+	filter_map = hash_create("filter bench", Min((Size) n_xacts * n_origins, 100000),
+							 &hash_ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	for (i = 0; i < n_xacts * n_origins; i++)
+	{
+		BenchFilterEntry entry;
+
+		memset(&entry, '\0', sizeof(entry));
+		entry.node_id = i % n_origins + 1;
+		entry.origin_lsn = lsns[i];
+		hash_search(filter_map, &entry, HASH_ENTER, NULL);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	values[4] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(duration));
+
+	values[3] = Int64GetDatum(MemoryContextMemAllocated(bench_ctx, true) -
+							  base_bytes);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < n_xacts * n_origins; i++)
+	{
+		BenchFilterEntry entry;
+		bool		found,
+					found_next;
+
+		memset(&entry, '\0', sizeof(entry));
+		entry.node_id = i % n_origins + 1;
+		entry.origin_lsn = lsns[i];
+		hash_search(filter_map, &entry, HASH_FIND, &found);
+		entry.origin_lsn = lsns[i] + 1;
+		hash_search(filter_map, &entry, HASH_FIND, &found_next);
+		if (!found || found_next)
+			mtm_log(ERROR, "hash filter lookup of %d/" LSN_FMT " is wrong",
+					i % n_origins + 1, lsns[i]);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	values[5] = Float8GetDatum(INSTR_TIME_GET_MICROSEC(duration) * 1000.0 /
+							   (2.0 * n_xacts * n_origins));
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(bench_ctx);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
@@ -0,0 +1,48 @@
+# Recovery filter lookups: recovery_filter_bench checks RecoveryFilter
+# answers against every filled in and missing lsn (it errors out otherwise)
+# and compares it with the dynahash we used before on a large filter window.
+# The function is test only and isn't declared by the extension.
+
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 2;
+
+my $cluster = new Cluster(2);
+$cluster->init();
+$cluster->start();
+$cluster->create_mm();
+
+my $node = $cluster->{nodes}->[0];
+
+$node->safe_psql('postgres', q{
+	create function recovery_filter_bench(n_origins int, n_xacts int,
+		out filter_bytes bigint, out filter_build_ms float8,
+		out filter_lookup_ns float8, out hash_bytes bigint,
+		out hash_build_ms float8, out hash_lookup_ns float8)
+	  as 'multimaster', 'mtm_recovery_filter_bench'
+	  language c strict;
+});
+
+# small filters, including a single entry one
+$node->safe_psql('postgres', q{
+	select recovery_filter_bench(1, 1);
+	select recovery_filter_bench(3, 1000);
+});
+pass("recovery filter lookups are correct");
+
+# ~3M xacts to filter, i.e. gigabytes of WAL to recover
+my $res = $node->safe_psql('postgres', q{
+	select filter_bytes, round(filter_build_ms), round(filter_lookup_ns::numeric, 1),
+		   hash_bytes, round(hash_build_ms), round(hash_lookup_ns::numeric, 1)
+	from recovery_filter_bench(3, 1000000);
+});
+my ($filter_bytes, $filter_build_ms, $filter_lookup_ns,
+	$hash_bytes, $hash_build_ms, $hash_lookup_ns) = split(/\|/, $res);
+note("recovery filter: $filter_bytes bytes, build $filter_build_ms ms, lookup $filter_lookup_ns ns");
+note("dynahash:        $hash_bytes bytes, build $hash_build_ms ms, lookup $hash_lookup_ns ns");
+
+cmp_ok($filter_bytes, '<', $hash_bytes, "recovery filter is smaller than dynahash");
+
+$cluster->stop();
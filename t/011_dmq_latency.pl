@@ -0,0 +1,91 @@
+# Commit latency against max_connections. Each multimaster commit makes
+# several round trips through dmq, whose sender used to poll queues of all
+# MaxBackends backends on every message; with the doorbell mask latency
+# shouldn't depend on max_connections much.
+
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 7;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->start();
+$cluster->create_mm();
+
+$cluster->safe_psql(0, q{
+	create table t (k serial primary key, v int);
+});
+
+my $pgbench_script = "${TestLib::tmp_check}/dmq_latency.pgb";
+TestLib::append_to_file($pgbench_script, q{
+	insert into t (v) values (1);
+});
+
+sub commit_latency
+{
+	my ($max_connections) = @_;
+
+	foreach my $node (@{$cluster->{nodes}})
+	{
+		$node->append_conf('postgresql.conf', qq{
+			max_connections = $max_connections
+		});
+	}
+	$cluster->stop();
+	$cluster->start();
+	$cluster->await_nodes([0..$#{$cluster->{nodes}}]);
+	$cluster->safe_psql(0, q{select mtm.stat_commit_phases_reset();});
+
+	my ($out, $err);
+	my $node = $cluster->{nodes}->[0];
+	IPC::Run::run([ 'pgbench', -h => $node->host(), -p => $node->port(),
+					'postgres', '-n', -c => 4, -T => 10,
+					-f => $pgbench_script ],
+				  '>', \$out, '2>', \$err);
+	$out =~ m/number of transactions actually processed: (\d+)/
+	  or BAIL_OUT("can't parse pgbench output: $out $err");
+	my $xacts = $1;
+	$out =~ m/latency average = ([\d.]+) ms/
+	  or BAIL_OUT("can't parse pgbench output: $out $err");
+	note("max_connections = $max_connections: $xacts xacts, latency average $1 ms");
+	return ($1, $xacts);
+}
+
+# Latencies are only reported: wall-clock bounds are flaky on loaded or
+# valgrind machines. max_connections is kept moderate to fit small shm limits.
+my ($small, $small_xacts) = commit_latency(50);
+my ($large, $xacts) = commit_latency(300);
+note(sprintf("latency ratio max_connections 300/50: %.2f", $large / $small));
+
+cmp_ok($small_xacts, '>', 0, "commits went through with max_connections = 50");
+cmp_ok($xacts, '>', 0, "commits went through with max_connections = 300");
+
+# where did the time go
+note($cluster->safe_psql(0, q{
+	select phase, node_id, calls, round(total_ms::numeric / calls, 3), p50_ms, p99_ms
+	from mtm.stat_commit_phases order by phase, node_id;
+}));
+# Stats were reset before the last run, so each commit of it passed every
+# phase. Local phases and prepare acks are timed for each commit on every node
+# involved, while precommit gather stops at quorum and times only the acks
+# which made it, so those are counted across peers.
+my %calls_agg = (
+	prepare => 'max',
+	prepare_acks => 'max',
+	precommit => 'max',
+	precommit_acks => 'sum',
+	commit => 'max',
+);
+foreach my $phase (sort keys %calls_agg)
+{
+	my ($calls, $p50_ms, $p99_ms) = split(/\|/, $cluster->safe_psql(0, qq{
+		select coalesce($calls_agg{$phase}(calls), 0), max(p50_ms), max(p99_ms)
+		from mtm.stat_commit_phases where phase = '$phase';
+	}));
+	ok($calls >= $xacts && $p50_ms <= $p99_ms,
+	   "$phase: $calls calls, p50 $p50_ms ms, p99 $p99_ms ms");
+}
+
+$cluster->stop();
@@ -0,0 +1,71 @@
+# Global tx lookup: gtxes of mm-generated gids live in xid2gtx keyed by
+# (coordinator, xid), explicit 2PC ones in gid2gtx keyed by gid. Check both
+# the lookup itself and explicit 2PC interleaved with ordinary mm commits.
+# Also check state_3pc encoding of every status and ballot and decoding of
+# version 1 records prepared before upgrade. The checks are test only
+# functions not declared by the extension.
+
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 5;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->start();
+$cluster->create_mm();
+
+$cluster->safe_psql(0, q{
+	create function global_tx_lookup_check() returns void
+	  as 'multimaster', 'mtm_global_tx_lookup_check' language c;
+	select global_tx_lookup_check();
+});
+pass("gtx lookup by (coordinator, xid) and by gid is correct");
+
+$cluster->safe_psql(0, q{
+	create function xstate_check() returns void
+	  as 'multimaster', 'mtm_xstate_check' language c;
+	select xstate_check();
+});
+pass("state_3pc round trip and version 1 decoding are correct");
+
+$cluster->safe_psql(0, q{create table t(id int primary key, v int);});
+
+# explicit xacts stay prepared while mm xacts come and go around them
+$cluster->safe_psql(0, q{
+	begin;
+	insert into t values (1, 1);
+	prepare transaction 'user_gid_1';
+});
+$cluster->safe_psql(1, q{
+	begin;
+	insert into t values (2, 2);
+	prepare transaction 'user_gid_2';
+});
+foreach my $i (0..2)
+{
+	$cluster->safe_psql($i, qq{
+		insert into t select g, g from generate_series(100 * ($i + 1), 100 * ($i + 1) + 49) g;
+	});
+}
+
+my $prepared = join(',', map {
+	$cluster->safe_psql($_, q{select count(*) from pg_prepared_xacts where gid like 'user_gid_%';})
+} 0..2);
+is($prepared, '2,2,2', "explicit xacts are prepared on all nodes");
+
+$cluster->safe_psql(0, q{commit prepared 'user_gid_1';});
+$cluster->safe_psql(1, q{rollback prepared 'user_gid_2';});
+
+$prepared = join(',', map {
+	$cluster->safe_psql($_, q{select count(*) from pg_prepared_xacts;})
+} 0..2);
+is($prepared, '0,0,0', "no prepared xacts left");
+
+my $rows = join(',', map {
+	$cluster->safe_psql($_, q{select count(*), sum(v) from t;})
+} 0..2);
+is($rows, join(',', ('151|33676') x 3), "data is the same on all nodes");
+
+$cluster->stop();
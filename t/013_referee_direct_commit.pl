@@ -0,0 +1,55 @@
+# Node online alone in referee granted generation has nobody to agree with,
+# so it commits xacts directly instead of going through 2PC. Check that no
+# commit phase is entered then, and that the peer gets these xacts while
+# recovering.
+
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 5;
+
+my $cluster = new Cluster(2, 1);
+$cluster->init();
+$cluster->start();
+$cluster->create_mm();
+
+$cluster->safe_psql(0, q{create table t(id int primary key);});
+
+# both nodes online: regular 2PC
+$cluster->safe_psql(0, q{select mtm.stat_commit_phases_reset();});
+$cluster->safe_psql(0, q{insert into t values (1);});
+cmp_ok($cluster->safe_psql(0, q{
+	select coalesce(sum(calls), 0) from mtm.stat_commit_phases where phase = 'prepare';
+}), '>', 0, "xact is prepared with both nodes online");
+
+# node2 goes down, node1 gets the referee grant and continues alone
+$cluster->{nodes}->[1]->stop('fast');
+$cluster->await_nodes_after_stop([0]);
+
+$cluster->safe_psql(0, q{select mtm.stat_commit_phases_reset();});
+foreach my $i (2..10)
+{
+	$cluster->safe_psql(0, qq{insert into t values ($i);});
+}
+$cluster->safe_psql(0, q{
+	begin;
+	insert into t values (11);
+	insert into t values (12);
+	commit;
+});
+is($cluster->safe_psql(0, q{select count(*) from t;}), 12,
+   "xacts are committed in referee generation");
+is($cluster->safe_psql(0, q{
+	select coalesce(sum(calls), 0) from mtm.stat_commit_phases;
+}), 0, "xacts are committed directly, without 2PC");
+is($cluster->safe_psql(0, q{select count(*) from pg_prepared_xacts;}), 0,
+   "no prepared xacts left");
+
+# node2 recovers from node1 and gets directly committed xacts
+$cluster->{nodes}->[1]->start();
+$cluster->await_nodes([0, 1]);
+is($cluster->safe_psql(1, q{select count(*), sum(id) from t;}), '12|78',
+   "directly committed xacts are replicated on recovery");
+
+$cluster->stop();
@@ -0,0 +1,74 @@
+# Large xacts exceeding logical_decoding_work_mem are streamed to peers while
+# still in progress (STREAM START/STOP blocks with subxact switches, aborts of
+# subxacts and whole xacts, and FINISH followed by PREPARE), spooled by the
+# receiver and applied on PREPARE.
+
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More;
+
+my $cluster = new Cluster(3);
+$cluster->init(q{
+	logical_decoding_work_mem = 64kB
+	multimaster.stream_in_progress = on
+});
+$cluster->start();
+$cluster->create_mm();
+
+if ($cluster->safe_psql(0, q{show server_version_num;}) < 140000)
+{
+	$cluster->stop();
+	plan skip_all => 'streaming of in-progress xacts is not supported';
+}
+plan tests => 4;
+
+$cluster->safe_psql(0, q{create table t(id int primary key, payload text);});
+
+sub table_state
+{
+	return join(',', map {
+		$cluster->safe_psql($_, q{select count(*), coalesce(sum(id), 0) from t;})
+	} 0..2);
+}
+
+# a few MB, with rolled back and committed subxacts in between
+$cluster->safe_psql(0, q{
+	begin;
+	insert into t select g, repeat('x', 100) from generate_series(1, 20000) g;
+	savepoint s1;
+	insert into t select g, repeat('y', 100) from generate_series(20001, 40000) g;
+	rollback to savepoint s1;
+	savepoint s2;
+	insert into t select g, repeat('z', 100) from generate_series(40001, 60000) g;
+	release savepoint s2;
+	update t set payload = repeat('u', 100) where id % 2 = 0;
+	commit;
+});
+is(table_state(), join(',', ('40000|1200020000') x 3),
+   "streamed xact is applied on all nodes");
+
+# streamed xact aborted before PREPARE is dropped by receivers
+$cluster->safe_psql(0, q{
+	begin;
+	insert into t select g, repeat('a', 100) from generate_series(100001, 120000) g;
+	rollback;
+});
+# and the filter still lets the next one through
+$cluster->safe_psql(0, q{
+	insert into t select g, repeat('b', 100) from generate_series(200001, 220000) g;
+});
+is(table_state(), join(',', ('60000|5400030000') x 3),
+   "aborted streamed xact is not applied");
+
+# slot stats are reported asynchronously
+ok($cluster->poll_query_until(0, q{
+	select coalesce(sum(stream_txns), 0) > 0 from pg_stat_replication_slots;
+}), "xacts went through the stream path");
+
+is(join(',', map {
+	$cluster->safe_psql($_, q{select count(*) from pg_prepared_xacts;})
+} 0..2), '0,0,0', "no prepared xacts left");
+
+$cluster->stop();